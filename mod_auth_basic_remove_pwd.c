@@ -98,13 +98,13 @@ static int fixup_auth_basic_remove_pwd(request_rec *r)
 
     decoded_line = ap_pbase64decode(r->pool, auth_line);
 
-    const char **user;
+    const char *user;
 
-    *user = ap_getword_nulls(r->pool, (const char**)&decoded_line, ':');
+    user = ap_getword_nulls(r->pool, (const char**)&decoded_line, ':');
 
     auth_line = apr_pstrcat(r->pool, "Basic ",
                             ap_pbase64encode(r->pool,
-                                             apr_pstrcat(r->pool, *user,
+                                             apr_pstrcat(r->pool, user,
                                                          ":", "*", NULL)),
                             NULL);
     // Set the appropriate header
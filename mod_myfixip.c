@@ -17,12 +17,62 @@
     v1.2 - 2015.08.06, memory cleanups: bucket and brigades
     v1.3 - 2015.12.27, connection cleanup: non-PROXY partial headers
     v1.4 - 2016.01.06, fix order with mod_security2
+    v1.5 - 2026.10.16, RewriteIPAllow compiled into a CIDR radix trie
+    v1.6 - 2026.10.16, Support for PROXY protocol v2 (binary)
+    v1.7 - 2026.10.16, zero-copy speculative header detection (RewriteIPSpeculative)
+                       filter removes itself once the header is handled
+    v1.8 - 2026.10.16, typed per-connection state (notes export optional: RewriteIPExportNotes)
+    v1.9 - 2026.10.16, resolver-free IPv4/IPv6 rewrite, reused across keepalive requests
+    v2.0 - 2026.10.16, per-listener PROXY policy (RewriteIPProxyProtocol)
+                       per-vhost RewriteIPAllow (identical lists share compiled trie)
+    v2.1 - 2026.10.16, shared memory counters and header latency histogram
+                       (handler myfixip-status: Prometheus text or JSON)
+                       statistics slot owned by one live child (claimed by pid,
+                       released on child exit)
+    v2.2 - 2026.10.16, header phase honors non-blocking reads (APR_EAGAIN)
+                       header deadline (RewriteIPHeaderTimeout)
+                       APR_TIMEUP is a header timeout only past RewriteIPHeaderTimeout
+    v2.3 - 2026.10.16, TEST answers OK/DRAIN/BUSY with worker counts (RewriteIPTestStatus)
+    v2.4 - 2026.10.16, trace ring buffer in shared memory replaces DEBUG logging
+                       (RewriteIPTrace, handler myfixip-trace)
+                       trace ring owned by one live child (claimed by pid)
+                       sampling changed by POST only, raw dump (?raw)
+    v2.5 - 2026.10.16, single pass PROXY v1 parser (SSE2/AVX2 separator scan)
+                       strict address/port validation, PROXY UNKNOWN accepted
+                       MYFIXIP_SIMD selects the PROXY v1 separator scan
+    v2.6 - 2026.10.16, PROXY v2 TLVs decoded on demand (optional functions,
+                       ap_expr variables, %{VAR}^pp log format, RewriteIPProxyEnv)
+    v2.7 - 2026.10.16, optional functions for original/rewritten address, trust
+                       and source (mod_myfixip.h)
+    v2.8 - 2026.10.16, configurable client header (RewriteIPClientHeader)
+                       X-Forwarded-For / Forwarded walk over trusted hops
+                       (RewriteIPForwardedHeader)
+    v2.9 - 2026.10.16, PROXY v1/v2 header sent on mod_proxy backend connections
+                       (RewriteIPProxySend)
+                       client of the request kept per thread until it ends
+                       backend connection reused only for the client it announced
+    v3.0 - 2026.10.16, shared memory penalty box for peers sending bad headers
+                       (RewriteIPPenalty)
+                       invalid and overflowing headers only (not timeouts)
+                       keyed on the full IPv4 address or IPv6 /64 with its family
+    v3.1 - 2026.10.16, concurrent connections and request rate limits by real
+                       client (RewriteIPClientLimit)
+                       client table keyed like the penalty box (full address)
 
     = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
     In HTTP (no SSL): this will fix "useragent_ip" field if the request
-    contains an "X-Cluster-Client-Ip" header field, and the request came
-    directly from a one of the IP Addresses specified in the configuration
-    file (RewriteIPAllow directive).
+    contains an "X-Cluster-Client-Ip" header field (RewriteIPClientHeader),
+    and the request came directly from a one of the IP Addresses specified
+    in the configuration file (RewriteIPAllow directive).
+
+    With RewriteIPForwardedHeader (X-Forwarded-For, or RFC 7239 Forwarded
+    "for=" parameters) the list is walked from the right while hops are
+    in RewriteIPAllow: the first untrusted hop is the client (or the
+    leftmost one if all are trusted, or the last trusted one if a hop is
+    not an address). The walk also starts when the PROXY/HELO address is
+    itself in RewriteIPAllow (CDN -> LB -> Apache). The list is parsed in
+    place, one pass, whatever its length. The resolved address is then
+    written to the client header, the forwarded header is left untouched.
 
     In HTTPS (SSL): this will fix "useragent_ip" field if any of:
     1) the connection buffer begins with "HELOxxxx" (there xxxx is IPv4 in
@@ -45,11 +95,116 @@
          "PROXY UNKNOWN ffff:f...f:ffff ffff:f...f:ffff 65535 65535\r\n"
          => 5 + 1 + 7 + 1 + 39 + 1 + 39 + 1 + 5 + 1 + 5 + 2 = 107 chars
 
+    3) buffer follow PROXY protocol v2 (binary)
+
+       - fixed header :
+         "\r\n\r\n\0\r\nQUIT\n" ver_cmd(1) fam(1) len(2, netorder)
+         => 12 + 1 + 1 + 2 = 16 bytes, followed by len bytes of addresses
+
+       - addresses :
+         AF_INET  => src(4) + dst(4) + srcport(2) + dstport(2) = 12 bytes
+         AF_INET6 => src(16) + dst(16) + srcport(2) + dstport(2) = 36 bytes
+         AF_UNIX  => src(108) + dst(108) = 216 bytes (no rewrite)
+
+       - LOCAL command (health checks of the proxy itself) keeps the
+         connection address
+
+       - TLVs after the addresses are kept raw in the connection and only
+         decoded when asked for (cached per connection):
+           PROXY_ALPN, PROXY_AUTHORITY, PROXY_UNIQUE_ID (hex), PROXY_NETNS,
+           PROXY_SSL ("on"), PROXY_SSL_VERIFY, PROXY_SSL_VERSION,
+           PROXY_SSL_CN, PROXY_SSL_CIPHER, PROXY_SSL_SIG_ALG,
+           PROXY_SSL_KEY_ALG, PROXY_AWS_VPCE_ID, PROXY_AZURE_LINKID
+         from other modules (optional functions in mod_myfixip.h), from
+         ap_expr (2.4: %{PROXY_SSL_CN}, proxy_tlv('0xEA01') raw hex), from
+         LogFormat (2.4: %{PROXY_AWS_VPCE_ID}^pp) or exported as environment
+         variables listed in RewriteIPProxyEnv (before mod_rewrite runs).
+         Non printable bytes of text TLVs are replaced by '?'.
+
        Complete Proxy-Protocol:
          http://haproxy.1wt.eu/download/1.5/doc/proxy-protocol.txt
 
     The rewrite address of request is allowed from a one of the IP Addresses
-    specified in the configuration file (RewriteIPAllow directive).
+    specified in the configuration file (RewriteIPAllow directive). A
+    VirtualHost with its own RewriteIPAllow list replaces the global one.
+
+    Each Listen port can be marked (RewriteIPProxyProtocol, global only):
+      required - connection must start with HELO/PROXY/TEST (else dropped)
+      optional - header is detected when present (default)
+      off      - header never looked for (no filter on the connection)
+    "*" sets the default for ports without their own entry.
+
+    RewriteIPPenalty <failures> <seconds> [entries] (global) counts bad
+    headers (invalid, overflow; not timeouts, which a slow network causes
+    too) by peer in a shared memory hash table (4096 entries, IPv6 peers
+    by /64). A peer with <failures> within <seconds> of its first counted
+    failure is penalized: its connections are dropped in pre_connection
+    before anything is allocated or logged, until <seconds> after its last
+    failure. The count restarts with the first failure after the window
+    (or after the penalty).
+
+    RewriteIPClientLimit <connections> [<requests/s> [burst]] (global) limits
+    each real client (the rewritten address, IPv6 by /64; or an untrusted
+    peer itself) across all children, in a shared memory table (16384
+    entries, lock free). Checked in post_read_request: a client over
+    <connections> (0 = no limit) gets 503 and the connection is closed, a
+    client over <requests/s> (token bucket of [burst] requests, default one
+    second worth) gets 429 with Retry-After (503 on Apache 2.2).
+
+    Statistics (handler "myfixip-status") are kept in shared memory, one
+    slot per live child (claimed by pid in child_init, released when the
+    child exits, or taken over once its owner is gone), updated with
+    atomics (no locks). Connections are counted
+    by header outcome and the time spent in the header phase (from accept
+    to header handled) goes to a log2 histogram (1us .. ~1s, +Inf). Output
+    is Prometheus text format, or JSON with "?json" in the query string.
+
+    The header phase follows the read type of the caller: a non-blocking
+    read without data returns APR_EAGAIN instead of waiting. The whole
+    header must arrive within RewriteIPHeaderTimeout (seconds, or "ms"
+    suffix; 0 = only Timeout applies) counted from the connection accept,
+    blocking reads in between are bounded by the time left.
+
+    The TEST command answers "OK\n". With RewriteIPTestStatus on (global)
+    it answers a status line instead:
+      "OK|DRAIN|BUSY busy=<workers> idle=<workers> gen=<generation>\n"
+      DRAIN - server stopping or this child is from an old generation
+      BUSY  - no idle worker, or busy >= RewriteIPTestBusy percent (90)
+              of MaxRequestWorkers
+    A thread in each child refreshes the line from the scoreboard every
+    TEST_STATUS_REFRESH msec, a probe only copies and sends it.
+
+    The PROXY v1 line is split on a bitmask of its separators, built with
+    AVX2, SSE2 or a scalar loop: MYFIXIP_SIMD=2|1|0 at build time (default
+    the best the compiler target allows, e.g. -mavx2 for AVX2).
+
+    Trace points (compiled unless MYFIXIP_TRACE is 0) record compact binary
+    events of sampled connections into a ring per child in shared memory:
+    phase changes, reads and bucket lengths, need/recv, header outcome.
+    RewriteIPTrace <events per child> [sample] allocates the rings, one of
+    every <sample> connections is traced (0 = none). Handler "myfixip-trace"
+    prints per-connection timelines ("?conn=ID" shows a single connection)
+    and "?raw" returns the segment for the offline decoder (test/Makefile,
+    myfixip_trace). Sampling changes at runtime with a POST to
+    "?sample=N" (a GET never changes it).
+
+    RewriteIPProxySend v1|v2 (per vhost, default off) writes a PROXY header
+    at the start of every new mod_proxy backend connection, with the
+    (rewritten) useragent address as source and the address the client
+    connected to as destination (PROXY UNKNOWN / v2 LOCAL when there is no
+    client, e.g. health checks). The header describes the connection, so
+    a pooled backend connection is only reused for the client connection
+    it was opened for (same addresses and ports): to any other it looks
+    closed to the pre-send check of mod_proxy (2.4), which then opens a new
+    one. Apache 2.2 makes no such check, so there a backend connection is
+    closed after its first request. Should a connection still be reused
+    for another client, the request is refused rather than sent with a
+    wrong header.
+
+    Other modules can read the result without c->notes or header lookups
+    through the optional functions declared in mod_myfixip.h:
+    myfixip_original_addr, myfixip_rewrite_addr (apr_sockaddr_t),
+    myfixip_trusted, myfixip_source (HELO, PROXY v1/v2 or HTTP header).
 
 
     Usage:
@@ -57,9 +212,37 @@
     # Global
     <IfModule mod_myfixip.c>
       RewriteIPResetHeader off
+      RewriteIPSpeculative on
+      RewriteIPExportNotes off
+      RewriteIPHeaderTimeout 5
+      RewriteIPTestStatus on
+      RewriteIPTestBusy 90
+      RewriteIPTrace 4096 0
+      RewriteIPPenalty 10 60
+      RewriteIPClientLimit 32 50 100
       RewriteIPAllow 192.168.0.0/16 127.0.0.1
+      RewriteIPProxyProtocol 443 required
+      RewriteIPProxyProtocol 80 off
+      RewriteIPProxyEnv PROXY_AWS_VPCE_ID
+      RewriteIPClientHeader X-Cluster-Client-Ip
+      RewriteIPForwardedHeader X-Forwarded-For
+      RewriteIPProxySend v2
     </IfModule>
 
+    # TLV in log / rewrite (2.4)
+    LogFormat "%h %{PROXY_AWS_VPCE_ID}^pp %r %>s" vpce
+    RewriteCond expr "%{PROXY_SSL_CN} == 'client.example.com'"
+
+    # Status
+    <Location /myfixip-status>
+      SetHandler myfixip-status
+      Require ip 127.0.0.1
+    </Location>
+    <Location /myfixip-trace>
+      SetHandler myfixip-trace
+      Require ip 127.0.0.1
+    </Location>
+
     # VirtualHost
     <VirtualHost *:443>
       <IfModule mod_myfixip.c>
@@ -109,16 +292,54 @@
 #include "http_log.h"
 #include "ap_mpm.h"
 #include "apr_strings.h"
+#include "apr_lib.h"
+#include "apr_hash.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
+#include "apr_version.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
 #include "scoreboard.h"
 #include "http_core.h"
 #include "ap_listen.h"
+#include "apr_optional.h"
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+#include "ap_expr.h"
+#include "mod_log_config.h"
+#endif
+#include "mod_myfixip.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+// PROXY v1 separator scan: 2 = AVX2, 1 = SSE2, 0 = scalar (default: best the target allows)
+#ifndef MYFIXIP_SIMD
+#if defined(__AVX2__)
+#define MYFIXIP_SIMD 2
+#elif defined(__SSE2__)
+#define MYFIXIP_SIMD 1
+#else
+#define MYFIXIP_SIMD 0
+#endif
+#endif
+#if (MYFIXIP_SIMD >= 2) && !defined(__AVX2__)
+#error "MYFIXIP_SIMD=2 needs an AVX2 target (-mavx2)"
+#elif (MYFIXIP_SIMD == 1) && !defined(__SSE2__)
+#error "MYFIXIP_SIMD=1 needs an SSE2 target (-msse2)"
+#endif
+#if MYFIXIP_SIMD >= 2
+#include <immintrin.h>
+#elif MYFIXIP_SIMD == 1
+#include <emmintrin.h>
+#endif
 
 #define MODULE_NAME "mod_myfixip"
-#define MODULE_VERSION "1.4"
+#define MODULE_VERSION "3.1"
 
 module AP_MODULE_DECLARE_DATA myfixip_module;
 
@@ -126,19 +347,53 @@ module AP_MODULE_DECLARE_DATA myfixip_module;
 #define HELO                  "HELO"
 #define TEST                  "TEST"
 #define TEST_RES_OK           "OK" "\n"
+#define TEST_STATUS_LENGTH    64
+#ifndef TEST_STATUS_REFRESH
+#define TEST_STATUS_REFRESH   200 // msec
+#endif
 
 #define NOTE_ORIGINAL_IP      "FIXIP_ORIGINAL_USERAGENT_IP"
 #define NOTE_REWRITE_IP       "FIXIP_REWRITE_USERAGENT_IP"
 #define NOTE_CLIENT_TRUST     "FIXIP_CLIENT_TRUSTED"
 
 #ifndef HDR_USERAGENT_IP
-#define HDR_USERAGENT_IP      "X-Cluster-Client-Ip" // FIXME: Do configurable name
+#define HDR_USERAGENT_IP      "X-Cluster-Client-Ip" // default RewriteIPClientHeader
 #endif
 
-//#define DEBUG
+#ifndef MYFIXIP_TRACE
+#define MYFIXIP_TRACE 1 // compile trace points (RewriteIPTrace)
+#endif
 #define PROXY_HEAD_LENGTH 4
 #define PROXY_MAX_LENGTH 107
+#define PROXY_SCAN_LENGTH 128 // separator scan window (>= PROXY_MAX_LENGTH)
+#define PROXY_V2_SIG "\r\n\r\n\0\r\nQUIT\n"
+#define PROXY_V2_SIG_LENGTH 12
+#define PROXY_V2_HEAD_LENGTH 16
+#ifndef PROXY_V2_MAX_LENGTH
+#define PROXY_V2_MAX_LENGTH 1024 // header + addresses + TLVs
+#endif
+#define PROXY_BUF_LENGTH PROXY_V2_MAX_LENGTH
+#if PROXY_BUF_LENGTH < PROXY_SCAN_LENGTH
+#error "PROXY_V2_MAX_LENGTH must hold the PROXY v1 separator scan window"
+#endif
 #define PAD_MAGIC 0x04202015
+#define STATUS_HANDLER "myfixip-status"
+#define TRACE_HANDLER "myfixip-trace"
+#define STAT_HIST_BUCKETS 22 // le 2^0 .. 2^20 usec, +Inf
+#define PEER_PROBES 8 // linear probing window
+#define PEER_FREE 0   // my_peer tag state (low bits, generation above)
+#define PEER_BUSY 1   // key being written by its new owner
+#define PEER_V4 2     // IPv4 address
+#define PEER_V6 3     // IPv6 /64
+#define PEER_STATE 3
+#define PEER_GEN 4
+#define CLIENT_SLOTS 16384 // RewriteIPClientLimit table (power of 2)
+#define CLIENT_MASK (CLIENT_SLOTS - 1)
+#define CLIENT_TICKS_PER_SEC 10000 // request rate clock (100 usec)
+
+#ifndef HTTP_TOO_MANY_REQUESTS
+#define HTTP_TOO_MANY_REQUESTS HTTP_SERVICE_UNAVAILABLE // 2.2: no 429 status line
+#endif
 
 // Apache 2.4 or 2.2
 #if AP_SERVER_MINORVERSION_NUMBER > 3
@@ -147,42 +402,341 @@ module AP_MODULE_DECLARE_DATA myfixip_module;
 #define _CLIENT_ADDR    c->client_addr
 #define _USERAGENT_IP   r->useragent_ip
 #define _USERAGENT_ADDR r->useragent_addr
+#define _WORKER_SCORE(i, j) ap_get_scoreboard_worker_from_indexes(i, j)
 #else
 #define _REMOTE_HOST    c->remote_host
 #define _CLIENT_IP      c->remote_ip
 #define _CLIENT_ADDR    c->remote_addr
 #define _USERAGENT_IP   c->remote_ip
 #define _USERAGENT_ADDR c->remote_addr
+#define _WORKER_SCORE(i, j) ap_get_scoreboard_worker(i, j)
 #endif
 
+typedef struct {
+    apr_ipsubnet_t *ip;
+    int family;            // AF_INET / AF_INET6 (0 = not compilable)
+    int bits;              // prefix length
+    apr_uint32_t net[4];   // network address (host order, MSB first)
+} accesslist;
+
+/*
+ * RewriteIPAllow compiled in post_config into a path-compressed binary
+ * radix trie. Nodes live in one contiguous array and each node stores the
+ * whole prefix it covers, so a lookup is a few masked word compares down
+ * the path: O(prefix length), independent of the number of entries.
+ */
+typedef struct {
+    apr_uint32_t key[4];   // prefix covered by this node (host order)
+    apr_int32_t child[2];  // index of next node by bit value (-1 = none)
+    apr_byte_t bits;       // prefix length covered by this node
+    apr_byte_t match;      // a RewriteIPAllow prefix ends here
+} iptrie_node;
+
+typedef struct {
+    iptrie_node *nodes;
+    int nnodes;
+    apr_int32_t root4;     // IPv4 trie root (-1 = empty)
+    apr_int32_t root6;     // IPv6 trie root (-1 = empty)
+    apr_array_header_t *slow; // entries not expressible as a prefix
+} iptrie;
+
+typedef enum {
+    POLICY_OFF = 0,
+    POLICY_OPTIONAL,
+    POLICY_REQUIRED,
+    POLICY_OUTBOUND    // no listener on port: mod_proxy backend connection
+} my_policy;
+
+typedef struct {
+    int port;              // -1 = default ("*")
+    my_policy policy;
+} listenpolicy;
+
 typedef struct
 {
     apr_time_t time;
     apr_port_t port;
     apr_array_header_t *allows;
+    apr_array_header_t *policies; // RewriteIPProxyProtocol (main server)
+    iptrie *trie;
     int resetHeader;
+    const char *clientHeader;    // RewriteIPClientHeader (NULL = default)
+    const char *forwardedHeader; // RewriteIPForwardedHeader (NULL = none)
+    int forwardedRfc7239;        // forwardedHeader is "Forwarded"
+    int proxySend;               // RewriteIPProxySend: 1, 2 (0 = off, -1 = unset)
+    int penaltyLimit;            // RewriteIPPenalty failures (0 = off)
+    int penaltyTime;             // seconds
+    int penaltySlots;            // table size (power of 2)
+    int clientConns;             // RewriteIPClientLimit connections (0 = no limit)
+    int clientRate;              // requests per second (0 = no limit)
+    int clientBurst;             // requests above rate
+    int speculative;
+    int exportNotes;
+    apr_interval_time_t headerTimeout; // -1 = unset, 0 = off
+    int testStatus;        // TEST answers status line (main server)
+    int testBusy;          // BUSY threshold, percent of workers
+    int traceEvents;       // trace ring size per child (0 = no trace)
+    int traceSample;       // trace one of N connections (0 = none)
+    apr_array_header_t *tlvEnv; // RewriteIPProxyEnv (index of tlv_vars)
 } my_config;
 
-typedef struct {
-    apr_ipsubnet_t *ip;
-} accesslist;
+typedef enum {
+    SOURCE_NONE = MYFIXIP_SOURCE_NONE,
+    SOURCE_HELO = MYFIXIP_SOURCE_HELO,
+    SOURCE_PROXY_V1 = MYFIXIP_SOURCE_PROXY_V1,
+    SOURCE_PROXY_V2 = MYFIXIP_SOURCE_PROXY_V2,
+    SOURCE_HEADER = MYFIXIP_SOURCE_HEADER
+} my_source;
+
+/*
+ * Per-connection state (c->conn_config), replaces c->notes lookups
+ */
+typedef struct
+{
+    int trusted;                   // -1 = not checked yet
+    int trace;                     // connection sampled for trace
+    const iptrie *trusted_by;      // ACL that gave the verdict
+    my_source source;              // origin of rewrite address
+    int family;                    // AF_INET / AF_INET6 (0 = no rewrite)
+    unsigned char addr[16];        // rewrite address (network order)
+    apr_port_t port;               // rewrite port (0 = unknown)
+    const char *rewrite_ip;        // string form of addr (lazy)
+    const char *original_ip;       // useragent IP before any rewrite
+    apr_sockaddr_t *original_addr;
+    apr_sockaddr_t *ua_addr;       // last rewritten useragent address
+    my_source ua_source;           // origin of ua_addr (last request)
+    char ua_ip[INET6_ADDRSTRLEN];  // string form of ua_addr
+    const unsigned char *tlv;      // PROXY v2 TLVs (raw, in header buffer)
+    apr_size_t tlv_len;
+    const char **tlv_vars;         // decoded TLVs (lazy, see tlv_vars[])
+    int client_slot;               // RewriteIPClientLimit entry counting us (-1 = none)
+} my_conn_state;
+
+/*
+ * TLV variables: decoded on first use, cached in my_conn_state
+ */
+typedef enum {
+    TLV_TEXT,          // value as string
+    TLV_HEX,           // opaque value in hex
+    TLV_SSL_CLIENT,    // "on" if PP2_CLIENT_SSL
+    TLV_SSL_VERIFY,    // verify result (0 = success)
+    TLV_U32LE          // little endian 32 bits, decimal
+} my_tlv_fmt;
+
+static const struct {
+    const char *name;
+    int type;
+    my_tlv_fmt fmt;
+} tlv_vars[] = {
+    { "PROXY_ALPN",         PP2_TYPE_ALPN,      TLV_TEXT },
+    { "PROXY_AUTHORITY",    PP2_TYPE_AUTHORITY, TLV_TEXT },
+    { "PROXY_UNIQUE_ID",    PP2_TYPE_UNIQUE_ID, TLV_HEX },
+    { "PROXY_NETNS",        PP2_TYPE_NETNS,     TLV_TEXT },
+    { "PROXY_SSL",          PP2_TYPE_SSL,       TLV_SSL_CLIENT },
+    { "PROXY_SSL_VERIFY",   PP2_TYPE_SSL,       TLV_SSL_VERIFY },
+    { "PROXY_SSL_VERSION",  MYFIXIP_TLV(PP2_TYPE_SSL, PP2_SUBTYPE_SSL_VERSION), TLV_TEXT },
+    { "PROXY_SSL_CN",       MYFIXIP_TLV(PP2_TYPE_SSL, PP2_SUBTYPE_SSL_CN),      TLV_TEXT },
+    { "PROXY_SSL_CIPHER",   MYFIXIP_TLV(PP2_TYPE_SSL, PP2_SUBTYPE_SSL_CIPHER),  TLV_TEXT },
+    { "PROXY_SSL_SIG_ALG",  MYFIXIP_TLV(PP2_TYPE_SSL, PP2_SUBTYPE_SSL_SIG_ALG), TLV_TEXT },
+    { "PROXY_SSL_KEY_ALG",  MYFIXIP_TLV(PP2_TYPE_SSL, PP2_SUBTYPE_SSL_KEY_ALG), TLV_TEXT },
+    { "PROXY_AWS_VPCE_ID",  MYFIXIP_TLV(PP2_TYPE_AWS, PP2_SUBTYPE_AWS_VPCE_ID), TLV_TEXT },
+    { "PROXY_AZURE_LINKID", MYFIXIP_TLV(PP2_TYPE_AZURE, PP2_SUBTYPE_AZURE_PRIVATEENDPOINT_LINKID), TLV_U32LE }
+};
+#define TLV_VARS (sizeof(tlv_vars) / sizeof(tlv_vars[0]))
 
 typedef enum {
     PHASE_WANT_HEAD,  // first 4 bytes
     PHASE_WANT_BINIP, // next 4 bytes
     PHASE_WANT_LINE,  // full PROXY header
+    PHASE_WANT_V2HEAD, // rest of 16 bytes PROXY v2 header
+    PHASE_WANT_V2ADDR, // PROXY v2 addresses and TLVs (len bytes)
     PHASE_DONE
 } my_phase;
 
+/*
+ * Outcome of header phase (index of stats counters)
+ */
+typedef enum {
+    STAT_PASS,         // no header, plain stream
+    STAT_HELO,
+    STAT_PROXY_V1,
+    STAT_PROXY_V2,
+    STAT_PROXY_V2_LOCAL,
+    STAT_TEST,
+    STAT_ABORT,        // ABORT_CONN: invalid header / required missing
+    STAT_OVERFLOW,     // ABORT_CONN2: header too long
+    STAT_TIMEOUT,      // RewriteIPHeaderTimeout expired
+    STAT_CLOSED,       // closed (or timeout) before header complete
+    STAT_UNTRUSTED,    // no filter: peer not in RewriteIPAllow
+    STAT_REJECTED,     // untrusted peer on PROXY required port
+    STAT_PENALIZED,    // peer in penalty box (RewriteIPPenalty)
+    STAT_MAX
+} my_stat;
+
+static const char *const stat_names[STAT_MAX] = {
+    "pass", "helo", "proxy_v1", "proxy_v2", "proxy_v2_local", "test",
+    "abort", "overflow", "timeout", "closed", "untrusted", "rejected",
+    "penalized"
+};
+
+/*
+ * Shared memory statistics: one slot per child process
+ */
+#if APR_VERSION_AT_LEAST(1,7,0)
+typedef apr_uint64_t stat_sum_t; // usec
+#define STAT_SUM_PER_SEC 1000000.0
+#define stat_sum_add(p, v) apr_atomic_add64((p), (apr_uint64_t) (v))
+#define stat_sum_read(p) apr_atomic_read64(p)
+#else
+typedef apr_uint32_t stat_sum_t; // msec (no 64 bits atomics)
+#define STAT_SUM_PER_SEC 1000.0
+#define stat_sum_add(p, v) apr_atomic_add32((p), (apr_uint32_t) ((v) / 1000))
+#define stat_sum_read(p) apr_atomic_read32(p)
+#endif
+
+/*
+ * Requests rejected by RewriteIPClientLimit
+ */
+typedef enum {
+    LIMIT_CONNECTIONS, // 503: client over concurrent connections
+    LIMIT_RATE,        // 429: client over request rate
+    LIMIT_MAX
+} my_limit;
+
+static const char *const limit_names[LIMIT_MAX] = {
+    "connections", "rate"
+};
+
+typedef struct {
+    apr_uint32_t pid;                      // owner child (0 = free)
+    apr_uint32_t count[STAT_MAX];
+    apr_uint32_t limited[LIMIT_MAX];
+    apr_uint32_t inflight;                 // connections in header phase
+    apr_uint32_t hist[STAT_HIST_BUCKETS];  // header phase duration
+    stat_sum_t hist_sum;
+} my_stats_slot;
+
+typedef struct {
+    apr_uint32_t nslots;
+    my_stats_slot slot[1];
+} my_stats;
+
+/*
+ * Key of a peer in the shared tables: family tag and the full IPv4
+ * address or IPv6 /64. The tag is written last when a slot changes owner
+ * and carries a generation, so a reader sees either a whole key or a
+ * changed tag.
+ */
+typedef struct {
+    apr_uint32_t tag;      // PEER_FREE, PEER_BUSY, PEER_V4, PEER_V6 (+ generation)
+    apr_uint32_t addr[2];  // network order (IPv4: addr[1] = 0)
+} my_peer;
+
+/*
+ * Penalty box (RewriteIPPenalty): header failures by peer
+ */
+typedef struct {
+    my_peer peer;
+    apr_uint32_t count;    // failures since start
+    apr_uint32_t start;    // first failure of the window (seconds)
+    apr_uint32_t stamp;    // last failure (seconds)
+} my_penalty_slot;
+
+typedef struct {
+    apr_uint32_t mask;     // slots - 1 (power of 2)
+    apr_uint32_t limit;    // failures to be penalized
+    apr_uint32_t window;   // seconds (penalty and decay)
+    my_penalty_slot slot[1];
+} my_penalty;
+
+/*
+ * Client limits (RewriteIPClientLimit): GCRA by resolved client
+ */
+typedef struct {
+    my_peer peer;          // client
+    apr_uint32_t conns;    // open connections
+    apr_uint32_t tat;      // theoretical arrival time (ticks)
+} my_client_slot;
+
+typedef struct {
+    apr_uint32_t conns;     // connections limit (0 = none)
+    apr_uint32_t interval;  // ticks per request (0 = no rate limit)
+    apr_uint32_t tolerance; // interval * burst
+    my_client_slot slot[1];
+} my_clients;
+
+/*
+ * Trace events (a, b: event arguments)
+ */
+typedef enum {
+    TR_CONN,       // local port, client port
+    TR_PEEK,       // peek result, header length
+    TR_READ,       // mode, need
+    TR_READ_FAIL,  // status, phase
+    TR_EMPTY,      // read type (-1 = bucket without type), phase
+    TR_BUCKET,     // length, need
+    TR_META,       // flush, metadata
+    TR_GETLINE,    // offset, recv
+    TR_PHASE,      // new phase, offset
+    TR_RESTORE,    // bytes given back, phase
+    TR_TOKEN,      // PROXY v1 token index, length
+    TR_PROXY_V2,   // family, address block length
+    TR_REWRITE,    // source, port
+    TR_DONE,       // outcome (my_stat), usec in header phase
+    TR_REQUEST,    // family, port of rewritten useragent
+    TR_MAX
+} my_trace_ev;
+
+typedef struct {
+    apr_uint32_t seq;      // written last (0 = empty or being written)
+    apr_uint32_t conn;     // c->id (low bits)
+    apr_uint32_t usec;     // apr_time_now() (low bits)
+    apr_uint16_t ev;
+    apr_uint16_t line;     // source line of trace point
+    apr_int32_t a;
+    apr_int32_t b;
+} my_trace_rec;
+
+typedef struct {
+    apr_uint32_t head;     // next sequence number
+    apr_uint32_t pid;      // owner child (0 = free)
+    my_trace_rec rec[1];   // "size" records
+} my_trace_ring;
+
+typedef struct {
+    apr_uint32_t sample;   // trace one of N connections (runtime)
+    apr_uint32_t nslots;
+    apr_uint32_t size;     // records per ring (power of 2)
+    apr_size_t ring_bytes;
+} my_trace;
+
+#if MYFIXIP_TRACE
+#define TRACE(on, id, ev, a, b) \
+    do { if (on) trace_event((id), (ev), __LINE__, (apr_int32_t) (a), (apr_int32_t) (b)); } while (0)
+#else
+#define TRACE(on, id, ev, a, b)
+#endif
+
 typedef struct
 {
     int magic;
     my_phase phase;
+    my_stat stat;
+    int recorded;
+    int trace;                     // connection sampled for trace
+    long id;                       // c->id
+    apr_time_t start;
+    apr_time_t deadline;           // end of header phase (0 = none)
+    apr_socket_t *csd;
+    apr_interval_time_t saved_timeout; // socket Timeout (if bounded)
+    int bounded;                   // socket timeout lowered to deadline
+    int peeked;
+    int required;
     ap_input_mode_t mode;
     apr_off_t need;
     apr_off_t recv;
     apr_off_t offset;
-    char buf[PROXY_MAX_LENGTH + 1];
+    char buf[PROXY_BUF_LENGTH + 1];
     int pad;
 } my_ctx;
 
@@ -196,7 +750,27 @@ static void *create_config(apr_pool_t *p, server_rec *s)
     my_config *conf = apr_palloc(p, sizeof(my_config));
 
     conf->allows = apr_array_make(p, 1, sizeof(accesslist));
+    conf->policies = apr_array_make(p, 1, sizeof(listenpolicy));
+    conf->trie = NULL;
     conf->resetHeader = 0;
+    conf->clientHeader = NULL;
+    conf->forwardedHeader = NULL;
+    conf->forwardedRfc7239 = 0;
+    conf->proxySend = -1;
+    conf->penaltyLimit = 0;
+    conf->penaltyTime = 0;
+    conf->penaltySlots = 0;
+    conf->clientConns = 0;
+    conf->clientRate = 0;
+    conf->clientBurst = 0;
+    conf->speculative = -1;
+    conf->exportNotes = -1;
+    conf->headerTimeout = -1;
+    conf->testStatus = 0;
+    conf->testBusy = 90;
+    conf->traceEvents = 0;
+    conf->traceSample = 0;
+    conf->tlvEnv = apr_array_make(p, 1, sizeof(int));
     conf->time = apr_time_now();
 
     return conf;
@@ -212,8 +786,18 @@ static void *merge_config(apr_pool_t *p, void *parent_server1_conf, void *add_se
     my_config *s1conf = (my_config *) parent_server1_conf;
     my_config *s2conf = (my_config *) add_server2_conf;
 
-    //merged_config->allows = (s1conf->allows == s2conf->allows) ? s1conf->allows : s2conf->allows;
+    merged_config->allows = (s2conf->allows->nelts > 0) ? s2conf->allows : s1conf->allows;
     merged_config->resetHeader = (s1conf->resetHeader == s2conf->resetHeader) ? s1conf->resetHeader : s2conf->resetHeader;
+    merged_config->clientHeader = s2conf->clientHeader ? s2conf->clientHeader : s1conf->clientHeader;
+    merged_config->proxySend = (s2conf->proxySend != -1) ? s2conf->proxySend : s1conf->proxySend;
+    if (s2conf->forwardedHeader) {
+        merged_config->forwardedHeader = s2conf->forwardedHeader;
+        merged_config->forwardedRfc7239 = s2conf->forwardedRfc7239;
+    }
+    merged_config->speculative = (s2conf->speculative != -1) ? s2conf->speculative : s1conf->speculative;
+    merged_config->exportNotes = (s2conf->exportNotes != -1) ? s2conf->exportNotes : s1conf->exportNotes;
+    merged_config->headerTimeout = (s2conf->headerTimeout != -1) ? s2conf->headerTimeout : s1conf->headerTimeout;
+    merged_config->tlvEnv = (s2conf->tlvEnv->nelts > 0) ? s2conf->tlvEnv : s1conf->tlvEnv;
 
     return (void *) merged_config;
 }
@@ -235,286 +819,2708 @@ static const char *reset_header_config_cmd(cmd_parms *parms, void *mconfig, int
 }
 
 /**
- * Parse the RewriteIPAllow directive
+ * Parse the RewriteIPClientHeader directive
  */
-static const char *allow_config_cmd(cmd_parms *cmd, void *dv, const char *where_c)
+static const char *client_header_config_cmd(cmd_parms *cmd, void *dv, const char *name)
 {
-    my_config *d = ap_get_module_config(cmd->server->module_config, &myfixip_module);
-    accesslist *a;
-    char *where = apr_pstrdup(cmd->pool, where_c);
-    char *s;
-    char msgbuf[120];
-    apr_status_t rv;
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
 
-    a = (accesslist *) apr_array_push(d->allows);
+    conf->clientHeader = name;
+    return NULL;
+}
 
-    if ((s = ap_strchr(where, '/'))) {
-        *s++ = '\0';
-        rv = apr_ipsubnet_create(&a->ip, where, s, cmd->pool);
-        if (APR_STATUS_IS_EINVAL(rv)) {
-            /* looked nothing like an IP address */
-            return "An IP address was expected";
-        }
-        else if (rv != APR_SUCCESS) {
-            apr_strerror(rv, msgbuf, sizeof msgbuf);
-            return apr_pstrdup(cmd->pool, msgbuf);
-        }
-    }
-    else if (!APR_STATUS_IS_EINVAL(rv = apr_ipsubnet_create(&a->ip, where, NULL, cmd->pool))) {
-        if (rv != APR_SUCCESS) {
-            apr_strerror(rv, msgbuf, sizeof msgbuf);
-            return apr_pstrdup(cmd->pool, msgbuf);
-        }
-    }
-    else { /* no slash, didn't look like an IP address => must be a host */
-        return "An IP address was expected";
-    }
+/**
+ * Parse the RewriteIPForwardedHeader directive
+ */
+static const char *forwarded_header_config_cmd(cmd_parms *cmd, void *dv, const char *name)
+{
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
 
+    conf->forwardedHeader = name;
+    conf->forwardedRfc7239 = (strcasecmp(name, "Forwarded") == 0);
     return NULL;
 }
 
 /**
- * Array describing structure of configuration directives
+ * Parse the RewriteIPProxySend directive
  */
-static command_rec cmds[] = {
-    AP_INIT_FLAG("RewriteIPResetHeader", reset_header_config_cmd, NULL, RSRC_CONF, "Reset HTTP-Header in this SSL vhost?"),
-    AP_INIT_ITERATE("RewriteIPAllow", allow_config_cmd, NULL, RSRC_CONF, "IP-address wildcards"),
-    {NULL}
-};
+static const char *proxy_send_config_cmd(cmd_parms *cmd, void *dv, const char *arg)
+{
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+
+    if (!strcasecmp(arg, "v1")) {
+        conf->proxySend = 1;
+    }
+    else if (!strcasecmp(arg, "v2")) {
+        conf->proxySend = 2;
+    }
+    else if (!strcasecmp(arg, "off")) {
+        conf->proxySend = 0;
+    }
+    else {
+        return "RewriteIPProxySend: must be v1, v2 or off";
+    }
+    return NULL;
+}
 
 /**
- * Set up startup-time initialization
+ * Parse the RewriteIPSpeculative directive
  */
-static int post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+static const char *speculative_config_cmd(cmd_parms *parms, void *mconfig, int flag)
 {
-    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL, MODULE_NAME " " MODULE_VERSION " started");
-    return OK;
+    my_config *conf = ap_get_module_config(parms->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context (parms, NOT_IN_DIR_LOC_FILE|NOT_IN_LIMIT);
+
+    if (err != NULL) {
+        return err;
+    }
+
+    conf->speculative = flag ? TRUE : FALSE;
+    return NULL;
 }
 
 /**
- * Find remote_addr in ACL
+ * Parse the RewriteIPExportNotes directive
  */
-static int find_accesslist(apr_array_header_t *a, apr_sockaddr_t *remote_addr)
+static const char *export_notes_config_cmd(cmd_parms *parms, void *mconfig, int flag)
 {
-    accesslist *ap = (accesslist *) a->elts;
-    int i;
+    my_config *conf = ap_get_module_config(parms->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context (parms, NOT_IN_DIR_LOC_FILE|NOT_IN_LIMIT);
 
-    for (i = 0; i < a->nelts; ++i) {
-        if (apr_ipsubnet_test(ap[i].ip, remote_addr)) {
-            return 1;
-        }
+    if (err != NULL) {
+        return err;
     }
 
-    return 0;
+    conf->exportNotes = flag ? TRUE : FALSE;
+    return NULL;
 }
 
 /**
- * Check if client_ip is trusted
+ * Parse the RewriteIPHeaderTimeout directive
  */
-static int check_trusted( conn_rec *c, my_config *conf )
+static const char *header_timeout_config_cmd(cmd_parms *parms, void *mconfig, const char *arg)
 {
-    const char *trusted;
-
-    trusted = apr_table_get( c->notes, NOTE_CLIENT_TRUST);
-    if (trusted) return (trusted[0] == 'Y');
+    my_config *conf = ap_get_module_config(parms->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context (parms, NOT_IN_DIR_LOC_FILE|NOT_IN_LIMIT);
+    char *end;
+    long n;
 
-    // Find Access List & Permit/Deny rewrite IP of Client
-    if (find_accesslist(conf->allows, _CLIENT_ADDR)) {
-        apr_table_setn(c->notes, NOTE_CLIENT_TRUST, "Y");
-        return 1;
+    if (err != NULL) {
+        return err;
     }
 
-    apr_table_setn(c->notes, NOTE_CLIENT_TRUST, "N");
-    return 0;
+    n = strtol(arg, &end, 10);
+    if ((end == arg) || (n < 0)) {
+        return "RewriteIPHeaderTimeout: timeout must be a non-negative number (seconds, or ms suffix; 0 = off)";
+    }
+    if (strcasecmp(end, "ms") == 0) {
+        conf->headerTimeout = apr_time_from_msec(n);
+    }
+    else if ((*end == '\0') || (strcasecmp(end, "s") == 0)) {
+        conf->headerTimeout = apr_time_from_sec(n);
+    }
+    else {
+        return "RewriteIPHeaderTimeout: unknown time unit";
+    }
+    return NULL;
 }
 
 /**
- * Check if connection is inbound
+ * Parse the RewriteIPTestStatus directive
  */
-static int check_inbound( conn_rec *c )
+static const char *test_status_config_cmd(cmd_parms *cmd, void *dv, int flag)
 {
-    apr_port_t port = c->local_addr->port;
-    ap_listen_rec *l;
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-    for (l = ap_listeners; l != NULL; l = l->next) {
-        if (l->bind_addr != NULL) {
-            if (port == l->bind_addr->port) {
-                return 1;
-            }
-        }
+    if (err != NULL) {
+        return err;
     }
 
-    return 0;
+    conf->testStatus = flag ? TRUE : FALSE;
+    return NULL;
 }
 
 /**
- * Pre Connection
+ * Parse the RewriteIPTestBusy directive
  */
-static int pre_connection(conn_rec *c, void *csd)
+static const char *test_busy_config_cmd(cmd_parms *cmd, void *dv, const char *arg)
 {
-    my_config *conf = ap_get_module_config (c->base_server->module_config, &myfixip_module);
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-#ifdef DEBUG
-    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::pre_connection IP Connection remote: %s:%d localport=%d (1)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port);
-#endif
-
-    if (!check_inbound(c)) { // Not Inbound (mod_proxy)
-        return DECLINED;
+    if (err != NULL) {
+        return err;
     }
 
-#ifdef DEBUG
-    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::pre_connection IP Connection from: %s:%d to port=%d (1)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port);
-#endif
-
-    if (!check_trusted(c, conf)) { // Not Trusted
-        return DECLINED;
+    conf->testBusy = atoi(arg);
+    if ((conf->testBusy < 1) || (conf->testBusy > 100)) {
+        return "RewriteIPTestBusy: percent must be 1-100";
     }
+    return NULL;
+}
 
-    my_ctx *cctx = apr_palloc(c->pool, sizeof(my_ctx));
-    cctx->phase = PHASE_WANT_HEAD;
-    cctx->mode = AP_MODE_READBYTES;
-    cctx->need = PROXY_HEAD_LENGTH;
-    cctx->recv = 0;
-    cctx->offset = 0;
-    memset(cctx->buf, 0, sizeof(cctx->buf));
-    cctx->magic = (PAD_MAGIC ^ c->id ^ conf->time) & 0x7FFFFFFF;
-    cctx->pad = cctx->magic;
+/**
+ * Parse the RewriteIPTrace directive
+ */
+static const char *trace_config_cmd(cmd_parms *cmd, void *dv, const char *events, const char *sample)
+{
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
 
-    ap_add_input_filter(myfixip_filter_name, cctx, NULL, c);
+    if (err != NULL) {
+        return err;
+    }
 
-    return DECLINED;
+    n = atoi(events);
+    if ((n < 0) || (n > (1 << 20))) {
+        return "RewriteIPTrace: events per child must be 0-1048576";
+    }
+    // Round up to power of 2
+    for (conf->traceEvents = n ? 256 : 0; conf->traceEvents && (conf->traceEvents < n); conf->traceEvents <<= 1)
+        ;
+    conf->traceSample = sample ? atoi(sample) : 0;
+    if (conf->traceSample < 0) {
+        return "RewriteIPTrace: sample must be 0 (none) or trace one of N connections";
+    }
+#if !MYFIXIP_TRACE
+    if (conf->traceEvents) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, cmd->server, MODULE_NAME " built without MYFIXIP_TRACE, RewriteIPTrace ignored");
+    }
+#endif
+    return NULL;
 }
 
 /**
- * Transform binary-network-address to human
+ * Index of TLV variable name in tlv_vars (-1 = unknown)
  */
-static const char *fromBinIPtoString(apr_pool_t *p, const char *binip)
+static int tlv_var_index(const char *name)
 {
-    // Rewrite IP
-    struct in_addr inp;
-    memcpy((char *)&inp, binip, 4);
-    char *str_ip = inet_ntoa(inp);
-    if (inet_aton(str_ip, &inp) == 0) {
-        return NULL;
+    int i;
+
+    for (i = 0; i < (int) TLV_VARS; ++i) {
+        if (!strcasecmp(name, tlv_vars[i].name)) {
+            return i;
+        }
     }
-    return apr_pstrdup( p, str_ip );
+    return -1;
 }
 
 /**
- * Save original UserAgent IP in connection note
+ * Parse the RewriteIPProxyEnv directive
  */
-static void save_req_ip(request_rec *r)
+static const char *proxy_env_config_cmd(cmd_parms *cmd, void *dv, const char *name)
 {
-    conn_rec *c = r->connection;
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    int idx = tlv_var_index(name);
 
-    const char *old_ip = apr_table_get(c->notes, NOTE_ORIGINAL_IP);
-    if (!old_ip) {
-        apr_table_set(c->notes, NOTE_ORIGINAL_IP, _USERAGENT_IP);
+    if (idx < 0) {
+        return apr_pstrcat(cmd->pool, "RewriteIPProxyEnv: unknown PROXY v2 TLV variable ", name, NULL);
     }
+    *(int *) apr_array_push(conf->tlvEnv) = idx;
+    return NULL;
 }
 
 /**
- * Rewrite UserAgent IP
+ * Parse the RewriteIPPenalty directive
  */
-static void rewrite_req_ip(request_rec *r, const char *new_ip)
+static const char *penalty_config_cmd(cmd_parms *cmd, void *dv, const char *limit, const char *secs, const char *slots)
+{
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    conf->penaltyLimit = atoi(limit);
+    conf->penaltyTime = atoi(secs);
+    if ((conf->penaltyLimit < 0) || (conf->penaltyTime < 1)) {
+        return "RewriteIPPenalty: failures must be >= 0 (0 = off) and seconds >= 1";
+    }
+    n = slots ? atoi(slots) : 4096;
+    if ((n < 1) || (n > (1 << 24))) {
+        return "RewriteIPPenalty: entries must be 1-16777216";
+    }
+    // Round up to power of 2
+    for (conf->penaltySlots = 64; conf->penaltySlots < n; conf->penaltySlots <<= 1)
+        ;
+    return NULL;
+}
+
+/**
+ * Parse the RewriteIPClientLimit directive
+ */
+static const char *client_limit_config_cmd(cmd_parms *cmd, void *dv, const char *conns, const char *rate, const char *burst)
+{
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+
+    conf->clientConns = atoi(conns);
+    conf->clientRate = rate ? atoi(rate) : 0;
+    conf->clientBurst = burst ? atoi(burst) : conf->clientRate;
+    if ((conf->clientConns < 0) || (conf->clientRate < 0) || (conf->clientRate > CLIENT_TICKS_PER_SEC)) {
+        return apr_psprintf(cmd->pool, "RewriteIPClientLimit: connections must be >= 0, requests/s 0-%d (0 = no limit)", CLIENT_TICKS_PER_SEC);
+    }
+    if (conf->clientRate && (conf->clientBurst < 1)) {
+        return "RewriteIPClientLimit: burst must be >= 1";
+    }
+    return NULL;
+}
+
+/**
+ * Parse the RewriteIPProxyProtocol directive
+ */
+static const char *proxy_protocol_config_cmd(cmd_parms *cmd, void *dv, const char *port, const char *mode)
+{
+    my_config *conf = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    listenpolicy *lp;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    lp = (listenpolicy *) apr_array_push(conf->policies);
+    if (strcmp(port, "*") == 0) {
+        lp->port = -1;
+    }
+    else {
+        long n = strtol(port, &end, 10);
+        if ((*port == '\0') || (*end != '\0') || (n < 1) || (n > 65535)) {
+            return "RewriteIPProxyProtocol: port must be 1-65535 or *";
+        }
+        lp->port = (int) n;
+    }
+    if (strcasecmp(mode, "required") == 0) {
+        lp->policy = POLICY_REQUIRED;
+    }
+    else if (strcasecmp(mode, "optional") == 0) {
+        lp->policy = POLICY_OPTIONAL;
+    }
+    else if (strcasecmp(mode, "off") == 0) {
+        lp->policy = POLICY_OFF;
+    }
+    else {
+        return "RewriteIPProxyProtocol: mode must be required, optional or off";
+    }
+    return NULL;
+}
+
+/**
+ * Parse a partial IPv4 network ("10", "172.16", "192.168.1")
+ */
+static int parse_partial_ipv4(const char *ip, apr_uint32_t *net, int *bits)
+{
+    apr_uint32_t addr = 0;
+    int octets = 0;
+
+    while (*ip) {
+        int v = 0, digits = 0;
+        while (*ip >= '0' && *ip <= '9' && digits < 4) {
+            v = v * 10 + (*ip++ - '0');
+            digits++;
+        }
+        if (!digits || (v > 255) || (octets == 4)) {
+            return 0;
+        }
+        addr |= (apr_uint32_t) v << (24 - 8 * octets++);
+        if (*ip == '.') {
+            ip++;
+        }
+        else if (*ip) {
+            return 0;
+        }
+    }
+    if (!octets) {
+        return 0;
+    }
+    *net = addr;
+    *bits = 8 * octets;
+    return 1;
+}
+
+/**
+ * Fill prefix form (family/net/bits) of an allow entry, mirroring the
+ * forms accepted by apr_ipsubnet_create(). Leaves family=0 when the entry
+ * cannot be compiled (e.g. non-contiguous netmask).
+ */
+static void parse_prefix(accesslist *a, const char *ip, const char *mask)
+{
+    unsigned char buf[16];
+    int i, max;
+
+    a->family = 0;
+    a->bits = 0;
+    memset(a->net, 0, sizeof(a->net));
+
+    if (inet_pton(AF_INET, ip, buf) == 1) {
+        a->net[0] = ((apr_uint32_t) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+        a->family = AF_INET;
+        max = 32;
+    }
+    else if (inet_pton(AF_INET6, ip, buf) == 1) {
+        for (i = 0; i < 4; i++) {
+            a->net[i] = ((apr_uint32_t) buf[4*i] << 24) | (buf[4*i+1] << 16) | (buf[4*i+2] << 8) | buf[4*i+3];
+        }
+        a->family = AF_INET6;
+        max = 128;
+    }
+    else if (!mask && parse_partial_ipv4(ip, &a->net[0], &a->bits)) {
+        a->family = AF_INET;
+        return;
+    }
+    else {
+        return;
+    }
+
+    a->bits = max;
+    if (mask) {
+        char *end;
+        long n = strtol(mask, &end, 10);
+        if ((*mask != '\0') && (*end == '\0')) {
+            if ((n < 0) || (n > max)) {
+                a->family = 0;
+                return;
+            }
+            a->bits = (int) n;
+        }
+        else if ((a->family == AF_INET) && (inet_pton(AF_INET, mask, buf) == 1)) {
+            apr_uint32_t m = ((apr_uint32_t) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+            a->bits = 0;
+            while ((a->bits < 32) && (m & (0x80000000U >> a->bits))) {
+                a->bits++;
+            }
+            if ((a->bits < 32) && (m << a->bits)) { // non-contiguous netmask
+                a->family = 0;
+                return;
+            }
+        }
+        else {
+            a->family = 0;
+            return;
+        }
+    }
+    // Clear host bits
+    for (i = 0; i < 4; i++) {
+        int keep = a->bits - 32 * i;
+        if (keep <= 0) {
+            a->net[i] = 0;
+        }
+        else if (keep < 32) {
+            a->net[i] &= ~(0xFFFFFFFFU >> keep);
+        }
+    }
+}
+
+/**
+ * Parse the RewriteIPAllow directive
+ */
+static const char *allow_config_cmd(cmd_parms *cmd, void *dv, const char *where_c)
+{
+    my_config *d = ap_get_module_config(cmd->server->module_config, &myfixip_module);
+    accesslist *a;
+    char *where = apr_pstrdup(cmd->pool, where_c);
+    char *s;
+    char msgbuf[120];
+    apr_status_t rv;
+
+    a = (accesslist *) apr_array_push(d->allows);
+
+    if ((s = ap_strchr(where, '/'))) {
+        *s++ = '\0';
+        parse_prefix(a, where, s);
+        rv = apr_ipsubnet_create(&a->ip, where, s, cmd->pool);
+        if (APR_STATUS_IS_EINVAL(rv)) {
+            /* looked nothing like an IP address */
+            return "An IP address was expected";
+        }
+        else if (rv != APR_SUCCESS) {
+            apr_strerror(rv, msgbuf, sizeof msgbuf);
+            return apr_pstrdup(cmd->pool, msgbuf);
+        }
+    }
+    else if (!APR_STATUS_IS_EINVAL(rv = apr_ipsubnet_create(&a->ip, where, NULL, cmd->pool))) {
+        parse_prefix(a, where, NULL);
+        if (rv != APR_SUCCESS) {
+            apr_strerror(rv, msgbuf, sizeof msgbuf);
+            return apr_pstrdup(cmd->pool, msgbuf);
+        }
+    }
+    else { /* no slash, didn't look like an IP address => must be a host */
+        return "An IP address was expected";
+    }
+
+    return NULL;
+}
+
+/**
+ * Array describing structure of configuration directives
+ */
+static command_rec cmds[] = {
+    AP_INIT_FLAG("RewriteIPResetHeader", reset_header_config_cmd, NULL, RSRC_CONF, "Reset HTTP-Header in this SSL vhost?"),
+    AP_INIT_ITERATE("RewriteIPAllow", allow_config_cmd, NULL, RSRC_CONF, "IP-address wildcards"),
+    AP_INIT_TAKE1("RewriteIPClientHeader", client_header_config_cmd, NULL, RSRC_CONF, "Header with the client IP (default " HDR_USERAGENT_IP ")"),
+    AP_INIT_TAKE1("RewriteIPForwardedHeader", forwarded_header_config_cmd, NULL, RSRC_CONF, "Forwarding list walked over trusted hops (X-Forwarded-For or Forwarded)"),
+    AP_INIT_TAKE2("RewriteIPProxyProtocol", proxy_protocol_config_cmd, NULL, RSRC_CONF, "Listen port (or *) and PROXY header policy: required, optional or off"),
+    AP_INIT_TAKE1("RewriteIPProxySend", proxy_send_config_cmd, NULL, RSRC_CONF, "Send PROXY header on mod_proxy backend connections: v1, v2 or off (default)"),
+    AP_INIT_FLAG("RewriteIPSpeculative", speculative_config_cmd, NULL, RSRC_CONF, "Peek PROXY header, consume only its bytes (default on)"),
+    AP_INIT_TAKE1("RewriteIPHeaderTimeout", header_timeout_config_cmd, NULL, RSRC_CONF, "Time to receive the PROXY/HELO header (seconds, or ms suffix; 0 = off)"),
+    AP_INIT_FLAG("RewriteIPTestStatus", test_status_config_cmd, NULL, RSRC_CONF, "TEST answers OK/DRAIN/BUSY with worker counts (default off)"),
+    AP_INIT_TAKE1("RewriteIPTestBusy", test_busy_config_cmd, NULL, RSRC_CONF, "Percent of busy workers reported as BUSY (default 90)"),
+    AP_INIT_ITERATE("RewriteIPProxyEnv", proxy_env_config_cmd, NULL, RSRC_CONF, "PROXY v2 TLV variables exported to the environment (PROXY_SSL_CN, ...)"),
+    AP_INIT_TAKE23("RewriteIPPenalty", penalty_config_cmd, NULL, RSRC_CONF, "Bad headers from a peer before its connections are dropped, seconds (penalty and decay), [entries]"),
+    AP_INIT_TAKE123("RewriteIPClientLimit", client_limit_config_cmd, NULL, RSRC_CONF, "Concurrent connections by real client (0 = no limit), [requests/s, [burst]]"),
+    AP_INIT_TAKE12("RewriteIPTrace", trace_config_cmd, NULL, RSRC_CONF, "Trace ring events per child and sampling (one of N connections, 0 = none)"),
+    AP_INIT_FLAG("RewriteIPExportNotes", export_notes_config_cmd, NULL, RSRC_CONF, "Export " NOTE_CLIENT_TRUST "/" NOTE_REWRITE_IP "/" NOTE_ORIGINAL_IP " connection notes (default off)"),
+    {NULL}
+};
+
+/*
+ * Uncompressed build-time trie (ptemp only)
+ */
+typedef struct build_node {
+    struct build_node *child[2];
+    int match;
+} build_node;
+
+#define PREFIX_BIT(key, i) (((key)[(i) >> 5] >> (31 - ((i) & 31))) & 1)
+
+/**
+ * Insert prefix in build trie, dropping prefixes covered by a shorter one
+ */
+static int trie_build_insert(apr_pool_t *ptemp, build_node *root, const apr_uint32_t *key, int bits)
+{
+    build_node *n = root;
+    int i, added = 0;
+
+    for (i = 0; i < bits; i++) {
+        if (n->match) { // already covered
+            return added;
+        }
+        int b = PREFIX_BIT(key, i);
+        if (!n->child[b]) {
+            n->child[b] = apr_pcalloc(ptemp, sizeof(build_node));
+            added++;
+        }
+        n = n->child[b];
+    }
+    n->match = 1;
+    n->child[0] = n->child[1] = NULL; // everything below is covered
+    return added;
+}
+
+/**
+ * Emit path-compressed nodes into contiguous array (preorder)
+ */
+static apr_int32_t trie_emit(iptrie *t, build_node *n, apr_uint32_t *key, int depth)
+{
+    // Skip single-child chains (path compression)
+    while (!n->match && ((n->child[0] == NULL) != (n->child[1] == NULL))) {
+        int b = n->child[1] ? 1 : 0;
+        if (b) {
+            key[depth >> 5] |= (0x80000000U >> (depth & 31));
+        }
+        n = n->child[b];
+        depth++;
+    }
+
+    apr_int32_t idx = t->nnodes++;
+    iptrie_node *node = &t->nodes[idx];
+    memcpy(node->key, key, sizeof(node->key));
+    node->bits = depth;
+    node->match = n->match;
+    node->child[0] = node->child[1] = -1;
+
+    int b;
+    for (b = 0; b < 2; b++) {
+        if (n->child[b]) {
+            apr_uint32_t sub[4];
+            memcpy(sub, key, sizeof(sub));
+            if (b) {
+                sub[depth >> 5] |= (0x80000000U >> (depth & 31));
+            }
+            node->child[b] = trie_emit(t, n->child[b], sub, depth + 1);
+        }
+    }
+    return idx;
+}
+
+/**
+ * Compile RewriteIPAllow list into radix trie
+ */
+static iptrie *trie_compile(apr_pool_t *p, apr_pool_t *ptemp, apr_array_header_t *allows)
+{
+    iptrie *t = apr_pcalloc(p, sizeof(iptrie));
+    accesslist *ap = (accesslist *) allows->elts;
+    build_node *root4 = apr_pcalloc(ptemp, sizeof(build_node));
+    build_node *root6 = apr_pcalloc(ptemp, sizeof(build_node));
+    int have4 = 0, have6 = 0, count = 2;
+    int i;
+
+    t->slow = apr_array_make(p, 1, sizeof(accesslist));
+    for (i = 0; i < allows->nelts; ++i) {
+        if (ap[i].family == AF_INET) {
+            count += trie_build_insert(ptemp, root4, ap[i].net, ap[i].bits);
+            have4 = 1;
+        }
+        else if (ap[i].family == AF_INET6) {
+            count += trie_build_insert(ptemp, root6, ap[i].net, ap[i].bits);
+            have6 = 1;
+        }
+        else {
+            *(accesslist *) apr_array_push(t->slow) = ap[i];
+        }
+    }
+
+    apr_uint32_t key[4] = { 0, 0, 0, 0 };
+    t->nodes = apr_palloc(p, count * sizeof(iptrie_node));
+    t->nnodes = 0;
+    t->root4 = have4 ? trie_emit(t, root4, key, 0) : -1;
+    memset(key, 0, sizeof(key));
+    t->root6 = have6 ? trie_emit(t, root6, key, 0) : -1;
+
+    return t;
+}
+
+/**
+ * Test key against trie. Every node flagged as match is an allow entry, so
+ * the first match on the path is enough (no need to find the longest one).
+ */
+static int trie_lookup(const iptrie *t, apr_int32_t idx, const apr_uint32_t *key, int maxbits)
+{
+    while (idx >= 0) {
+        const iptrie_node *n = &t->nodes[idx];
+        int full = n->bits >> 5, rest = n->bits & 31, i;
+
+        for (i = 0; i < full; i++) {
+            if (n->key[i] != key[i]) {
+                return 0;
+            }
+        }
+        if (rest && ((n->key[full] ^ key[full]) & ~(0xFFFFFFFFU >> rest))) {
+            return 0;
+        }
+        if (n->match) {
+            return 1;
+        }
+        if (n->bits >= maxbits) {
+            return 0;
+        }
+        idx = n->child[PREFIX_BIT(key, n->bits)];
+    }
+    return 0;
+}
+
+/**
+ * Find remote_addr in ACL
+ */
+static int find_accesslist(apr_array_header_t *a, apr_sockaddr_t *remote_addr)
+{
+    accesslist *ap = (accesslist *) a->elts;
+    int i;
+
+    for (i = 0; i < a->nelts; ++i) {
+        if (apr_ipsubnet_test(ap[i].ip, remote_addr)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Find remote_addr in compiled ACL
+ */
+static int find_trie(const iptrie *t, apr_sockaddr_t *remote_addr)
+{
+    apr_uint32_t key[4];
+
+    if (remote_addr->family == APR_INET) {
+        key[0] = ntohl(remote_addr->sa.sin.sin_addr.s_addr);
+        if (trie_lookup(t, t->root4, key, 32)) {
+            return 1;
+        }
+    }
+#if APR_HAVE_IPV6
+    else if (remote_addr->family == APR_INET6) {
+        const unsigned char *b = remote_addr->sa.sin6.sin6_addr.s6_addr;
+        int i;
+        for (i = 0; i < 4; i++) {
+            key[i] = ((apr_uint32_t) b[4*i] << 24) | (b[4*i+1] << 16) | (b[4*i+2] << 8) | b[4*i+3];
+        }
+        // IPv4 entries also match IPv4-mapped IPv6 (as apr_ipsubnet_test)
+        if ((key[0] == 0) && (key[1] == 0) && (key[2] == 0xFFFF)
+            && trie_lookup(t, t->root4, key + 3, 32)) {
+            return 1;
+        }
+        if (trie_lookup(t, t->root6, key, 128)) {
+            return 1;
+        }
+    }
+#endif
+    return (t->slow->nelts ? find_accesslist(t->slow, remote_addr) : 0);
+}
+
+/**
+ * Find address in RewriteIPAllow of server (compiled if available)
+ */
+static int find_acl(my_config *conf, apr_sockaddr_t *addr)
+{
+    return conf->trie ? find_trie(conf->trie, addr) : find_accesslist(conf->allows, addr);
+}
+
+/*
+ * Trace segment (post_config) and ring of this child (child_init)
+ */
+static my_trace *trace = NULL;
+static my_trace_ring *trace_ring = NULL;
+
+#define TRACE_RING(t, i) ((my_trace_ring *) ((char *) (t) + APR_ALIGN_DEFAULT(sizeof(my_trace)) + (i) * (t)->ring_bytes))
+
+/**
+ * Create trace shared memory
+ */
+static void trace_create(apr_pool_t *p, server_rec *s)
+{
+    my_config *conf = ap_get_module_config(s->module_config, &myfixip_module);
+    apr_size_t ring_bytes, size;
+    apr_shm_t *shm;
+    apr_status_t rv;
+    int nslots = 0;
+
+    trace = NULL;
+    if (!MYFIXIP_TRACE || !conf->traceEvents) {
+        return;
+    }
+    if ((ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &nslots) != APR_SUCCESS) || (nslots < 1)) {
+        nslots = 1;
+    }
+    ring_bytes = APR_ALIGN_DEFAULT(APR_OFFSETOF(my_trace_ring, rec) + conf->traceEvents * sizeof(my_trace_rec));
+    size = APR_ALIGN_DEFAULT(sizeof(my_trace)) + nslots * ring_bytes;
+
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (rv == APR_ENOTIMPL) {
+        const char *fname = ap_server_root_relative(p, "logs/" MODULE_NAME ".trace");
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&shm, size, fname, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, MODULE_NAME "::trace_create unable to create shared memory (%" APR_SIZE_T_FMT " bytes), trace disabled", size);
+        return;
+    }
+    trace = apr_shm_baseaddr_get(shm);
+    memset(trace, 0, size);
+    trace->sample = conf->traceSample;
+    trace->nslots = nslots;
+    trace->size = conf->traceEvents;
+    trace->ring_bytes = ring_bytes;
+}
+
+/**
+ * Record trace event (lock-free: slot reserved with an atomic increment,
+ * published by writing its sequence number last)
+ */
+static void trace_event(long id, my_trace_ev ev, int line, apr_int32_t a, apr_int32_t b)
+{
+    my_trace_ring *ring = trace_ring;
+    my_trace_rec *rec;
+    apr_uint32_t seq;
+
+    if (!ring) {
+        return;
+    }
+    seq = apr_atomic_inc32(&ring->head);
+    rec = &ring->rec[seq & (trace->size - 1)];
+    apr_atomic_set32(&rec->seq, 0);
+    rec->conn = (apr_uint32_t) id;
+    rec->usec = (apr_uint32_t) apr_time_now();
+    rec->ev = ev;
+    rec->line = line;
+    rec->a = a;
+    rec->b = b;
+    apr_atomic_set32(&rec->seq, seq + 1);
+}
+
+/**
+ * Is connection sampled for trace?
+ */
+static int trace_sampled(conn_rec *c)
+{
+    apr_uint32_t n;
+
+    if (!trace_ring) {
+        return 0;
+    }
+    n = apr_atomic_read32(&trace->sample);
+    return n && ((c->id % n) == 0);
+}
+
+/*
+ * Statistics segment (post_config) and slot of this child (child_init)
+ */
+static my_stats *stats = NULL;
+static my_stats_slot *stats_slot = NULL;
+
+/**
+ * Create statistics shared memory
+ */
+static void stats_create(apr_pool_t *p, server_rec *s)
+{
+    apr_shm_t *shm;
+    apr_size_t size;
+    apr_status_t rv;
+    int nslots = 0;
+
+    if ((ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &nslots) != APR_SUCCESS) || (nslots < 1)) {
+        nslots = 1;
+    }
+    size = APR_OFFSETOF(my_stats, slot) + nslots * sizeof(my_stats_slot);
+
+    // Anonymous if possible, else name based (removed with pconf)
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (rv == APR_ENOTIMPL) {
+        const char *fname = ap_server_root_relative(p, "logs/" MODULE_NAME ".shm");
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&shm, size, fname, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, MODULE_NAME "::stats_create unable to create shared memory (%" APR_SIZE_T_FMT " bytes), statistics disabled", size);
+        stats = NULL;
+        return;
+    }
+    stats = apr_shm_baseaddr_get(shm);
+    memset(stats, 0, size);
+    stats->nslots = nslots;
+}
+
+/**
+ * Header phase finished: count outcome and duration (once per connection)
+ */
+static void stats_header_done(my_ctx *ctx)
+{
+    apr_time_t usec;
+    int i;
+
+    if (ctx->recorded) {
+        return;
+    }
+    ctx->recorded = 1;
+    usec = apr_time_now() - ctx->start;
+    TRACE(ctx->trace, ctx->id, TR_DONE, ctx->stat, usec);
+    if (!stats_slot) {
+        return;
+    }
+    for (i = 0; (i < STAT_HIST_BUCKETS - 1) && (usec > ((apr_time_t) 1 << i)); ++i)
+        ;
+    apr_atomic_inc32(&stats_slot->count[ctx->stat]);
+    apr_atomic_inc32(&stats_slot->hist[i]);
+    stat_sum_add(&stats_slot->hist_sum, (usec > 0) ? usec : 0);
+    apr_atomic_dec32(&stats_slot->inflight);
+}
+
+/**
+ * Connection closed before end of header phase
+ */
+static apr_status_t stats_conn_cleanup(void *data)
+{
+    my_ctx *ctx = data;
+
+    ctx->stat = STAT_CLOSED;
+    stats_header_done(ctx);
+    return APR_SUCCESS;
+}
+
+/**
+ * Count outcome for connections without header phase
+ */
+static void stats_count(my_stat stat)
+{
+    if (stats_slot) {
+        apr_atomic_inc32(&stats_slot->count[stat]);
+    }
+}
+
+/**
+ * Count request rejected by a client limit
+ */
+static void stats_limited(my_limit limit)
+{
+    if (stats_slot) {
+        apr_atomic_inc32(&stats_slot->limited[limit]);
+    }
+}
+
+/*
+ * Penalty box: peers sending bad headers, fixed size open addressing hash
+ * table in shared memory (keys are claimed with CAS, never removed: a
+ * decayed entry is taken over in place, so probe chains have no holes)
+ */
+static my_penalty *penalty = NULL;
+
+/**
+ * Create penalty table (post_config)
+ */
+static void penalty_create(apr_pool_t *p, server_rec *s)
+{
+    my_config *conf = ap_get_module_config(s->module_config, &myfixip_module);
+    apr_size_t size;
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    penalty = NULL;
+    if (!conf->penaltyLimit) {
+        return;
+    }
+    size = APR_OFFSETOF(my_penalty, slot) + conf->penaltySlots * sizeof(my_penalty_slot);
+
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (rv == APR_ENOTIMPL) {
+        const char *fname = ap_server_root_relative(p, "logs/" MODULE_NAME ".penalty");
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&shm, size, fname, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, MODULE_NAME "::penalty_create unable to create shared memory (%" APR_SIZE_T_FMT " bytes), penalty box disabled", size);
+        return;
+    }
+    penalty = apr_shm_baseaddr_get(shm);
+    memset(penalty, 0, size);
+    penalty->mask = conf->penaltySlots - 1;
+    penalty->limit = conf->penaltyLimit;
+    penalty->window = conf->penaltyTime;
+}
+
+/**
+ * Key of peer: IPv4 address (also IPv4-mapped) or IPv6 /64 (0 = none)
+ */
+static int peer_key(const apr_sockaddr_t *sa, my_peer *key)
+{
+    key->addr[1] = 0;
+    if (sa->family == APR_INET) {
+        key->tag = PEER_V4;
+        key->addr[0] = sa->sa.sin.sin_addr.s_addr;
+        return 1;
+    }
+#if APR_HAVE_IPV6
+    if (sa->family == APR_INET6) {
+        const unsigned char *b = sa->sa.sin6.sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&sa->sa.sin6.sin6_addr)) {
+            key->tag = PEER_V4;
+            memcpy(&key->addr[0], b + 12, 4);
+        }
+        else {
+            key->tag = PEER_V6;
+            memcpy(key->addr, b, 8);
+        }
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Hash of key for the first slot (murmur3 finalizer: spreads close addresses)
+ */
+static apr_uint32_t peer_hash(const my_peer *key)
+{
+    apr_uint32_t h = key->addr[0] ^ (key->addr[1] * 0x9E3779B1U) ^ key->tag;
+
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * Slot holds key (tag read before and after the address: not changed
+ * under us by a new owner)
+ */
+static int peer_match(my_peer *sl, const my_peer *key)
+{
+    apr_uint32_t t = apr_atomic_read32(&sl->tag);
+
+    return ((t & PEER_STATE) == key->tag)
+        && (apr_atomic_read32(&sl->addr[0]) == key->addr[0])
+        && (apr_atomic_read32(&sl->addr[1]) == key->addr[1])
+        && (apr_atomic_read32(&sl->tag) == t);
+}
+
+/**
+ * Take over slot seen with tag t for key: 0 = someone else was faster
+ */
+static int peer_claim(my_peer *sl, apr_uint32_t t, const my_peer *key)
+{
+    apr_uint32_t gen = (t & ~PEER_STATE) + PEER_GEN;
+
+    if (apr_atomic_cas32(&sl->tag, gen | PEER_BUSY, t) != t) {
+        return 0;
+    }
+    apr_atomic_set32(&sl->addr[0], key->addr[0]);
+    apr_atomic_set32(&sl->addr[1], key->addr[1]);
+    apr_atomic_xchg32(&sl->tag, gen | key->tag); // publish
+    return 1;
+}
+
+/**
+ * Peer is in the penalty box (read only: no allocation, no write)
+ */
+static int penalty_check(const apr_sockaddr_t *sa)
+{
+    my_peer key;
+    apr_uint32_t i, n, t, now;
+
+    if (!peer_key(sa, &key)) {
+        return 0;
+    }
+    now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    for (i = peer_hash(&key) & penalty->mask, n = 0; n < PEER_PROBES; ++n, i = (i + 1) & penalty->mask) {
+        my_penalty_slot *sl = &penalty->slot[i];
+        if (peer_match(&sl->peer, &key)) {
+            return (apr_atomic_read32(&sl->count) >= penalty->limit)
+                && ((now - apr_atomic_read32(&sl->stamp)) < penalty->window);
+        }
+        t = apr_atomic_read32(&sl->peer.tag);
+        if ((t & PEER_STATE) == PEER_FREE) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Count a header failure of peer
+ */
+static void penalty_record(const apr_sockaddr_t *sa)
+{
+    my_peer key;
+    apr_uint32_t i, n, t, now;
+    my_penalty_slot *sl = NULL;
+
+    if (!peer_key(sa, &key)) {
+        return;
+    }
+    now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    for (i = peer_hash(&key) & penalty->mask, n = 0; n < PEER_PROBES; ++n, i = (i + 1) & penalty->mask) {
+        sl = &penalty->slot[i];
+        if (peer_match(&sl->peer, &key)) {
+            break;
+        }
+        // Free or decayed: take over (count reset before stamp, so the
+        // new owner is never seen with the old count and a fresh stamp)
+        t = apr_atomic_read32(&sl->peer.tag);
+        if (((t & PEER_STATE) == PEER_FREE)
+            || (((t & PEER_STATE) != PEER_BUSY) && ((now - apr_atomic_read32(&sl->stamp)) >= penalty->window))) {
+            if (peer_claim(&sl->peer, t, &key)) {
+                apr_atomic_set32(&sl->count, 0);
+                break;
+            }
+            if (peer_match(&sl->peer, &key)) {
+                break;
+            }
+        }
+        sl = NULL;
+    }
+    if (!sl) { // probe window full: not counted
+        return;
+    }
+    // Window over (penalty served: window after the last failure): count restarts
+    if ((now - apr_atomic_read32((apr_atomic_read32(&sl->count) < penalty->limit) ? &sl->start : &sl->stamp))
+        >= penalty->window) {
+        apr_atomic_set32(&sl->start, now);
+        apr_atomic_set32(&sl->count, 0);
+    }
+    apr_atomic_set32(&sl->stamp, now);
+    if (apr_atomic_inc32(&sl->count) + 1 == penalty->limit) {
+        char ip[INET6_ADDRSTRLEN];
+        apr_sockaddr_ip_getbuf(ip, sizeof(ip), (apr_sockaddr_t *) sa);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::penalty_record peer %s penalized for %us after %u bad headers", ip, penalty->window, penalty->limit);
+    }
+}
+
+/**
+ * Peers in the penalty box now (status)
+ */
+static apr_uint32_t penalty_count(void)
+{
+    apr_uint32_t i, n = 0, now = (apr_uint32_t) apr_time_sec(apr_time_now());
+
+    for (i = 0; i <= penalty->mask; ++i) {
+        my_penalty_slot *sl = &penalty->slot[i];
+        if (((apr_atomic_read32(&sl->peer.tag) & PEER_STATE) >= PEER_V4) && (apr_atomic_read32(&sl->count) >= penalty->limit)
+            && ((now - apr_atomic_read32(&sl->stamp)) < penalty->window)) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+/*
+ * Real client limits: concurrent connections and request rate (GCRA, the
+ * token bucket as one "theoretical arrival time" word) by resolved client,
+ * in the same kind of table as the penalty box. An entry is taken over
+ * when idle (no connection, bucket full). A connection keeps the index of
+ * its entry, so a take over racing with a new connection of the old key
+ * only skews that entry until the connection closes.
+ */
+static my_clients *clients = NULL;
+
+/**
+ * Create client table (post_config)
+ */
+static void clients_create(apr_pool_t *p, server_rec *s)
+{
+    my_config *conf = ap_get_module_config(s->module_config, &myfixip_module);
+    apr_size_t size;
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    clients = NULL;
+    if (!conf->clientConns && !conf->clientRate) {
+        return;
+    }
+    size = APR_OFFSETOF(my_clients, slot) + CLIENT_SLOTS * sizeof(my_client_slot);
+
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (rv == APR_ENOTIMPL) {
+        const char *fname = ap_server_root_relative(p, "logs/" MODULE_NAME ".clients");
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&shm, size, fname, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, MODULE_NAME "::clients_create unable to create shared memory (%" APR_SIZE_T_FMT " bytes), client limits disabled", size);
+        return;
+    }
+    clients = apr_shm_baseaddr_get(shm);
+    memset(clients, 0, size);
+    clients->conns = conf->clientConns;
+    if (conf->clientRate) {
+        clients->interval = (apr_uint32_t) (CLIENT_TICKS_PER_SEC / conf->clientRate);
+        clients->interval = clients->interval ? clients->interval : 1;
+        clients->tolerance = clients->interval * conf->clientBurst;
+    }
+}
+
+/**
+ * Ticks the bucket of entry is behind a full one (0 = full, or stale after
+ * a wrap: the theoretical arrival time never exceeds now + tolerance)
+ */
+static apr_uint32_t clients_ahead(my_client_slot *sl, apr_uint32_t now)
+{
+    apr_int32_t ahead = (apr_int32_t) (apr_atomic_read32(&sl->tat) - now);
+
+    return ((ahead > 0) && ((apr_uint32_t) ahead <= clients->tolerance)) ? (apr_uint32_t) ahead : 0;
+}
+
+/**
+ * Entry of client (claimed if needed), -1 = table full around its slot
+ */
+static int clients_find(const my_peer *key, apr_uint32_t now)
+{
+    apr_uint32_t i, n, t;
+
+    for (i = peer_hash(key) & CLIENT_MASK, n = 0; n < PEER_PROBES; ++n, i = (i + 1) & CLIENT_MASK) {
+        my_client_slot *sl = &clients->slot[i];
+        if (peer_match(&sl->peer, key)) {
+            return i;
+        }
+        // Free or idle: take over
+        t = apr_atomic_read32(&sl->peer.tag);
+        if (((t & PEER_STATE) == PEER_FREE)
+            || (((t & PEER_STATE) != PEER_BUSY) && !apr_atomic_read32(&sl->conns) && !clients_ahead(sl, now))) {
+            if (peer_claim(&sl->peer, t, key) || peer_match(&sl->peer, key)) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Take one request token of entry i: 0 = ok, else ticks until next token
+ */
+static apr_uint32_t clients_rate(int i, apr_uint32_t now)
+{
+    my_client_slot *sl = &clients->slot[i];
+    apr_uint32_t tat, ahead;
+
+    for (;;) {
+        tat = apr_atomic_read32(&sl->tat);
+        ahead = clients_ahead(sl, now) + clients->interval;
+        if (ahead > clients->tolerance) {
+            return ahead - clients->tolerance;
+        }
+        if (apr_atomic_cas32(&sl->tat, now + ahead, tat) == tat) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Connection closed: release its client entry
+ */
+static apr_status_t clients_conn_cleanup(void *data)
+{
+    my_conn_state *st = data;
+
+    if (st->client_slot >= 0) {
+        apr_atomic_dec32(&clients->slot[st->client_slot].conns);
+        st->client_slot = -1;
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Account request of resolved client: OK, or HTTP status to reject it
+ */
+static int clients_check(request_rec *r, my_conn_state *st)
+{
+    conn_rec *c = r->connection;
+    apr_uint32_t now = (apr_uint32_t) (apr_time_now() / (APR_USEC_PER_SEC / CLIENT_TICKS_PER_SEC));
+    apr_uint32_t wait;
+    my_peer key;
+    int i;
+
+    if (!peer_key(_USERAGENT_ADDR, &key)) {
+        return OK;
+    }
+    // Connection counted for its client (moves with the client on a reused LB connection)
+    if ((st->client_slot < 0) || !peer_match(&clients->slot[st->client_slot].peer, &key)) {
+        i = clients_find(&key, now);
+        if (st->client_slot >= 0) {
+            apr_atomic_dec32(&clients->slot[st->client_slot].conns);
+        }
+        else if (i >= 0) {
+            apr_pool_cleanup_register(c->pool, st, clients_conn_cleanup, apr_pool_cleanup_null);
+        }
+        st->client_slot = i;
+        if (i < 0) { // Table full: not limited
+            return OK;
+        }
+        if (clients->conns && (apr_atomic_inc32(&clients->slot[i].conns) >= clients->conns)) {
+            apr_atomic_dec32(&clients->slot[i].conns);
+            st->client_slot = -1;
+            c->keepalive = AP_CONN_CLOSE;
+            stats_limited(LIMIT_CONNECTIONS);
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, MODULE_NAME "::clients_check client %s over %u connections", st->ua_ip, clients->conns);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+        if (!clients->conns) {
+            apr_atomic_inc32(&clients->slot[i].conns);
+        }
+    }
+    if (clients->interval && (wait = clients_rate(st->client_slot, now))) {
+        stats_limited(LIMIT_RATE);
+        apr_table_setn(r->err_headers_out, "Retry-After",
+                       apr_psprintf(r->pool, "%u", (wait + CLIENT_TICKS_PER_SEC - 1) / CLIENT_TICKS_PER_SEC));
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, MODULE_NAME "::clients_check client %s over request rate", st->ua_ip);
+        return HTTP_TOO_MANY_REQUESTS;
+    }
+    return OK;
+}
+
+/**
+ * Clients over a limit now, active: clients with a connection or a
+ * non full bucket (status)
+ */
+static apr_uint32_t clients_count(apr_uint32_t *active)
+{
+    apr_uint32_t i, n = 0, now = (apr_uint32_t) (apr_time_now() / (APR_USEC_PER_SEC / CLIENT_TICKS_PER_SEC));
+
+    *active = 0;
+    for (i = 0; i < CLIENT_SLOTS; ++i) {
+        my_client_slot *sl = &clients->slot[i];
+        apr_uint32_t conns = apr_atomic_read32(&sl->conns);
+        apr_uint32_t ahead = clients_ahead(sl, now);
+        if (((apr_atomic_read32(&sl->peer.tag) & PEER_STATE) < PEER_V4) || (!conns && !ahead)) {
+            continue;
+        }
+        ++*active;
+        if ((clients->conns && (conns >= clients->conns))
+            || (clients->interval && (ahead + clients->interval > clients->tolerance))) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+/*
+ * PROXY policy by local port (built in post_config, NULL before)
+ */
+static unsigned char *listen_policy = NULL;
+
+/**
+ * Build lookup key with the content of an ACL (identical lists share a trie)
+ */
+static const char *acl_key(apr_pool_t *ptemp, apr_array_header_t *allows, apr_size_t *klen)
+{
+    typedef struct {
+        apr_uint32_t family;
+        apr_uint32_t bits;
+        apr_uint32_t net[4];
+        apr_ipsubnet_t *ip; // only for entries not compilable
+    } acl_key_entry;
+    accesslist *ap = (accesslist *) allows->elts;
+    acl_key_entry *k = apr_pcalloc(ptemp, allows->nelts * sizeof(acl_key_entry) + 1);
+    int i;
+
+    for (i = 0; i < allows->nelts; ++i) {
+        k[i].family = ap[i].family;
+        k[i].bits = ap[i].bits;
+        memcpy(k[i].net, ap[i].net, sizeof(k[i].net));
+        k[i].ip = ap[i].family ? NULL : ap[i].ip;
+    }
+    *klen = allows->nelts * sizeof(acl_key_entry);
+    return (const char *) k;
+}
+
+/**
+ * Compile RewriteIPProxyProtocol into table indexed by local port
+ */
+static void listen_policy_compile(apr_pool_t *p, server_rec *s)
+{
+    my_config *conf = ap_get_module_config(s->module_config, &myfixip_module);
+    listenpolicy *lp = (listenpolicy *) conf->policies->elts;
+    my_policy def = POLICY_OPTIONAL;
+    ap_listen_rec *l;
+    int i;
+
+    for (i = 0; i < conf->policies->nelts; ++i) {
+        if (lp[i].port < 0) {
+            def = lp[i].policy;
+        }
+    }
+    // Ports without listener are outbound (mod_proxy connections)
+    listen_policy = apr_palloc(p, 65536);
+    memset(listen_policy, POLICY_OUTBOUND, 65536);
+    for (l = ap_listeners; l != NULL; l = l->next) {
+        if (l->bind_addr != NULL) {
+            listen_policy[l->bind_addr->port] = def;
+        }
+    }
+    for (i = 0; i < conf->policies->nelts; ++i) {
+        if (lp[i].port >= 0) {
+            listen_policy[lp[i].port] = lp[i].policy;
+        }
+    }
+}
+
+/**
+ * Set up startup-time initialization
+ */
+static int post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+    apr_hash_t *compiled = apr_hash_make(ptemp);
+
+    listen_policy_compile(p, s);
+    stats_create(p, s);
+    trace_create(p, s);
+    penalty_create(p, s);
+    clients_create(p, s);
+
+    // Compile ACLs (servers with identical lists share the trie)
+    for (; s; s = s->next) {
+        my_config *conf = ap_get_module_config(s->module_config, &myfixip_module);
+        apr_size_t klen;
+        const char *key = acl_key(ptemp, conf->allows, &klen);
+        conf->trie = apr_hash_get(compiled, key, klen);
+        if (!conf->trie) {
+            conf->trie = trie_compile(p, ptemp, conf->allows);
+            apr_hash_set(compiled, key, klen, conf->trie);
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL, MODULE_NAME " " MODULE_VERSION " started");
+    return OK;
+}
+
+/**
+ * Get (or create) connection state
+ */
+static my_conn_state *get_conn_state(conn_rec *c)
+{
+    my_conn_state *st = ap_get_module_config(c->conn_config, &myfixip_module);
+
+    if (!st) {
+        st = apr_pcalloc(c->pool, sizeof(my_conn_state));
+        st->trusted = -1;
+        st->client_slot = -1;
+        ap_set_module_config(c->conn_config, &myfixip_module, st);
+    }
+    return st;
+}
+
+/**
+ * Check if client_ip is trusted
+ */
+static int check_trusted( conn_rec *c, my_config *conf )
+{
+    my_conn_state *st = get_conn_state(c);
+
+    // Verdict is valid for every vhost sharing the same compiled ACL
+    if ((st->trusted >= 0) && (st->trusted_by == conf->trie)) return st->trusted;
+
+    // Find Access List & Permit/Deny rewrite IP of Client
+    st->trusted = find_acl(conf, _CLIENT_ADDR) ? 1 : 0;
+    st->trusted_by = conf->trie;
+
+    if (conf->exportNotes > 0) {
+        apr_table_setn(c->notes, NOTE_CLIENT_TRUST, st->trusted ? "Y" : "N");
+    }
+    return st->trusted;
+}
+
+/**
+ * Check if connection is inbound (PROXY policy of listener)
+ */
+static my_policy check_inbound( conn_rec *c )
+{
+    apr_port_t port = c->local_addr->port;
+    ap_listen_rec *l;
+
+    if (listen_policy) {
+        return listen_policy[port];
+    }
+    for (l = ap_listeners; l != NULL; l = l->next) {
+        if (l->bind_addr != NULL) {
+            if (port == l->bind_addr->port) {
+                return POLICY_OPTIONAL;
+            }
+        }
+    }
+
+    return POLICY_OUTBOUND;
+}
+
+/*
+ * Client of the request this thread is proxying. mod_proxy writes to and
+ * checks the backend connection from the thread running the frontend
+ * request, so the backend filters find it in a per-thread slot: set by
+ * the fixups of that request, cleared when its pool is destroyed (a
+ * backend connection has no link to the frontend one, e.g. c->id is 0
+ * on 2.4).
+ */
+typedef struct {
+    int family;                    // AF_INET / AF_INET6 (0 = none)
+    unsigned char src[16];         // useragent address (network order)
+    unsigned char dst[16];         // address the client connected to
+    apr_port_t sport;
+    apr_port_t dport;
+} my_outbound;
+
+/*
+ * Backend connection state (shared by output and check filters)
+ */
+typedef struct {
+    int version;                   // PROXY header version (1, 2)
+    int sent;                      // header written
+    my_outbound client;            // client announced in the header
+} my_out_ctx;
+
+static const char *const myfixip_out_filter_name = "myfixip_out_filter";
+static const char *const myfixip_check_filter_name = "myfixip_check_filter";
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *outbound_key = NULL;
+#else
+static my_outbound outbound_slot;
+#endif
+
+/**
+ * Outbound slot of this thread (NULL = none yet)
+ */
+static my_outbound *outbound_get(int create)
+{
+#if APR_HAS_THREADS
+    void *slot = NULL;
+
+    if (!outbound_key) {
+        return NULL;
+    }
+    apr_threadkey_private_get(&slot, outbound_key);
+    if (!slot && create) {
+        slot = calloc(1, sizeof(my_outbound)); // freed by thread key destructor
+        if (slot) {
+            apr_threadkey_private_set(slot, outbound_key);
+        }
+    }
+    return slot;
+#else
+    return &outbound_slot;
+#endif
+}
+
+/**
+ * Copy address (binary) of apr_sockaddr_t, IPv4 as IPv4-mapped if wide
+ */
+static void outbound_addr(const apr_sockaddr_t *sa, int wide, unsigned char *bin, apr_port_t *port)
+{
+    static const unsigned char v4mapped[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+
+    *port = sa->port;
+    if (sa->family == AF_INET) {
+        if (wide) {
+            memcpy(bin, v4mapped, 12);
+            memcpy(bin + 12, &sa->sa.sin.sin_addr, 4);
+        }
+        else {
+            memcpy(bin, &sa->sa.sin.sin_addr, 4);
+        }
+    }
+#if APR_HAVE_IPV6
+    else {
+        memcpy(bin, &sa->sa.sin6.sin6_addr, 16);
+    }
+#endif
+}
+
+/**
+ * Request done: this thread proxies for nobody (r->pool cleanup)
+ */
+static apr_status_t outbound_clear(void *data)
+{
+    ((my_outbound *) data)->family = 0;
+    return APR_SUCCESS;
+}
+
+/**
+ * Fixups: remember client of request about to be proxied
+ */
+static int outbound_fixups(request_rec *r)
+{
+    conn_rec *c = r->connection;
+    my_config *conf = ap_get_module_config(r->server->module_config, &myfixip_module);
+    apr_sockaddr_t *ua = _USERAGENT_ADDR;
+    my_outbound *o;
+    int wide;
+
+    if (!r->proxyreq || (conf->proxySend <= 0) || !(o = outbound_get(1))) {
+        return DECLINED;
+    }
+    o->family = 0;
+    apr_pool_cleanup_register(r->pool, o, outbound_clear, apr_pool_cleanup_null);
+    if (((ua->family != AF_INET) && (ua->family != AF_INET6))
+        || ((c->local_addr->family != AF_INET) && (c->local_addr->family != AF_INET6))) {
+        return DECLINED; // PROXY UNKNOWN / LOCAL
+    }
+    // Both addresses of the same family (IPv4-mapped when mixed)
+    wide = (ua->family == AF_INET6) || (c->local_addr->family == AF_INET6);
+    o->family = wide ? AF_INET6 : AF_INET;
+    outbound_addr(ua, wide, o->src, &o->sport);
+    outbound_addr(c->local_addr, wide, o->dst, &o->dport);
+    return DECLINED;
+}
+
+/**
+ * Client of the request this thread is proxying (NULL = none)
+ */
+static const my_outbound *outbound_client(void)
+{
+    const my_outbound *o = outbound_get(0);
+
+    return (o && o->family) ? o : NULL;
+}
+
+/**
+ * Same client (addresses and ports) as announced in the header of the connection
+ */
+static int outbound_same(const my_outbound *a, const my_outbound *b)
+{
+    apr_size_t alen;
+
+    if (!a || !b) {
+        return (a == b);
+    }
+    alen = (a->family == AF_INET) ? 4 : 16;
+    return (a->family == b->family) && (a->sport == b->sport) && (a->dport == b->dport)
+        && !memcmp(a->src, b->src, alen) && !memcmp(a->dst, b->dst, alen);
+}
+
+/**
+ * Build PROXY header for client o (NULL = unknown) into buf
+ */
+static apr_size_t outbound_header(int version, const my_outbound *o, char *buf)
+{
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    unsigned char *h = (unsigned char *) buf;
+    apr_size_t alen;
+
+    if (version == 1) {
+        if (!o) {
+            return apr_snprintf(buf, PROXY_MAX_LENGTH + 1, "PROXY UNKNOWN\r\n");
+        }
+        inet_ntop(o->family, o->src, src, sizeof(src));
+        inet_ntop(o->family, o->dst, dst, sizeof(dst));
+        return apr_snprintf(buf, PROXY_MAX_LENGTH + 1, "PROXY %s %s %s %u %u\r\n",
+                            (o->family == AF_INET) ? "TCP4" : "TCP6", src, dst, o->sport, o->dport);
+    }
+    memcpy(h, PROXY_V2_SIG, PROXY_V2_SIG_LENGTH);
+    if (!o) {
+        h[12] = 0x20; // LOCAL
+        h[13] = 0x00; // AF_UNSPEC
+        h[14] = h[15] = 0;
+        return PROXY_V2_HEAD_LENGTH;
+    }
+    alen = (o->family == AF_INET) ? 4 : 16;
+    h[12] = 0x21; // PROXY
+    h[13] = (o->family == AF_INET) ? 0x11 : 0x21; // TCP over IPv4 / IPv6
+    h[14] = 0;
+    h[15] = (unsigned char) (2 * alen + 4);
+    memcpy(h + PROXY_V2_HEAD_LENGTH, o->src, alen);
+    memcpy(h + PROXY_V2_HEAD_LENGTH + alen, o->dst, alen);
+    h += PROXY_V2_HEAD_LENGTH + 2 * alen;
+    h[0] = o->sport >> 8;
+    h[1] = o->sport & 0xFF;
+    h[2] = o->dport >> 8;
+    h[3] = o->dport & 0xFF;
+    return PROXY_V2_HEAD_LENGTH + 2 * alen + 4;
+}
+
+/**
+ * Backend output: PROXY header before the first bytes of the connection
+ */
+static apr_status_t outbound_filter_out(ap_filter_t *f, apr_bucket_brigade *b)
+{
+    conn_rec *c = f->c;
+    my_out_ctx *ctx = f->ctx;
+    const my_outbound *o = outbound_client();
+
+    if (APR_BRIGADE_EMPTY(b)) {
+        return ap_pass_brigade(f->next, b);
+    }
+    if (!ctx->sent) {
+        char buf[PROXY_MAX_LENGTH + 1];
+        apr_size_t len = outbound_header(ctx->version, o, buf);
+        APR_BRIGADE_INSERT_HEAD(b, apr_bucket_heap_create(buf, len, NULL, c->bucket_alloc));
+        if (o) {
+            ctx->client = *o;
+        }
+        ctx->sent = 1;
+#if AP_SERVER_MINORVERSION_NUMBER < 4
+        // No pre-send check on 2.2 (socket only): closed after this request
+        c->keepalive = AP_CONN_CLOSE;
+#endif
+    }
+    else if (o && !outbound_same(o, ctx->client.family ? &ctx->client : NULL)) {
+        // Pooled connection of another client (no pre-send check was made)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, c->base_server, MODULE_NAME "::outbound_filter_out backend connection announced another client, request refused");
+        c->aborted = 1;
+        apr_brigade_cleanup(b);
+        return APR_ECONNABORTED;
+    }
+    return ap_pass_brigade(f->next, b);
+}
+
+/**
+ * Backend input: the connection looks closed to mod_proxy's pre-send
+ * check (speculative read) when reused for another client
+ */
+static apr_status_t outbound_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_input_mode_t mode, apr_read_type_e block, apr_off_t readbytes)
+{
+    my_out_ctx *ctx = f->ctx;
+
+    if ((mode == AP_MODE_SPECULATIVE) && ctx->sent) {
+        const my_outbound *o = outbound_client();
+        if (o && !outbound_same(o, ctx->client.family ? &ctx->client : NULL)) {
+            return APR_EOF;
+        }
+    }
+    return ap_get_brigade(f->next, b, mode, block, readbytes);
+}
+
+/**
+ * New backend connection: PROXY header filters
+ */
+static void outbound_init(conn_rec *c, int version)
+{
+    my_out_ctx *ctx = apr_pcalloc(c->pool, sizeof(my_out_ctx));
+
+    ctx->version = version;
+    ap_add_output_filter(myfixip_out_filter_name, ctx, NULL, c);
+    ap_add_input_filter(myfixip_check_filter_name, ctx, NULL, c);
+}
+
+/**
+ * Pre Connection
+ */
+static int pre_connection(conn_rec *c, void *csd)
+{
+    my_config *conf = ap_get_module_config (c->base_server->module_config, &myfixip_module);
+    my_policy policy;
+
+    policy = check_inbound(c);
+    if (policy == POLICY_OUTBOUND) { // mod_proxy backend
+        if (conf->proxySend > 0) {
+            outbound_init(c, conf->proxySend);
+        }
+        return DECLINED;
+    }
+    if (policy == POLICY_OFF) { // PROXY off
+        return DECLINED;
+    }
+    if (penalty && penalty_check(_CLIENT_ADDR)) { // Penalized (nothing allocated, nothing logged)
+        c->aborted = 1;
+        stats_count(STAT_PENALIZED);
+        return DECLINED;
+    }
+
+    if (!check_trusted(c, conf)) { // Not Trusted
+        if (policy == POLICY_REQUIRED) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, NULL, MODULE_NAME "::pre_connection untrusted peer on PROXY required port from=%s to port=%d", _CLIENT_IP, c->local_addr->port);
+            c->aborted = 1;
+            stats_count(STAT_REJECTED);
+        }
+        else {
+            stats_count(STAT_UNTRUSTED);
+        }
+        return DECLINED;
+    }
+
+    my_ctx *cctx = apr_palloc(c->pool, sizeof(my_ctx));
+    cctx->phase = PHASE_WANT_HEAD;
+    cctx->stat = STAT_PASS;
+    cctx->recorded = 0;
+    cctx->id = c->id;
+    cctx->trace = get_conn_state(c)->trace = trace_sampled(c);
+    cctx->start = apr_time_now();
+    cctx->deadline = (conf->headerTimeout > 0) ? (cctx->start + conf->headerTimeout) : 0;
+    cctx->csd = csd;
+    cctx->saved_timeout = 0;
+    cctx->bounded = 0;
+    cctx->required = (policy == POLICY_REQUIRED);
+    cctx->peeked = !conf->speculative; // -1 (unset) is on
+    cctx->mode = AP_MODE_READBYTES;
+    cctx->need = PROXY_HEAD_LENGTH;
+    cctx->recv = 0;
+    cctx->offset = 0;
+    memset(cctx->buf, 0, sizeof(cctx->buf));
+    cctx->magic = (PAD_MAGIC ^ c->id ^ conf->time) & 0x7FFFFFFF;
+    cctx->pad = cctx->magic;
+
+    ap_add_input_filter(myfixip_filter_name, cctx, NULL, c);
+    TRACE(cctx->trace, c->id, TR_CONN, c->local_addr->port, _CLIENT_ADDR->port);
+    if (stats_slot) {
+        apr_atomic_inc32(&stats_slot->inflight);
+        apr_pool_cleanup_register(c->pool, cctx, stats_conn_cleanup, apr_pool_cleanup_null);
+    }
+
+    return DECLINED;
+}
+
+/**
+ * Parse dotted quad IPv4 of len chars to binary (network order)
+ */
+static int parse_ipv4_n(const char *str, apr_size_t len, unsigned char *bin)
+{
+    apr_size_t i = 0;
+    int part;
+
+    for (part = 0; part < 4; ++part) {
+        apr_size_t start = i;
+        unsigned int v = 0;
+        while ((i < len) && (i - start < 3) && (str[i] >= '0') && (str[i] <= '9')) {
+            v = v * 10 + (str[i++] - '0');
+        }
+        if ((i == start) || (v > 255) || ((str[start] == '0') && (i - start > 1))) {
+            return 0;
+        }
+        bin[part] = (unsigned char) v;
+        if (part < 3) {
+            if ((i >= len) || (str[i] != '.')) {
+                return 0;
+            }
+            ++i;
+        }
+    }
+    return (i == len);
+}
+
+/**
+ * Parse IPv6 of len chars to binary (network order), "::" and dotted
+ * IPv4 tail allowed
+ */
+static int parse_ipv6_n(const char *str, apr_size_t len, unsigned char *bin)
+{
+    apr_uint16_t w[8];
+    apr_size_t i = 0;
+    int n = 0, gap = -1, k;
+
+    if ((len >= 2) && (str[0] == ':') && (str[1] == ':')) {
+        gap = 0;
+        i = 2;
+    }
+    while (i < len) {
+        apr_size_t j = i;
+        unsigned int v = 0;
+        while ((j < len) && apr_isxdigit(str[j])) {
+            v = (v << 4) | (apr_isdigit(str[j]) ? (str[j] - '0') : ((str[j] | 0x20) - 'a' + 10));
+            ++j;
+        }
+        if ((j < len) && (str[j] == '.')) { // IPv4 tail
+            unsigned char v4[4];
+            if ((n > 6) || !parse_ipv4_n(str + i, len - i, v4)) {
+                return 0;
+            }
+            w[n++] = (v4[0] << 8) | v4[1];
+            w[n++] = (v4[2] << 8) | v4[3];
+            break;
+        }
+        if ((j == i) || (j - i > 4) || (n == 8)) {
+            return 0;
+        }
+        w[n++] = (apr_uint16_t) v;
+        i = j;
+        if (i == len) {
+            break;
+        }
+        if ((str[i] != ':') || (++i == len)) {
+            return 0;
+        }
+        if (str[i] == ':') {
+            if (gap >= 0) {
+                return 0;
+            }
+            gap = n;
+            ++i;
+        }
+    }
+    if ((gap < 0) ? (n != 8) : (n > 7)) {
+        return 0;
+    }
+    memset(bin, 0, 16);
+    for (k = 0; k < n; ++k) {
+        int pos = ((gap >= 0) && (k >= gap)) ? (8 - n + k) : k;
+        bin[pos * 2] = w[k] >> 8;
+        bin[pos * 2 + 1] = w[k] & 0xFF;
+    }
+    return 1;
+}
+
+/**
+ * Fold IPv4-mapped IPv6 address to IPv4
+ */
+static void fold_v4mapped(int *family, unsigned char *bin)
+{
+    static const unsigned char v4mapped[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+
+    if ((*family == AF_INET6) && (memcmp(bin, v4mapped, sizeof(v4mapped)) == 0)) {
+        memmove(bin, bin + 12, 4);
+        *family = AF_INET;
+    }
+}
+
+/**
+ * Parse IPv4/IPv6 literal to binary (network order), never resolves.
+ * IPv4-mapped IPv6 addresses are returned as IPv4.
+ */
+static int parse_ip(const char *str, int *family, unsigned char *bin)
+{
+    apr_size_t len = strlen(str);
+
+    if (parse_ipv4_n(str, len, bin)) {
+        *family = AF_INET;
+        return 1;
+    }
+    if (parse_ipv6_n(str, len, bin)) {
+        *family = AF_INET6;
+        fold_v4mapped(family, bin);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Fill apr_sockaddr_t from binary address (as apr_sockaddr_vars_set)
+ */
+static void build_sockaddr(apr_sockaddr_t *sa, apr_pool_t *p, int family, const unsigned char *addr, apr_port_t port)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->pool = p;
+    sa->family = family;
+    sa->port = port;
+#if APR_HAVE_IPV6
+    if (family == AF_INET6) {
+        sa->sa.sin6.sin6_family = AF_INET6;
+        sa->sa.sin6.sin6_port = htons(port);
+        memcpy(&sa->sa.sin6.sin6_addr, addr, 16);
+        sa->salen = sizeof(struct sockaddr_in6);
+        sa->addr_str_len = 46;
+        sa->ipaddr_ptr = &sa->sa.sin6.sin6_addr;
+        sa->ipaddr_len = sizeof(struct in6_addr);
+        return;
+    }
+#endif
+    sa->sa.sin.sin_family = AF_INET;
+    sa->sa.sin.sin_port = htons(port);
+    memcpy(&sa->sa.sin.sin_addr, addr, 4);
+    sa->salen = sizeof(struct sockaddr_in);
+    sa->addr_str_len = 16;
+    sa->ipaddr_ptr = &sa->sa.sin.sin_addr;
+    sa->ipaddr_len = sizeof(struct in_addr);
+}
+
+/**
+ * Rewrite address in string form (formatted once per connection)
+ */
+static const char *rewrite_ip_string(conn_rec *c, my_conn_state *st)
+{
+    char str_ip[INET6_ADDRSTRLEN];
+
+    if (!st->rewrite_ip && st->family) {
+        if (!inet_ntop(st->family, st->addr, str_ip, sizeof(str_ip))) {
+            return NULL;
+        }
+        st->rewrite_ip = apr_pstrdup(c->pool, str_ip);
+    }
+    return st->rewrite_ip;
+}
+
+/**
+ * Store rewrite address (binary, network order) found in header
+ */
+static void set_rewrite_addr(conn_rec *c, my_source source, int family, const void *addr, apr_port_t port)
+{
+    my_config *conf = ap_get_module_config(c->base_server->module_config, &myfixip_module);
+    my_conn_state *st = get_conn_state(c);
+
+    st->source = source;
+    st->family = family;
+    memcpy(st->addr, addr, (family == AF_INET) ? 4 : 16);
+    st->port = port;
+    st->rewrite_ip = NULL;
+    TRACE(st->trace, c->id, TR_REWRITE, source, port);
+
+    if (conf->exportNotes > 0) {
+        apr_table_set(c->notes, NOTE_REWRITE_IP, rewrite_ip_string(c, st));
+    }
+}
+
+/**
+ * Save original UserAgent IP in connection state
+ */
+static void save_req_ip(request_rec *r, my_conn_state *st, my_config *conf)
+{
+    conn_rec *c = r->connection;
+
+    if (!st->original_ip) {
+        st->original_ip = apr_pstrdup(c->pool, _USERAGENT_IP);
+        st->original_addr = _USERAGENT_ADDR;
+        if (conf->exportNotes > 0) {
+            apr_table_setn(c->notes, NOTE_ORIGINAL_IP, st->original_ip);
+        }
+    }
+}
+
+/**
+ * Rewrite UserAgent IP
+ */
+static void rewrite_req_ip(request_rec *r, my_conn_state *st, int family, const unsigned char *addr, apr_port_t port)
 {
     conn_rec *c = r->connection;
-    // Rewrite IP
-    apr_sockaddr_t *temp_sa = _USERAGENT_ADDR;
-    apr_sockaddr_info_get(&temp_sa, new_ip,
-                                    APR_UNSPEC, temp_sa->port,
-                                    APR_IPV4_ADDR_OK, c->pool);
-    _USERAGENT_ADDR = temp_sa;
-    apr_sockaddr_ip_get(&_USERAGENT_IP, _USERAGENT_ADDR);
-    apr_sockaddr_ip_get(&_REMOTE_HOST, _USERAGENT_ADDR);
+    apr_sockaddr_t *sa = st->ua_addr;
+
+    if (!port) { // keep port of connection
+        port = _USERAGENT_ADDR->port;
+    }
+    // Rewrite IP (only rebuild when it changed, in place: no growth of c->pool)
+    if (!sa || (sa->family != family) || (sa->port != port)
+        || memcmp(sa->ipaddr_ptr, addr, (family == AF_INET) ? 4 : 16)) {
+        if (!sa) {
+            sa = st->ua_addr = apr_palloc(c->pool, sizeof(apr_sockaddr_t));
+        }
+        build_sockaddr(sa, c->pool, family, addr, port);
+        inet_ntop(family, addr, st->ua_ip, sizeof(st->ua_ip));
+    }
+    _USERAGENT_ADDR = sa;
+    _USERAGENT_IP = st->ua_ip;
+    _REMOTE_HOST = st->ua_ip;
     //c->remote_host = NULL; // Force DNS re-resolution
-#ifdef DEBUG
-    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::rewrite_req_ip IP Connection from: %s:%d [%s] to port=%d newip=%s (OK)", _CLIENT_IP, _CLIENT_ADDR->port, _USERAGENT_IP, c->local_addr->port, new_ip);
+    TRACE(st->trace, c->id, TR_REQUEST, family, port);
+}
+
+/**
+ * Parse decimal port of len chars
+ */
+static int parse_port_n(const char *str, apr_size_t len, apr_port_t *port)
+{
+    apr_uint32_t v = 0;
+    apr_size_t i;
+
+    if ((len == 0) || (len > 5) || ((str[0] == '0') && (len > 1))) {
+        return 0;
+    }
+    for (i = 0; i < len; ++i) {
+        if ((str[i] < '0') || (str[i] > '9')) {
+            return 0;
+        }
+        v = v * 10 + (str[i] - '0');
+    }
+    if (v > 65535) {
+        return 0;
+    }
+    *port = (apr_port_t) v;
+    return 1;
+}
+
+/**
+ * Bitmask of separators (' ' and '\r') in the first PROXY_SCAN_LENGTH
+ * bytes of buf: bit i of mask[i / 64] is buf[i]
+ */
+static void scan_separators(const char *buf, apr_uint64_t mask[2])
+{
+    int i;
+
+    mask[0] = mask[1] = 0;
+#if MYFIXIP_SIMD >= 2
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    for (i = 0; i < PROXY_SCAN_LENGTH / 32; ++i) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i * 32));
+        apr_uint32_t m = (apr_uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, cr)));
+        mask[i >> 1] |= (apr_uint64_t) m << ((i & 1) * 32);
+    }
+#elif MYFIXIP_SIMD == 1
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (i = 0; i < PROXY_SCAN_LENGTH / 16; ++i) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i * 16));
+        apr_uint64_t m = (apr_uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, cr)));
+        mask[i >> 2] |= m << ((i & 3) * 16);
+    }
+#else
+    for (i = 0; i < PROXY_SCAN_LENGTH; ++i) {
+        if ((buf[i] == ' ') || (buf[i] == '\r')) {
+            mask[i >> 6] |= (apr_uint64_t) 1 << (i & 63);
+        }
+    }
+#endif
+}
+
+/**
+ * Position of first separator at or after pos (-1 = none)
+ */
+static int next_separator(const apr_uint64_t mask[2], int pos)
+{
+    while (pos < PROXY_SCAN_LENGTH) {
+        apr_uint64_t w = mask[pos >> 6] >> (pos & 63);
+        if (w) {
+#if defined(__GNUC__)
+            return pos + __builtin_ctzll(w);
+#else
+            while (!(w & 1)) {
+                w >>= 1;
+                ++pos;
+            }
+            return pos;
 #endif
+        }
+        pos = (pos | 63) + 1;
+    }
+    return -1;
+}
+
+/**
+ * Rewrite UserAgent IP (PROXY protocol v1), single pass:
+ * "PROXY TCP4|TCP6 srcip dstip srcport dstport\r\n" or "PROXY UNKNOWN...\r\n"
+ */
+static int process_proxy_header(ap_filter_t *f)
+{
+    conn_rec *c = f->c;
+    my_ctx *ctx = f->ctx;
+    const char *buf = ctx->buf;
+    int len = (int) ctx->offset;
+    apr_uint64_t mask[2];
+    const char *tok[6];
+    int toklen[6];
+    int ntok = 0, pos = 6, sep, family;
+    unsigned char src[16], dst[16];
+    apr_port_t sport, dport;
+
+    if ((len < 15) || (len > PROXY_MAX_LENGTH) || (buf[len - 2] != '\r') || (buf[len - 1] != '\n')
+        || (memcmp(buf, PROXY " ", 6) != 0)) {
+        return FALSE;
+    }
+    if (ctx->pad != ctx->magic) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::process_proxy_header padding magic fail (bad=%d vs good=%d)", ctx->pad, ctx->magic);
+        return FALSE;
+    }
+
+    // Split tokens on the separator mask (ends at first '\r')
+    scan_separators(buf, mask);
+    do {
+        sep = next_separator(mask, pos);
+        if ((sep < 0) || (sep > len - 2) || (sep == pos) || (ntok == 6)) {
+            return FALSE;
+        }
+        tok[ntok] = buf + pos;
+        toklen[ntok] = sep - pos;
+        TRACE(ctx->trace, c->id, TR_TOKEN, ntok, toklen[ntok]);
+        ++ntok;
+        pos = sep + 1;
+        if ((ntok == 1) && (toklen[0] == 7) && (memcmp(tok[0], "UNKNOWN", 7) == 0)) {
+            return TRUE; // keep connection address, ignore rest of line
+        }
+    } while (buf[sep] != '\r');
+    if ((sep != len - 2) || (ntok != 5) || (toklen[0] != 4) || (memcmp(tok[0], "TCP", 3) != 0)) {
+        return FALSE;
+    }
+
+    switch (tok[0][3]) {
+        case '4':
+            family = AF_INET;
+            if (!parse_ipv4_n(tok[1], toklen[1], src) || !parse_ipv4_n(tok[2], toklen[2], dst)) {
+                return FALSE;
+            }
+            break;
+        case '6':
+            family = AF_INET6;
+            if (!parse_ipv6_n(tok[1], toklen[1], src) || !parse_ipv6_n(tok[2], toklen[2], dst)) {
+                return FALSE;
+            }
+            fold_v4mapped(&family, src);
+            break;
+        default:
+            return FALSE;
+    }
+    if (!parse_port_n(tok[3], toklen[3], &sport) || !parse_port_n(tok[4], toklen[4], &dport)) {
+        return FALSE;
+    }
+    set_rewrite_addr(c, SOURCE_PROXY_V1, family, src, sport);
+    return TRUE;
+}
+
+/**
+ * Rewrite UserAgent IP (PROXY protocol v2)
+ */
+static int process_proxy_v2_header(ap_filter_t *f)
+{
+    conn_rec *c = f->c;
+    my_ctx *ctx = f->ctx;
+    const unsigned char *hdr = (const unsigned char *) ctx->buf;
+    apr_size_t len = (hdr[14] << 8) | hdr[15];
+    apr_size_t alen; // address block length
+    int family;
+
+    if (ctx->offset != (apr_off_t) (PROXY_V2_HEAD_LENGTH + len)) {
+        return FALSE;
+    }
+    switch (hdr[12]) { // version (high nibble) + command
+        case 0x20: // LOCAL: connection from the proxy itself
+            ctx->stat = STAT_PROXY_V2_LOCAL;
+            return TRUE;
+        case 0x21: // PROXY
+            break;
+        default:
+            return FALSE;
+    }
+    switch (hdr[13] >> 4) { // address family
+        case 0x1: // AF_INET
+            family = AF_INET;
+            alen = 12;
+            break;
+        case 0x2: // AF_INET6
+            family = AF_INET6;
+            alen = 36;
+            break;
+        case 0x3: // AF_UNIX: no IP to rewrite
+            family = 0;
+            alen = 216;
+            break;
+        case 0x0: // AF_UNSPEC: ignore address block
+            family = 0;
+            alen = 0;
+            break;
+        default:
+            return FALSE;
+    }
+    if (len < alen) {
+        return FALSE;
+    }
+    // TLVs stay raw in the header buffer until asked for (tlv_find)
+    if (len > alen) {
+        my_conn_state *st = get_conn_state(c);
+        st->tlv = hdr + PROXY_V2_HEAD_LENGTH + alen;
+        st->tlv_len = len - alen;
+    }
+    if (!family) {
+        return TRUE;
+    }
+    if (ctx->pad != ctx->magic) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::process_proxy_v2_header padding magic fail (bad=%d vs good=%d)", ctx->pad, ctx->magic);
+        return FALSE;
+    }
+    // src addr, dst addr, src port, dst port
+    const unsigned char *sport = hdr + PROXY_V2_HEAD_LENGTH + ((family == AF_INET) ? 8 : 32);
+    set_rewrite_addr(c, SOURCE_PROXY_V2, family, hdr + PROXY_V2_HEAD_LENGTH, (sport[0] << 8) | sport[1]);
+    TRACE(ctx->trace, c->id, TR_PROXY_V2, family, len);
+    return TRUE;
 }
 
 /**
- * Rewrite UserAgent IP
+ * Rewrite UserAgent IP (HELO + binary IPv4)
  */
-static int process_proxy_header(ap_filter_t *f)
+static int process_helo_header(ap_filter_t *f)
 {
     conn_rec *c = f->c;
     my_ctx *ctx = f->ctx;
-    if (ctx->offset < 15) {
-        return FALSE;
-    }
-    char *end = ctx->buf + ctx->offset - 2;
-    if ((end[0] != '\r') || (end[1] != '\n')) {
+
+    if (ctx->offset < PROXY_HEAD_LENGTH + 4) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in ERROR: HELO+IP invalid");
         return FALSE;
     }
-    end[0] = ' '; // for next split
-    end[1] = 0;
-#ifdef DEBUG
-    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::process_proxy_header DEBUG: CMD=PROXY header=%s", ctx->buf);
-#endif
-    apr_size_t length = (end + 2 - ctx->buf);
-    int size = length - 1;
-    char *ptr = (char *) ctx->buf;
-    int tok = 0;
-    char *srcip = NULL, *dstip = NULL, *srcport = NULL, *dstport = NULL;
-    while (ptr) {
-        char *f = memchr(ptr, ' ', size);
-        if (!f) {
-            break;
+    set_rewrite_addr(c, SOURCE_HELO, AF_INET, ctx->buf + 4, 0);
+    return TRUE;
+}
+
+/**
+ * Find TLV type in block p of len bytes (no copy)
+ */
+static int tlv_find(const unsigned char *p, apr_size_t len, int type, const unsigned char **value, apr_size_t *vlen)
+{
+    apr_size_t n;
+
+    while (len >= 3) {
+        n = (p[1] << 8) | p[2];
+        if (n > len - 3) { // truncated: ignore rest of block
+            return 0;
         }
-        *f = '\0';
-#ifdef DEBUG
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::process_proxy_header DEBUG: CMD=PROXY token=%s [%d]", ptr, tok);
-#endif
-        // PROXY TCP4 255.255.255.255 255.255.255.255 65535 65535
-        switch (tok) {
-            case 0: // PROXY
-                if (ptr[4] != 'Y') {
-                    return FALSE;
+        if (p[0] == type) {
+            *value = p + 3;
+            *vlen = n;
+            return 1;
+        }
+        p += 3 + n;
+        len -= 3 + n;
+    }
+    return 0;
+}
+
+/**
+ * TLV value in hex
+ */
+static char *tlv_hex(apr_pool_t *p, const unsigned char *v, apr_size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *str = apr_palloc(p, 2 * len + 1);
+    apr_size_t i;
+
+    for (i = 0; i < len; ++i) {
+        str[2 * i] = hex[v[i] >> 4];
+        str[2 * i + 1] = hex[v[i] & 0xF];
+    }
+    str[2 * len] = 0;
+    return str;
+}
+
+/**
+ * Optional function: raw value of TLV (or nested TLV) of the connection
+ */
+static int myfixip_tlv_get(conn_rec *c, int type, const unsigned char **value, apr_size_t *len)
+{
+    my_conn_state *st = ap_get_module_config(c->conn_config, &myfixip_module);
+    int sub = type & 0xFF;
+
+    if (!st || !st->tlv) {
+        return 0;
+    }
+    if (type <= 0xFF) {
+        return tlv_find(st->tlv, st->tlv_len, type, value, len);
+    }
+    if (!tlv_find(st->tlv, st->tlv_len, type >> 8, value, len)) {
+        return 0;
+    }
+    if ((type >> 8) == PP2_TYPE_SSL) { // client(1) + verify(4) + sub-TLVs
+        return (*len >= 5) && tlv_find(*value + 5, *len - 5, sub, value, len);
+    }
+    if ((*len < 1) || (**value != sub)) { // vendor: subtype(1) + value
+        return 0;
+    }
+    ++*value;
+    --*len;
+    return 1;
+}
+
+/**
+ * Decode TLV variable (cached per connection, NULL = absent)
+ */
+static const char *tlv_var(conn_rec *c, int idx)
+{
+    static const char absent[] = "";
+    my_conn_state *st = ap_get_module_config(c->conn_config, &myfixip_module);
+    const unsigned char *v;
+    apr_size_t len, i;
+    char *str = NULL;
+
+    if (!st || !st->tlv) {
+        return NULL;
+    }
+    if (!st->tlv_vars) {
+        st->tlv_vars = apr_pcalloc(c->pool, TLV_VARS * sizeof(const char *));
+    }
+    if (st->tlv_vars[idx]) {
+        return (st->tlv_vars[idx] == absent) ? NULL : st->tlv_vars[idx];
+    }
+    if (myfixip_tlv_get(c, tlv_vars[idx].type, &v, &len)) {
+        switch (tlv_vars[idx].fmt) {
+            case TLV_TEXT:
+                str = apr_palloc(c->pool, len + 1);
+                for (i = 0; i < len; ++i) {
+                    str[i] = apr_isprint(v[i]) ? v[i] : '?';
                 }
+                str[len] = 0;
                 break;
-            case 2: // SRCIP
-                srcip = ptr;
+            case TLV_HEX:
+                str = tlv_hex(c->pool, v, len);
                 break;
-            case 3: // DSTIP
-                dstip = ptr;
+            case TLV_SSL_CLIENT:
+                str = ((len >= 1) && (v[0] & PP2_CLIENT_SSL)) ? "on" : NULL;
                 break;
-            case 4: // SRCPORT
-                srcport = ptr;
+            case TLV_SSL_VERIFY:
+                str = (len >= 5) ? apr_psprintf(c->pool, "%u", (unsigned) ((v[1] << 24) | (v[2] << 16) | (v[3] << 8) | v[4])) : NULL;
                 break;
-            case 5: // DSTPORT
-                dstport = ptr;
+            case TLV_U32LE:
+                str = (len == 4) ? apr_psprintf(c->pool, "%u", (unsigned) ((v[3] << 24) | (v[2] << 16) | (v[1] << 8) | v[0])) : NULL;
                 break;
-            case 1: // PROTO
-                if (strncmp("TCP", ptr, 3) == 0) {
-                    if ((ptr[3] != '4') &&
-                        (ptr[3] != '6')) {
-                        return FALSE;
+        }
+    }
+    st->tlv_vars[idx] = str ? str : absent;
+    return str;
+}
+
+/**
+ * Optional function: decoded TLV by variable name
+ */
+static const char *myfixip_tlv_var(conn_rec *c, const char *name)
+{
+    int idx = tlv_var_index(name);
+
+    return (idx < 0) ? NULL : tlv_var(c, idx);
+}
+
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+/**
+ * ap_expr variable: %{PROXY_*}
+ */
+static const char *expr_var_fn(ap_expr_eval_ctx_t *ctx, const void *data)
+{
+    return ctx->c ? tlv_var(ctx->c, (int) (apr_intptr_t) data) : NULL;
+}
+
+/**
+ * ap_expr function: proxy_tlv('<type>') raw value in hex
+ */
+static const char *expr_tlv_fn(ap_expr_eval_ctx_t *ctx, const void *data, const char *arg)
+{
+    const unsigned char *v;
+    apr_size_t len;
+
+    if (!ctx->c || !myfixip_tlv_get(ctx->c, (int) apr_strtoi64(arg, NULL, 0), &v, &len)) {
+        return NULL;
+    }
+    return tlv_hex(ctx->p, v, len);
+}
+
+/**
+ * Resolve ap_expr names once at config time (variable index as data)
+ */
+static int expr_lookup(ap_expr_lookup_parms *parms)
+{
+    int idx;
+
+    switch (parms->type) {
+        case AP_EXPR_FUNC_VAR:
+            if ((idx = tlv_var_index(parms->name)) >= 0) {
+                *parms->func = expr_var_fn;
+                *parms->data = (const void *) (apr_intptr_t) idx;
+                return OK;
+            }
+            break;
+        case AP_EXPR_FUNC_STRING:
+            if (!strcasecmp(parms->name, "proxy_tlv")) {
+                *parms->func = expr_tlv_fn;
+                *parms->data = NULL;
+                return OK;
+            }
+            break;
+    }
+    return DECLINED;
+}
+
+/**
+ * LogFormat %{PROXY_*}^pp
+ */
+static const char *log_tlv_var(request_rec *r, char *a)
+{
+    return myfixip_tlv_var(r->connection, a);
+}
+#endif
+
+/*
+ * TEST status line of this child: written by the refresh thread into the
+ * spare buffer, then published by switching "cur" (probes never walk the
+ * scoreboard)
+ */
+typedef struct {
+    char line[2][TEST_STATUS_LENGTH];
+    apr_uint32_t len[2];
+    apr_uint32_t cur;
+    int enabled;
+    int busy_percent;
+    apr_time_t stamp;              // last refresh
+#if APR_HAS_THREADS
+    apr_thread_t *thread;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int stop;
+#endif
+} my_test_status;
+
+static my_test_status test_status;
+
+/**
+ * Build TEST status line from the scoreboard
+ */
+static void test_status_refresh(void)
+{
+    int server_limit = 0, thread_limit = 0, max_daemons = 0, max_threads = 0;
+    int mpm_state = AP_MPMQ_RUNNING;
+    int i, j, busy = 0, idle = 0, capacity;
+    ap_generation_t gen;
+    const char *state;
+    apr_uint32_t next;
+
+    if (!ap_exists_scoreboard_image()) {
+        return;
+    }
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &server_limit);
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &thread_limit);
+    ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &max_daemons);
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &max_threads);
+    ap_mpm_query(AP_MPMQ_MPM_STATE, &mpm_state);
+    gen = ap_scoreboard_image->global->running_generation;
+
+    // Same rules as mod_status
+    for (i = 0; i < server_limit; ++i) {
+        process_score *ps = &ap_scoreboard_image->parent[i];
+        if (!ps->pid || ps->quiescing) {
+            continue;
+        }
+        for (j = 0; j < thread_limit; ++j) {
+            worker_score *ws = _WORKER_SCORE(i, j);
+            switch (ws->status) {
+                case SERVER_DEAD:
+                case SERVER_STARTING:
+                case SERVER_IDLE_KILL:
+                    break;
+                case SERVER_READY:
+                    if (ps->generation == gen) {
+                        ++idle;
                     }
-                }
-                break;
-            default:
-                srcip = dstip = srcport = dstport = NULL;
-                return FALSE;
+                    break;
+                default:
+                    ++busy;
+                    break;
+            }
         }
-        size -= (f + 1 - ptr);
-        ptr = f + 1;
-        tok++;
     }
-    if (!dstport) {
-        return FALSE;
+    capacity = ((max_daemons > 0) ? max_daemons : 1) * ((max_threads > 0) ? max_threads : 1);
+
+    if ((mpm_state == AP_MPMQ_STOPPING) || (ap_my_generation != gen)) {
+        state = "DRAIN";
     }
-    if (ctx->pad != ctx->magic) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::process_proxy_header padding magic fail (bad=%d vs good=%d)", ctx->pad, ctx->magic);
-        return FALSE;
+    else if ((idle == 0) || ((busy * 100) >= (test_status.busy_percent * capacity))) {
+        state = "BUSY";
+    }
+    else {
+        state = "OK";
+    }
+
+    next = !apr_atomic_read32(&test_status.cur);
+    test_status.len[next] = apr_snprintf(test_status.line[next], TEST_STATUS_LENGTH, "%s busy=%d idle=%d gen=%d\n", state, busy, idle, (int) gen);
+    apr_atomic_set32(&test_status.cur, next);
+    test_status.stamp = apr_time_now();
+}
+
+#if APR_HAS_THREADS
+/**
+ * Refresh thread (one per child)
+ */
+static void *APR_THREAD_FUNC test_status_thread(apr_thread_t *thd, void *data)
+{
+    apr_thread_mutex_lock(test_status.mutex);
+    while (!test_status.stop) {
+        test_status_refresh();
+        apr_thread_cond_timedwait(test_status.cond, test_status.mutex, apr_time_from_msec(TEST_STATUS_REFRESH));
     }
-    apr_table_set(c->notes, NOTE_REWRITE_IP, srcip);
-#ifdef DEBUG
-    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::process_proxy_header DEBUG: CMD=PROXY tokens OK");
+    apr_thread_mutex_unlock(test_status.mutex);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/**
+ * Stop refresh thread with the child
+ */
+static apr_status_t test_status_cleanup(void *data)
+{
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(test_status.mutex);
+    test_status.stop = 1;
+    apr_thread_cond_signal(test_status.cond);
+    apr_thread_mutex_unlock(test_status.mutex);
+    apr_thread_join(&rv, test_status.thread);
+    test_status.thread = NULL;
+    return APR_SUCCESS;
+}
 #endif
-    return TRUE;
+
+/**
+ * Start TEST status refresh in this child
+ */
+static void test_status_init(apr_pool_t *p, server_rec *s)
+{
+    my_config *conf = ap_get_module_config(s->module_config, &myfixip_module);
+
+    memset(&test_status, 0, sizeof(test_status));
+    test_status.enabled = conf->testStatus;
+    test_status.busy_percent = conf->testBusy;
+    if (!test_status.enabled) {
+        return;
+    }
+    test_status_refresh();
+#if APR_HAS_THREADS
+    if ((apr_thread_mutex_create(&test_status.mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS)
+        || (apr_thread_cond_create(&test_status.cond, p) != APR_SUCCESS)
+        || (apr_thread_create(&test_status.thread, NULL, test_status_thread, NULL, p) != APR_SUCCESS)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, MODULE_NAME "::test_status_init no refresh thread, TEST refreshes status when stale");
+        test_status.thread = NULL;
+        return;
+    }
+    // Before pchild destroys the thread pool (a subpool)
+    apr_pool_pre_cleanup_register(p, NULL, test_status_cleanup);
+#endif
+}
+
+/**
+ * Copy current TEST response (no scoreboard access unless no thread)
+ */
+static apr_size_t test_status_get(char *line)
+{
+    apr_uint32_t cur;
+
+    if (!test_status.enabled) {
+        memcpy(line, TEST_RES_OK, sizeof(TEST_RES_OK));
+        return strlen(TEST_RES_OK);
+    }
+#if APR_HAS_THREADS
+    if (!test_status.thread)
+#endif
+    {
+        if ((apr_time_now() - test_status.stamp) > apr_time_from_msec(TEST_STATUS_REFRESH)) {
+            test_status_refresh();
+        }
+    }
+    cur = apr_atomic_read32(&test_status.cur);
+    if (!test_status.len[cur]) {
+        memcpy(line, TEST_RES_OK, sizeof(TEST_RES_OK));
+        return strlen(TEST_RES_OK);
+    }
+    memcpy(line, test_status.line[cur], TEST_STATUS_LENGTH);
+    return test_status.len[cur];
+}
+
+/**
+ * Answer TEST command and close connection
+ */
+static apr_status_t send_test_response(conn_rec *c, apr_bucket_brigade *b)
+{
+    apr_socket_t *csd = ap_get_module_config(c->conn_config, &core_module);
+    char line[TEST_STATUS_LENGTH];
+    apr_size_t length = test_status_get(line);
+    apr_socket_send(csd, line, &length);
+    apr_socket_shutdown(csd, APR_SHUTDOWN_WRITE);
+    apr_socket_close(csd);
+
+    c->aborted = 1;
+    apr_brigade_cleanup(b);
+    return APR_ECONNABORTED;
+}
+
+typedef enum {
+    PEEK_PASS,     // not a header, nothing consumed
+    PEEK_DONE,     // header processed and consumed
+    PEEK_FALLBACK, // header incomplete in first segment: use buffered path
+    PEEK_TEST,     // TEST command
+    PEEK_INVALID,  // malformed header
+    PEEK_OVERFLOW  // header too long
+} peek_result;
+
+/**
+ * Classify the peeked bytes and copy exactly the header (if any) to ctx->buf
+ */
+static peek_result peek_classify(my_ctx *ctx, const char *str, apr_size_t len)
+{
+    apr_size_t hdrlen;
+
+    if (len < PROXY_HEAD_LENGTH) {
+        return PEEK_FALLBACK;
+    }
+    if (memcmp(TEST, str, 4) == 0) {
+        return PEEK_TEST;
+    }
+    if (memcmp(HELO, str, 4) == 0) {
+        hdrlen = PROXY_HEAD_LENGTH + 4;
+        if (len < hdrlen) {
+            return PEEK_FALLBACK;
+        }
+        ctx->phase = PHASE_WANT_BINIP;
+    }
+    else if (memcmp(PROXY, str, 4) == 0) {
+        const char *end = memchr(str, '\n', (len < PROXY_MAX_LENGTH) ? len : PROXY_MAX_LENGTH);
+        if (!end) {
+            return (len < PROXY_MAX_LENGTH) ? PEEK_FALLBACK : PEEK_OVERFLOW;
+        }
+        hdrlen = end + 1 - str;
+        ctx->phase = PHASE_WANT_LINE;
+    }
+    else if (memcmp(PROXY_V2_SIG, str, 4) == 0) {
+        if (len < PROXY_V2_HEAD_LENGTH) {
+            return PEEK_FALLBACK;
+        }
+        if (memcmp(PROXY_V2_SIG, str, PROXY_V2_SIG_LENGTH) != 0) {
+            return PEEK_INVALID;
+        }
+        hdrlen = PROXY_V2_HEAD_LENGTH + (((unsigned char) str[14] << 8) | (unsigned char) str[15]);
+        if (hdrlen > PROXY_V2_MAX_LENGTH) {
+            return PEEK_OVERFLOW;
+        }
+        if (len < hdrlen) {
+            return PEEK_FALLBACK;
+        }
+        ctx->phase = PHASE_WANT_V2ADDR;
+    }
+    else {
+        return PEEK_PASS;
+    }
+
+    memcpy(ctx->buf, str, hdrlen);
+    ctx->buf[hdrlen] = 0;
+    ctx->offset = hdrlen;
+    return PEEK_DONE;
+}
+
+/**
+ * Bound next read by the header deadline (APR_TIMEUP once expired)
+ */
+static apr_status_t header_deadline(my_ctx *ctx, apr_read_type_e block)
+{
+    apr_interval_time_t left;
+
+    if (!ctx->deadline) {
+        return APR_SUCCESS;
+    }
+    left = ctx->deadline - apr_time_now();
+    if (left <= 0) {
+        return APR_TIMEUP;
+    }
+    if ((block == APR_BLOCK_READ) && ctx->csd) {
+        if (!ctx->bounded) {
+            if (apr_socket_timeout_get(ctx->csd, &ctx->saved_timeout) != APR_SUCCESS) {
+                return APR_SUCCESS;
+            }
+            ctx->bounded = 1;
+        }
+        // Never past the deadline, never longer than Timeout
+        apr_socket_timeout_set(ctx->csd, ((ctx->saved_timeout >= 0) && (ctx->saved_timeout < left)) ? ctx->saved_timeout : left);
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Header deadline passed (otherwise APR_TIMEUP from a read is the socket
+ * Timeout, or a lower filter's own, and goes up unchanged)
+ */
+static int header_expired(const my_ctx *ctx)
+{
+    return ctx->deadline && (apr_time_now() >= ctx->deadline);
+}
+
+/**
+ * Header phase finished: give back socket Timeout
+ */
+static void header_deadline_restore(my_ctx *ctx)
+{
+    if (ctx->bounded) {
+        apr_socket_timeout_set(ctx->csd, ctx->saved_timeout);
+        ctx->bounded = 0;
+    }
 }
 
+/**
+ * Speculative header detection: look at the first segment with
+ * AP_MODE_SPECULATIVE and, if it holds a complete header, consume exactly
+ * that many bytes. The header bytes are copied once into ctx->buf
+ * (peek_classify); application data stays in the core input buffer.
+ */
+static apr_status_t peek_header(ap_filter_t *f, apr_read_type_e block, peek_result *res)
+{
+    conn_rec *c = f->c;
+    my_ctx *ctx = f->ctx;
+    apr_bucket_brigade *bb = apr_brigade_create(c->pool, c->bucket_alloc);
+    const char *str = NULL;
+    apr_size_t length = 0;
+    apr_status_t s;
+
+    s = ap_get_brigade(f->next, bb, AP_MODE_SPECULATIVE, block, PROXY_BUF_LENGTH);
+    if ((s == APR_SUCCESS) && APR_BRIGADE_EMPTY(bb) && (block == APR_NONBLOCK_READ)) {
+        s = APR_EAGAIN; // nothing yet, peek again on next call
+    }
+    if (s != APR_SUCCESS) {
+        apr_brigade_destroy(bb);
+        return s;
+    }
+    ctx->peeked = 1;
+    *res = PEEK_FALLBACK;
+    if (!APR_BRIGADE_EMPTY(bb) && !APR_BUCKET_IS_METADATA(APR_BRIGADE_FIRST(bb))) {
+        s = apr_bucket_read(APR_BRIGADE_FIRST(bb), &str, &length, APR_BLOCK_READ);
+        if (s == APR_SUCCESS) {
+            *res = peek_classify(ctx, str, length);
+        }
+    }
+    apr_brigade_cleanup(bb);
+    if (*res != PEEK_DONE) {
+        apr_brigade_destroy(bb);
+        return APR_SUCCESS;
+    }
+
+    // Consume exactly the header (already buffered by core: no wait)
+    apr_off_t left = ctx->offset;
+    while (left > 0) {
+        s = ap_get_brigade(f->next, bb, AP_MODE_READBYTES, APR_BLOCK_READ, left);
+        if (s != APR_SUCCESS) {
+            break;
+        }
+        apr_off_t got = 0;
+        apr_brigade_length(bb, 1, &got);
+        apr_brigade_cleanup(bb);
+        if (got <= 0) {
+            s = APR_EOF;
+            break;
+        }
+        left -= got;
+    }
+    apr_brigade_destroy(bb);
+    return s;
+}
 
 /**
  * Process input stream
@@ -531,24 +3537,68 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
     }
     // Fast passthrough
     if (ctx->phase == PHASE_DONE) {
+        ap_remove_input_filter(f);
         return ap_get_brigade(f->next, b, mode, block, readbytes);
     }
 
+    // Speculative path (application data left in the core buffer)
+    if (!ctx->peeked) {
+        peek_result res;
+        apr_status_t s = header_deadline(ctx, block);
+        if (s == APR_SUCCESS) {
+            s = peek_header(f, block, &res);
+        }
+        if (APR_STATUS_IS_TIMEUP(s) && header_expired(ctx)) {
+            goto ABORT_TIMEOUT;
+        }
+        if (s != APR_SUCCESS) {
+            return s;
+        }
+        TRACE(ctx->trace, c->id, TR_PEEK, res, ctx->offset);
+        switch (res) {
+            case PEEK_TEST:
+                ctx->stat = STAT_TEST;
+                stats_header_done(ctx);
+                return send_test_response(c, b);
+            case PEEK_OVERFLOW:
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in ERROR: PROXY protocol header overflow from=%s to port=%d", _CLIENT_IP, c->local_addr->port);
+                ctx->stat = STAT_OVERFLOW;
+                goto ABORT_CONN2;
+            case PEEK_INVALID:
+                goto ABORT_CONN;
+            case PEEK_DONE:
+                ctx->stat = (ctx->phase == PHASE_WANT_BINIP) ? STAT_HELO
+                          : (ctx->phase == PHASE_WANT_LINE) ? STAT_PROXY_V1 : STAT_PROXY_V2;
+                if (((ctx->phase == PHASE_WANT_BINIP) && !process_helo_header(f))
+                    || ((ctx->phase == PHASE_WANT_LINE) && !process_proxy_header(f))
+                    || ((ctx->phase == PHASE_WANT_V2ADDR) && !process_proxy_v2_header(f))) {
+                    goto ABORT_CONN;
+                }
+                /* fallthrough */
+            case PEEK_PASS:
+                if ((res == PEEK_PASS) && ctx->required) {
+                    goto ABORT_CONN;
+                }
+                ctx->phase = PHASE_DONE;
+                goto END_CONN;
+            case PEEK_FALLBACK:
+                break;
+        }
+    }
+
     // Process Head
     do {
-#ifdef DEBUG
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " phase=%d (1)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->phase);
-#endif
-
         if (APR_BRIGADE_EMPTY(b)) {
-#ifdef DEBUG
-            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " phase=%d (2)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->phase);
-#endif
-            apr_status_t s = ap_get_brigade(f->next, b, ctx->mode, APR_BLOCK_READ, ctx->need);
+            TRACE(ctx->trace, c->id, TR_READ, ctx->mode, ctx->need);
+            apr_status_t s = header_deadline(ctx, block);
+            if (s == APR_SUCCESS) {
+                s = ap_get_brigade(f->next, b, ctx->mode, block, ctx->need);
+            }
+            if (APR_STATUS_IS_TIMEUP(s) && header_expired(ctx)) {
+                goto ABORT_TIMEOUT;
+            }
             if (s != APR_SUCCESS) {
-#ifdef DEBUG
-                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " phase=%d (fail)(1)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->phase);
-#endif
+                TRACE(ctx->trace, c->id, TR_READ_FAIL, s, ctx->phase);
                 return s;
             }
         }
@@ -556,17 +3606,13 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
             return APR_SUCCESS;
         }
         if (APR_BRIGADE_EMPTY(b)) {
-#ifdef DEBUG
-            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " phase=%d (empty)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->phase);
-#endif
-            return APR_SUCCESS;
+            TRACE(ctx->trace, c->id, TR_EMPTY, block, ctx->phase);
+            return (block == APR_NONBLOCK_READ) ? APR_EAGAIN : APR_SUCCESS;
         }
         apr_bucket *e = NULL;
         for (e = APR_BRIGADE_FIRST(b); e != APR_BRIGADE_SENTINEL(b); e = APR_BUCKET_NEXT(e)) {
             if (e->type == NULL) {
-#ifdef DEBUG
-                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " phase=%d (type=NULL)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->phase);
-#endif
+                TRACE(ctx->trace, c->id, TR_EMPTY, -1, ctx->phase);
                 return APR_SUCCESS;
             }
 
@@ -574,19 +3620,16 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
             if (ctx->need > 0) {
                 const char *str = NULL;
                 apr_size_t length = 0;
-                apr_status_t s = apr_bucket_read(e, &str, &length, APR_BLOCK_READ);
+                apr_status_t s = apr_bucket_read(e, &str, &length, block);
                 if (s != APR_SUCCESS) {
-#ifdef DEBUG
-                    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " recv=%" APR_OFF_T_FMT " phase=%d readed=%" APR_SIZE_T_FMT " (fail)(2)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->recv, ctx->phase, length);
-#endif
+                    TRACE(ctx->trace, c->id, TR_READ_FAIL, s, ctx->phase);
                     return s;
                 }
-#ifdef DEBUG
-                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " recv=%" APR_OFF_T_FMT " phase=%d readed=%" APR_SIZE_T_FMT " (3)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->recv, ctx->phase, length);
-#endif
+                TRACE(ctx->trace, c->id, TR_BUCKET, length, ctx->need);
                 if (length > 0) {
-                    if ((ctx->offset + length) > PROXY_MAX_LENGTH) { // Overflow
+                    if ((ctx->offset + length) > ((ctx->phase >= PHASE_WANT_V2HEAD) ? PROXY_V2_MAX_LENGTH : PROXY_MAX_LENGTH)) { // Overflow
                         ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in ERROR: PROXY protocol header overflow from=%s to port=%d length=%" APR_OFF_T_FMT, _CLIENT_IP, c->local_addr->port, (ctx->offset + length));
+                        ctx->stat = STAT_OVERFLOW;
                         goto ABORT_CONN2;
                     }
                     memcpy(ctx->buf + ctx->offset, str, length);
@@ -605,9 +3648,7 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
                 }
                 apr_bucket_delete(e);
                 if (length == 0) {
-#ifdef DEBUG
-                    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG bucket flush=%d meta=%d", APR_BUCKET_IS_FLUSH(e) ? 1 : 0, APR_BUCKET_IS_METADATA(e) ? 1 : 0);
-#endif
+                    TRACE(ctx->trace, c->id, TR_META, APR_BUCKET_IS_FLUSH(e), APR_BUCKET_IS_METADATA(e));
                     continue;
                 }
             }
@@ -616,9 +3657,7 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
                 if ((ctx->need > 0) && (ctx->recv > 2)) {
                     char *end = memchr(ctx->buf, '\r', ctx->offset - 1);
                     if (end) {
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG: GETLINE OK");
-#endif
+                        TRACE(ctx->trace, c->id, TR_GETLINE, ctx->offset, ctx->recv);
                         if ((end[0] == '\r') && (end[1] == '\n')) {
                             ctx->need = 0;
                         }
@@ -626,67 +3665,50 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
                 }
             }
             if (ctx->need <= 0) {
-#ifdef DEBUG
-                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d need=%" APR_OFF_T_FMT " recv=%" APR_OFF_T_FMT " phase=%d (4)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->need, ctx->recv, ctx->phase);
-#endif
                 switch (ctx->phase) {
                     case PHASE_WANT_HEAD: {
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d phase=%d checking=%s buf=%s", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->phase, "HEAD", ctx->buf);
-#endif
                         // TEST Command
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG: CMD=TEST CHECK");
-#endif
-                        if (strncmp(TEST, ctx->buf, 4) == 0) {
-                            apr_socket_t *csd = ap_get_module_config(c->conn_config, &core_module);
-                            apr_size_t length = strlen(TEST_RES_OK);
-                            apr_socket_send(csd, TEST_RES_OK, &length);
-                            apr_socket_shutdown(csd, APR_SHUTDOWN_WRITE);
-                            apr_socket_close(csd);
-
-#ifdef DEBUG
-                            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG: CMD=TEST OK");
-#endif
-
-                            // No need to check for SUCCESS, we did that above
-                            c->aborted = 1;
-                            apr_brigade_cleanup(b);
-                            return APR_ECONNABORTED;
+                        if (strncmp(TEST, ctx->buf, 4) == 0) {
+                            ctx->stat = STAT_TEST;
+                            stats_header_done(ctx);
+                            return send_test_response(c, b);
                         }
                         // HELO Command
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG: CMD=HELO CHECK");
-#endif
                         if (strncmp(HELO, ctx->buf, 4) == 0) {
-#ifdef DEBUG
-                            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG: CMD=HELO OK");
-#endif
+                            TRACE(ctx->trace, c->id, TR_PHASE, PHASE_WANT_BINIP, ctx->offset);
                             ctx->phase = PHASE_WANT_BINIP;
+                            ctx->stat = STAT_HELO;
                             ctx->mode = AP_MODE_READBYTES;
                             ctx->need = 4;
                             ctx->recv = 0;
                             break;
                         }
                         // PROXY Command
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG: CMD=PROXY CHECK");
-#endif
                         if (strncmp(PROXY, ctx->buf, 4) == 0) {
-#ifdef DEBUG
-                            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG: CMD=PROXY OK");
-#endif
+                            TRACE(ctx->trace, c->id, TR_PHASE, PHASE_WANT_LINE, ctx->offset);
                             ctx->phase = PHASE_WANT_LINE;
+                            ctx->stat = STAT_PROXY_V1;
                             ctx->mode = AP_MODE_GETLINE;
                             ctx->need = PROXY_MAX_LENGTH - ctx->offset;
                             ctx->recv = 0;
                             break;
                         }
+                        // PROXY v2 Command
+                        if (memcmp(PROXY_V2_SIG, ctx->buf, 4) == 0) {
+                            TRACE(ctx->trace, c->id, TR_PHASE, PHASE_WANT_V2HEAD, ctx->offset);
+                            ctx->phase = PHASE_WANT_V2HEAD;
+                            ctx->stat = STAT_PROXY_V2;
+                            ctx->mode = AP_MODE_READBYTES;
+                            ctx->need = PROXY_V2_HEAD_LENGTH - ctx->offset;
+                            ctx->recv = 0;
+                            break;
+                        }
                         // ELSE... GET / POST / etc
+                        if (ctx->required) {
+                            goto ABORT_CONN;
+                        }
                         ctx->phase = PHASE_DONE;
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG from: %s:%d to port=%d newBucket (1) size=%" APR_OFF_T_FMT, _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->offset);
-#endif
+                        TRACE(ctx->trace, c->id, TR_RESTORE, ctx->offset, ctx->phase);
                         // Restore original data
                         if (ctx->offset) {
                             e = apr_bucket_heap_create(ctx->buf, ctx->offset, NULL, c->bucket_alloc);
@@ -696,27 +3718,14 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
                         break;
                     }
                     case PHASE_WANT_BINIP: {
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d phase=%d checking=%s", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->phase, "BINIP");
-#endif
                         // REWRITE CLIENT IP
-                        const char *new_ip = fromBinIPtoString(c->pool, ctx->buf+4);
-                        if (!new_ip) {
-                            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in ERROR: HELO+IP invalid");
+                        ctx->phase = PHASE_DONE;
+                        if (!process_helo_header(f)) {
                             goto ABORT_CONN;
                         }
-
-                        apr_table_set(c->notes, NOTE_REWRITE_IP, new_ip);
-                        ctx->phase = PHASE_DONE;
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG from: %s:%d to port=%d newip=%s", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, new_ip);
-#endif
                         break;
                     }
                     case PHASE_WANT_LINE: {
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d phase=%d checking=%s buf=%s", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->phase, "LINE", ctx->buf);
-#endif
                         ctx->phase = PHASE_DONE;
                         char *end = memchr(ctx->buf, '\r', ctx->offset - 1);
                         if (!end) {
@@ -730,9 +3739,7 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
                         }
                         // Restore original data
                         int count = (ctx->offset - ((end - ctx->buf) + 2));
-#ifdef DEBUG
-                        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in DEBUG from: %s:%d to port=%d newBucket (2) size=%d rest=%s", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, count, end + 2);
-#endif
+                        TRACE(ctx->trace, c->id, TR_RESTORE, count, ctx->phase);
                         if (count > 0) {
                             e = apr_bucket_heap_create(end + 2, count, NULL, c->bucket_alloc);
                             APR_BRIGADE_INSERT_HEAD(b, e);
@@ -740,11 +3747,36 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
                         }
                         break;
                     }
+                    case PHASE_WANT_V2HEAD: {
+                        if (memcmp(PROXY_V2_SIG, ctx->buf, PROXY_V2_SIG_LENGTH) != 0) {
+                            goto ABORT_CONN;
+                        }
+                        apr_off_t len = ((unsigned char) ctx->buf[14] << 8) | (unsigned char) ctx->buf[15];
+                        if ((PROXY_V2_HEAD_LENGTH + len) > PROXY_V2_MAX_LENGTH) { // Overflow
+                            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in ERROR: PROXY protocol v2 header overflow from=%s to port=%d length=%" APR_OFF_T_FMT, _CLIENT_IP, c->local_addr->port, (PROXY_V2_HEAD_LENGTH + len));
+                            ctx->stat = STAT_OVERFLOW;
+                            goto ABORT_CONN2;
+                        }
+                        if (len > 0) {
+                            ctx->phase = PHASE_WANT_V2ADDR;
+                            ctx->need = len;
+                            ctx->recv = 0;
+                            break;
+                        }
+                    }
+                    /* fallthrough */
+                    case PHASE_WANT_V2ADDR: {
+                        ctx->phase = PHASE_DONE;
+                        if (!process_proxy_v2_header(f)) {
+                            goto ABORT_CONN;
+                        }
+                        break;
+                    }
+                    case PHASE_DONE:
+                        break;
                 }
                 if (ctx->phase == PHASE_DONE) {
-#ifdef DEBUG
-                    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in from: %s:%d to port=%d phase=%d (DONE)", _CLIENT_IP, _CLIENT_ADDR->port, c->local_addr->port, ctx->phase);
-#endif
+                    TRACE(ctx->trace, c->id, TR_PHASE, ctx->phase, ctx->offset);
                     ctx->mode = mode;
                     ctx->need = 0;
                     ctx->recv = 0;
@@ -755,53 +3787,665 @@ static apr_status_t helocon_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_
     } while (ctx->phase != PHASE_DONE);
 
     END_CONN:
+        // Header handled: later reads (keepalive) skip this filter
+        stats_header_done(ctx);
+        header_deadline_restore(ctx);
+        ap_remove_input_filter(f);
         return ap_get_brigade(f->next, b, mode, block, readbytes);
 
+    ABORT_TIMEOUT:
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, NULL, MODULE_NAME "::helocon_filter_in ERROR: PROXY protocol header timeout from=%s to port=%d received=%" APR_OFF_T_FMT, _CLIENT_IP, c->local_addr->port, ctx->offset);
+        ctx->stat = STAT_TIMEOUT;
+        goto ABORT_CONN2;
+
     ABORT_CONN:
         ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::helocon_filter_in ERROR: PROXY protocol header invalid from=%s to port=%d", _CLIENT_IP, c->local_addr->port);
+        ctx->stat = STAT_ABORT;
     ABORT_CONN2:
+        if (penalty && ((ctx->stat == STAT_ABORT) || (ctx->stat == STAT_OVERFLOW))) { // never for a timeout
+            penalty_record(_CLIENT_ADDR);
+        }
+        stats_header_done(ctx);
+        header_deadline_restore(ctx);
         c->aborted = 1;
         apr_brigade_cleanup(b);
         return APR_ECONNABORTED;
 }
 
 
+/**
+ * Hop of a forwarding list element (str, len without commas) to binary:
+ * "ip", "ip:port", "[ipv6]", "[ipv6]:port" (quoted for RFC 7239)
+ */
+static int parse_hop(const char *str, apr_size_t len, int rfc7239, int *family, unsigned char *bin)
+{
+    const char *end = str + len;
+    const char *colon;
+
+    if (rfc7239) { // for= parameter of the element (pairs separated by ';')
+        const char *pair = str, *semi;
+        for (;; pair = semi + 1) {
+            while ((pair < end) && ((*pair == ' ') || (*pair == '\t'))) {
+                ++pair;
+            }
+            if (((end - pair) > 4) && (strncasecmp(pair, "for=", 4) == 0)) {
+                break;
+            }
+            semi = memchr(pair, ';', end - pair);
+            if (!semi) {
+                return 0;
+            }
+        }
+        str = pair + 4;
+        semi = memchr(str, ';', end - str);
+        end = semi ? semi : end;
+    }
+    // Trim OWS and quotes
+    while ((str < end) && ((*str == ' ') || (*str == '\t'))) {
+        ++str;
+    }
+    while ((end > str) && ((end[-1] == ' ') || (end[-1] == '\t'))) {
+        --end;
+    }
+    if (((end - str) >= 2) && (*str == '"') && (end[-1] == '"')) {
+        ++str;
+        --end;
+    }
+    len = end - str;
+    if ((len == 0) || (len > INET6_ADDRSTRLEN + 8)) { // [ipv6]:port
+        return 0;
+    }
+    if (*str == '[') {
+        const char *close = memchr(str, ']', len);
+        if (!close || ((close + 1 < end) && (close[1] != ':'))
+            || !parse_ipv6_n(str + 1, close - str - 1, bin)) {
+            return 0;
+        }
+        *family = AF_INET6;
+    }
+    else if ((colon = memchr(str, ':', len)) && memchr(colon + 1, ':', end - colon - 1)) {
+        if (!parse_ipv6_n(str, len, bin)) {
+            return 0;
+        }
+        *family = AF_INET6;
+    }
+    else {
+        if (!parse_ipv4_n(str, colon ? (apr_size_t) (colon - str) : len, bin)) {
+            return 0;
+        }
+        *family = AF_INET;
+    }
+    fold_v4mapped(family, bin);
+    return 1;
+}
+
+/**
+ * Address (binary) in RewriteIPAllow of server
+ */
+static int trusted_hop(my_config *conf, int family, const unsigned char *bin)
+{
+    apr_sockaddr_t sa;
+
+    build_sockaddr(&sa, NULL, family, bin, 0);
+    return find_acl(conf, &sa);
+}
+
+/**
+ * Walk forwarding header from the right (nearest hop first) while hops
+ * are trusted. Every header instance and byte is visited once, in place
+ * (no copy, no allocation). Returns 1 with the client address.
+ */
+static int forwarded_walk(request_rec *r, my_config *conf, int *family, unsigned char *addr)
+{
+    const apr_array_header_t *arr = apr_table_elts(r->headers_in);
+    const apr_table_entry_t *e = (const apr_table_entry_t *) arr->elts;
+    unsigned char bin[16];
+    int i, f, found = 0;
+
+    // Last instance holds the nearest hops
+    for (i = arr->nelts - 1; i >= 0; --i) {
+        if (!e[i].key || strcasecmp(e[i].key, conf->forwardedHeader)) {
+            continue;
+        }
+        const char *val = e[i].val;
+        const char *end = val + strlen(val);
+        while (end > val) {
+            const char *p = end;
+            while ((p > val) && (p[-1] != ',')) {
+                --p;
+            }
+            if (strspn(p, " \t") < (apr_size_t) (end - p)) { // skip empty elements
+                if (!parse_hop(p, end - p, conf->forwardedRfc7239, &f, bin)) {
+                    return found; // not an address: stop at last trusted hop
+                }
+                *family = f;
+                memcpy(addr, bin, 16);
+                found = 1;
+                if (!trusted_hop(conf, f, bin)) {
+                    return 1;
+                }
+            }
+            end = (p > val) ? (p - 1) : val;
+        }
+    }
+    return found;
+}
 
 static int post_read_handler(request_rec *r)
 {
     conn_rec *c = r->connection;
-    my_config *conf = ap_get_module_config (c->base_server->module_config, &myfixip_module);
+    my_config *conf = ap_get_module_config (r->server->module_config, &myfixip_module);
+    my_conn_state *st = get_conn_state(c);
 
+    const char *hdr = conf->clientHeader ? conf->clientHeader : HDR_USERAGENT_IP;
     const char *new_ip = NULL;
+    unsigned char addr[16];
+    int family = 0;
+    my_source source = SOURCE_NONE;
+    apr_port_t port = 0;
 
     // Save original IP
-    save_req_ip(r);
+    save_req_ip(r, st, conf);
 
-    new_ip = apr_table_get(c->notes, NOTE_REWRITE_IP);
-    if (conf->resetHeader || new_ip || !check_trusted(c, conf)) {
-        apr_table_unset(r->headers_in, HDR_USERAGENT_IP);
+    if (st->family) {
+        new_ip = rewrite_ip_string(c, st);
+    }
+    if (conf->resetHeader || new_ip || conf->forwardedHeader || !check_trusted(c, conf)) {
+        apr_table_unset(r->headers_in, hdr);
     }
     if (new_ip) {
-        // Set Header
-        apr_table_set(r->headers_in, HDR_USERAGENT_IP, new_ip);
-    } else {
+        family = st->family;
+        memcpy(addr, st->addr, sizeof(addr));
+        source = st->source;
+        port = st->port;
+    } else if (!conf->forwardedHeader) {
         // Get Header
-        new_ip = apr_table_get(r->headers_in, HDR_USERAGENT_IP);
+        new_ip = apr_table_get(r->headers_in, hdr);
+        if (new_ip && parse_ip(new_ip, &family, addr)) {
+            source = SOURCE_HEADER;
+        } else { // Not an IP literal
+            family = 0;
+        }
+    }
+    // Walk forwarding list from a trusted peer (or trusted PROXY/HELO address)
+    if (conf->forwardedHeader && !conf->resetHeader
+        && (family ? trusted_hop(conf, family, addr) : check_trusted(c, conf))
+        && forwarded_walk(r, conf, &family, addr)) {
+        source = SOURCE_HEADER;
+        port = 0;
     }
 
-#ifdef DEBUG
-    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, MODULE_NAME "::post_read_handler IP Connection from: %s:%d [%s] to port=%d newip=%s (OK)", _CLIENT_IP, _CLIENT_ADDR->port, _USERAGENT_IP, c->local_addr->port, new_ip);
-#endif
-    if (new_ip && strcmp(_USERAGENT_IP, new_ip)) { // Change
-        rewrite_req_ip(r, new_ip);
+    if (family) {
+        rewrite_req_ip(r, st, family, addr, port);
+        st->ua_source = source;
+        // Set Header
+        if (source != SOURCE_HEADER) {
+            apr_table_setn(r->headers_in, hdr, new_ip);
+        }
+        else if (conf->forwardedHeader && strcasecmp(hdr, conf->forwardedHeader)) {
+            apr_table_set(r->headers_in, hdr, st->ua_ip);
+        }
+    }
+    else {
+        st->ua_source = SOURCE_NONE;
+    }
+
+    // Limits by real client (not for a trusted peer speaking for itself)
+    if (clients && (family || !check_trusted(c, conf))) {
+        int rc = clients_check(r, st);
+        if (rc != OK) {
+            return rc;
+        }
+    }
+
+    // Export TLVs (only those listed in RewriteIPProxyEnv are decoded)
+    if (st->tlv && conf->tlvEnv->nelts) {
+        const int *idx = (const int *) conf->tlvEnv->elts;
+        int i;
+        for (i = 0; i < conf->tlvEnv->nelts; ++i) {
+            const char *val = tlv_var(c, idx[i]);
+            if (val) {
+                apr_table_setn(r->subprocess_env, tlv_vars[idx[i]].name, val);
+            }
+        }
     }
 
     return DECLINED;
 }
 
+/**
+ * Optional function: peer address before any rewrite
+ */
+static apr_sockaddr_t *myfixip_original_addr(conn_rec *c)
+{
+    my_conn_state *st = ap_get_module_config(c->conn_config, &myfixip_module);
+
+    // Saved on first request (2.2 rewrites the connection address itself)
+    return (st && st->original_addr) ? st->original_addr : _CLIENT_ADDR;
+}
+
+/**
+ * Optional function: rewritten useragent address of last request
+ */
+static apr_sockaddr_t *myfixip_rewrite_addr(conn_rec *c)
+{
+    my_conn_state *st = ap_get_module_config(c->conn_config, &myfixip_module);
+
+    return (st && st->ua_source) ? st->ua_addr : NULL;
+}
+
+/**
+ * Optional function: peer is trusted (RewriteIPAllow)
+ */
+static int myfixip_trusted(conn_rec *c)
+{
+    my_config *conf = ap_get_module_config(c->base_server->module_config, &myfixip_module);
+
+    return check_trusted(c, conf);
+}
+
+/**
+ * Optional function: origin of rewritten address (MYFIXIP_SOURCE_*)
+ */
+static int myfixip_source(conn_rec *c)
+{
+    my_conn_state *st = ap_get_module_config(c->conn_config, &myfixip_module);
+
+    return st ? st->ua_source : SOURCE_NONE;
+}
+
+/**
+ * Status handler: statistics of all children (Prometheus text or JSON)
+ */
+static int status_handler(request_rec *r)
+{
+    my_stats_slot sum;
+    apr_uint32_t i, j, used, total = 0;
+    int json;
+
+    if (strcmp(r->handler, STATUS_HANDLER)) {
+        return DECLINED;
+    }
+    if (!stats) {
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    // Aggregate slots (each counter is read atomically, not the set)
+    memset(&sum, 0, sizeof(sum));
+    used = 0;
+    for (i = 0; i < stats->nslots; ++i) {
+        my_stats_slot *sl = &stats->slot[i];
+        used += (apr_atomic_read32(&sl->pid) != 0);
+        for (j = 0; j < STAT_MAX; ++j) {
+            sum.count[j] += apr_atomic_read32(&sl->count[j]);
+        }
+        for (j = 0; j < LIMIT_MAX; ++j) {
+            sum.limited[j] += apr_atomic_read32(&sl->limited[j]);
+        }
+        for (j = 0; j < STAT_HIST_BUCKETS; ++j) {
+            sum.hist[j] += apr_atomic_read32(&sl->hist[j]);
+        }
+        sum.inflight += apr_atomic_read32(&sl->inflight);
+        sum.hist_sum += stat_sum_read(&sl->hist_sum);
+    }
+
+    json = (r->args && strstr(r->args, "json"));
+    ap_set_content_type(r, json ? "application/json" : "text/plain; version=0.0.4");
+    apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+    if (r->header_only) {
+        return OK;
+    }
+
+    if (json) {
+        ap_rprintf(r, "{\"version\":\"%s\",\"children\":%u,\"inflight\":%u,\"connections\":{", MODULE_VERSION, used, sum.inflight);
+        for (j = 0; j < STAT_MAX; ++j) {
+            ap_rprintf(r, "%s\"%s\":%u", j ? "," : "", stat_names[j], sum.count[j]);
+        }
+        ap_rputs("},\"header_duration_usec\":{\"buckets\":[", r);
+        for (j = 0; j < STAT_HIST_BUCKETS; ++j) {
+            total += sum.hist[j];
+            if (j < STAT_HIST_BUCKETS - 1) {
+                ap_rprintf(r, "%s{\"le\":%u,\"count\":%u}", j ? "," : "", 1U << j, total);
+            }
+            else {
+                ap_rprintf(r, ",{\"le\":\"+Inf\",\"count\":%u}", total);
+            }
+        }
+        ap_rprintf(r, "],\"sum\":%.0f,\"count\":%u}", (double) sum.hist_sum * (1000000.0 / STAT_SUM_PER_SEC), total);
+        if (penalty) {
+            ap_rprintf(r, ",\"penalized_peers\":%u", penalty_count());
+        }
+        if (clients) {
+            apr_uint32_t active, over = clients_count(&active);
+            ap_rprintf(r, ",\"clients\":{\"active\":%u,\"limited\":%u,\"rejected\":{", active, over);
+            for (j = 0; j < LIMIT_MAX; ++j) {
+                ap_rprintf(r, "%s\"%s\":%u", j ? "," : "", limit_names[j], sum.limited[j]);
+            }
+            ap_rputs("}}", r);
+        }
+        ap_rputs("}\n", r);
+        return OK;
+    }
+
+    ap_rputs("# HELP myfixip_connections_total Connections by PROXY header outcome.\n"
+             "# TYPE myfixip_connections_total counter\n", r);
+    for (j = 0; j < STAT_MAX; ++j) {
+        ap_rprintf(r, "myfixip_connections_total{outcome=\"%s\"} %u\n", stat_names[j], sum.count[j]);
+    }
+    ap_rprintf(r, "# HELP myfixip_header_inflight Connections waiting for the header.\n"
+                  "# TYPE myfixip_header_inflight gauge\n"
+                  "myfixip_header_inflight %u\n", sum.inflight);
+    ap_rprintf(r, "# HELP myfixip_children Child processes reporting statistics.\n"
+                  "# TYPE myfixip_children gauge\n"
+                  "myfixip_children %u\n", used);
+    ap_rputs("# HELP myfixip_header_duration_seconds Time from accept to header handled.\n"
+             "# TYPE myfixip_header_duration_seconds histogram\n", r);
+    for (j = 0; j < STAT_HIST_BUCKETS; ++j) {
+        total += sum.hist[j];
+        if (j < STAT_HIST_BUCKETS - 1) {
+            ap_rprintf(r, "myfixip_header_duration_seconds_bucket{le=\"%.6f\"} %u\n", (double) (1U << j) / 1000000.0, total);
+        }
+        else {
+            ap_rprintf(r, "myfixip_header_duration_seconds_bucket{le=\"+Inf\"} %u\n", total);
+        }
+    }
+    ap_rprintf(r, "myfixip_header_duration_seconds_sum %.6f\n", (double) sum.hist_sum / STAT_SUM_PER_SEC);
+    ap_rprintf(r, "myfixip_header_duration_seconds_count %u\n", total);
+    if (penalty) {
+        ap_rprintf(r, "# HELP myfixip_penalized_peers Peers in the penalty box.\n"
+                      "# TYPE myfixip_penalized_peers gauge\n"
+                      "myfixip_penalized_peers %u\n", penalty_count());
+    }
+    if (clients) {
+        apr_uint32_t active, over = clients_count(&active);
+        ap_rprintf(r, "# HELP myfixip_clients Real clients with a connection or recent requests.\n"
+                      "# TYPE myfixip_clients gauge\n"
+                      "myfixip_clients %u\n"
+                      "# HELP myfixip_clients_limited Real clients at a limit now.\n"
+                      "# TYPE myfixip_clients_limited gauge\n"
+                      "myfixip_clients_limited %u\n", active, over);
+        ap_rputs("# HELP myfixip_client_rejected_total Requests rejected by client limit.\n"
+                 "# TYPE myfixip_client_rejected_total counter\n", r);
+        for (j = 0; j < LIMIT_MAX; ++j) {
+            ap_rprintf(r, "myfixip_client_rejected_total{limit=\"%s\"} %u\n", limit_names[j], sum.limited[j]);
+        }
+    }
+
+    return OK;
+}
+
+/*
+ * Trace decoding: event names and argument labels
+ */
+static const struct {
+    const char *name;
+    const char *a;
+    const char *b;
+} trace_names[TR_MAX] = {
+    { "conn",     "port",   "client_port" },
+    { "peek",     "result", "length" },
+    { "read",     "mode",   "need" },
+    { "readfail", "status", "phase" },
+    { "empty",    "block",  "phase" },
+    { "bucket",   "length", "need" },
+    { "meta",     "flush",  "metadata" },
+    { "getline",  "offset", "recv" },
+    { "phase",    "phase",  "offset" },
+    { "restore",  "length", "phase" },
+    { "token",    "index",  "length" },
+    { "proxyv2",  "family", "length" },
+    { "rewrite",  "source", "port" },
+    { "done",     "outcome", "usec" },
+    { "request",  "family", "port" }
+};
+
+typedef struct {
+    apr_uint32_t slot;
+    apr_uint32_t pid;
+    my_trace_rec rec;
+} trace_entry;
+
+/**
+ * Order trace entries by child, connection, sequence
+ */
+static int trace_entry_cmp(const void *a, const void *b)
+{
+    const trace_entry *x = a, *y = b;
+
+    if (x->slot != y->slot) return (x->slot < y->slot) ? -1 : 1;
+    if (x->rec.conn != y->rec.conn) return (x->rec.conn < y->rec.conn) ? -1 : 1;
+    if (x->rec.seq != y->rec.seq) return (x->rec.seq < y->rec.seq) ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Copy the consistent records of trace segment t (live, or a dump) of
+ * connection conn (-1 = all) into all, sorted; returns their count.
+ * Records being written or overwritten while copied are skipped.
+ */
+static apr_uint32_t trace_collect(const my_trace *t, long conn, trace_entry *all)
+{
+    apr_uint32_t i, k, n = 0;
+
+    for (i = 0; i < t->nslots; ++i) {
+        my_trace_ring *ring = TRACE_RING(t, i);
+        for (k = 0; k < t->size; ++k) {
+            apr_uint32_t seq = apr_atomic_read32(&ring->rec[k].seq);
+            if (!seq) {
+                continue;
+            }
+            all[n].rec = ring->rec[k];
+            if ((apr_atomic_read32(&ring->rec[k].seq) != seq) || (all[n].rec.seq != seq)
+                || (all[n].rec.ev >= TR_MAX) || ((conn >= 0) && (all[n].rec.conn != (apr_uint32_t) conn))) {
+                continue;
+            }
+            all[n].slot = i;
+            all[n].pid = ring->pid;
+            ++n;
+        }
+    }
+    qsort(all, n, sizeof(trace_entry), trace_entry_cmp);
+    return n;
+}
+
+/**
+ * Print per-connection timelines of collected entries, a line at a time
+ */
+static void trace_print(const my_trace *t, const trace_entry *all, apr_uint32_t n,
+                        void (*out)(void *data, const char *line), void *data)
+{
+    char line[256];
+    apr_uint32_t k, first = 0;
+
+    apr_snprintf(line, sizeof(line), "%s trace: sample=%u events=%u children=%u\n", MODULE_NAME,
+                 apr_atomic_read32((apr_uint32_t *) &t->sample), n, t->nslots);
+    out(data, line);
+    for (k = 0; k < n; ++k) {
+        const my_trace_rec *rec = &all[k].rec;
+        if ((k == 0) || (all[k].slot != all[k - 1].slot) || (rec->conn != all[k - 1].rec.conn)) {
+            apr_snprintf(line, sizeof(line), "\nchild %u pid %u conn %u\n", all[k].slot, all[k].pid, rec->conn);
+            out(data, line);
+            first = rec->usec;
+        }
+        if (rec->ev == TR_DONE) {
+            apr_snprintf(line, sizeof(line), "  +%8uus %-8s %s=%s %s=%d (line %u)\n", rec->usec - first, trace_names[rec->ev].name,
+                         trace_names[rec->ev].a, ((rec->a >= 0) && (rec->a < STAT_MAX)) ? stat_names[rec->a] : "?",
+                         trace_names[rec->ev].b, rec->b, rec->line);
+        }
+        else {
+            apr_snprintf(line, sizeof(line), "  +%8uus %-8s %s=%d %s=%d (line %u)\n", rec->usec - first, trace_names[rec->ev].name,
+                         trace_names[rec->ev].a, rec->a, trace_names[rec->ev].b, rec->b, rec->line);
+        }
+        out(data, line);
+    }
+}
+
+/**
+ * Size of trace segment t (header and rings)
+ */
+static apr_size_t trace_bytes(const my_trace *t)
+{
+    return APR_ALIGN_DEFAULT(sizeof(my_trace)) + t->nslots * t->ring_bytes;
+}
+
+/**
+ * Copy of the live trace segment, records changed while copied cleared
+ */
+static my_trace *trace_dump(apr_pool_t *p)
+{
+    apr_size_t size = trace_bytes(trace);
+    my_trace *copy = apr_palloc(p, size);
+    apr_uint32_t i, k;
+
+    memcpy(copy, trace, size);
+    for (i = 0; i < copy->nslots; ++i) {
+        my_trace_ring *live = TRACE_RING(trace, i), *ring = TRACE_RING(copy, i);
+        for (k = 0; k < copy->size; ++k) {
+            if (ring->rec[k].seq && (apr_atomic_read32(&live->rec[k].seq) != ring->rec[k].seq)) {
+                ring->rec[k].seq = 0;
+            }
+        }
+    }
+    return copy;
+}
+
+static void trace_out_request(void *data, const char *line)
+{
+    ap_rputs(line, (request_rec *) data);
+}
+
+/**
+ * Trace handler: per-connection timelines of all children ("?conn=ID"),
+ * raw segment for the offline decoder ("?raw"), sampling changed by POST
+ * ("?sample=N")
+ */
+static int trace_handler(request_rec *r)
+{
+    const char *arg;
+    trace_entry *all;
+    apr_uint32_t n;
+    long conn = -1;
+    int rv;
+
+    if (strcmp(r->handler, TRACE_HANDLER)) {
+        return DECLINED;
+    }
+    if (!trace) {
+        return HTTP_NOT_FOUND;
+    }
+    r->allowed |= (AP_METHOD_BIT << M_GET) | (AP_METHOD_BIT << M_POST);
+    if (r->args && (arg = strstr(r->args, "sample="))) {
+        // Shared state: never changed by a GET (crawlers, prefetch, caches)
+        if (r->method_number != M_POST) {
+            return HTTP_METHOD_NOT_ALLOWED;
+        }
+        if ((rv = ap_discard_request_body(r)) != OK) {
+            return rv;
+        }
+        apr_atomic_set32(&trace->sample, (apr_uint32_t) atoi(arg + 7));
+    }
+    else if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if (r->args && (arg = strstr(r->args, "conn="))) {
+        conn = atol(arg + 5);
+    }
+
+    apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+    if (r->args && !strcmp(r->args, "raw")) {
+        ap_set_content_type(r, "application/octet-stream");
+        if (!r->header_only) {
+            ap_rwrite(trace_dump(r->pool), (int) trace_bytes(trace), r);
+        }
+        return OK;
+    }
+    ap_set_content_type(r, "text/plain");
+    if (r->header_only) {
+        return OK;
+    }
+
+    all = apr_palloc(r->pool, trace->nslots * trace->size * sizeof(trace_entry));
+    n = trace_collect(trace, conn, all);
+    trace_print(trace, all, n, trace_out_request, r);
+
+    return OK;
+}
+
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+    APR_OPTIONAL_FN_TYPE(ap_register_log_handler) *log_register = APR_RETRIEVE_OPTIONAL_FN(ap_register_log_handler);
+
+    if (log_register) {
+        log_register(pconf, "^pp", log_tlv_var, 0);
+    }
+#endif
+    return OK;
+}
+
+/**
+ * Release slot of this child (pchild cleanup)
+ */
+static apr_status_t slot_release(void *data)
+{
+    apr_atomic_cas32((apr_uint32_t *) data, 0, (apr_uint32_t) getpid());
+    return APR_SUCCESS;
+}
+
+/**
+ * Claim a slot for this child: CAS on the owner pid of each slot (stride
+ * bytes apart), free ones first, then the ones of children gone without
+ * running their cleanup (killed). Released when pchild is destroyed.
+ */
+static int slot_claim(apr_pool_t *pchild, char *pid0, apr_size_t stride, apr_uint32_t nslots)
+{
+    apr_uint32_t pid = (apr_uint32_t) getpid(), i, owner;
+    int pass;
+
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < nslots; ++i) {
+            apr_uint32_t *slot = (apr_uint32_t *) (pid0 + i * stride);
+            owner = apr_atomic_read32(slot);
+            if ((pass == 0) ? (owner != 0) : ((owner == 0) || (kill((pid_t) owner, 0) == 0) || (errno != ESRCH))) {
+                continue;
+            }
+            if (apr_atomic_cas32(slot, pid, owner) == owner) {
+                apr_pool_cleanup_register(pchild, slot, slot_release, apr_pool_cleanup_null);
+                return (int) i;
+            }
+        }
+    }
+    return -1;
+}
+
 static void child_init(apr_pool_t *p, server_rec *s)
 {
+    int i;
+
     ap_add_version_component(p, MODULE_NAME "/" MODULE_VERSION);
+
+    // Slots of this child (owned while it lives, never shared)
+    stats_slot = NULL;
+    trace_ring = NULL;
+    if (stats) {
+        i = slot_claim(p, (char *) &stats->slot[0].pid, sizeof(my_stats_slot), stats->nslots);
+        if (i >= 0) {
+            stats_slot = &stats->slot[i];
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, MODULE_NAME "::child_init no free statistics slot, this child is not counted");
+        }
+    }
+    if (trace) {
+        i = slot_claim(p, (char *) &TRACE_RING(trace, 0)->pid, trace->ring_bytes, trace->nslots);
+        if (i >= 0) {
+            trace_ring = TRACE_RING(trace, i);
+        }
+    }
+    test_status_init(p, s);
+#if APR_HAS_THREADS
+    apr_threadkey_private_create(&outbound_key, free, p);
+#endif
 }
 
 static void register_hooks(apr_pool_t *p)
@@ -816,10 +4460,26 @@ static void register_hooks(apr_pool_t *p)
      * be called before mod_ssl.
      */
     ap_register_input_filter(myfixip_filter_name, helocon_filter_in, NULL, AP_FTYPE_CONNECTION + 9);
+    // Backend: header below mod_ssl (clear text), check above it
+    ap_register_output_filter(myfixip_out_filter_name, outbound_filter_out, NULL, AP_FTYPE_CONNECTION + 9);
+    ap_register_input_filter(myfixip_check_filter_name, outbound_filter_in, NULL, AP_FTYPE_CONNECTION);
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_pre_connection(pre_connection, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_read_request(post_read_handler, NULL, postread_afterme_list, APR_HOOK_REALLY_FIRST);
+    ap_hook_fixups(outbound_fixups, NULL, NULL, APR_HOOK_REALLY_LAST);
+    ap_hook_handler(status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(trace_handler, NULL, NULL, APR_HOOK_MIDDLE);
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+    ap_hook_expr_lookup(expr_lookup, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
+    APR_REGISTER_OPTIONAL_FN(myfixip_original_addr);
+    APR_REGISTER_OPTIONAL_FN(myfixip_rewrite_addr);
+    APR_REGISTER_OPTIONAL_FN(myfixip_trusted);
+    APR_REGISTER_OPTIONAL_FN(myfixip_source);
+    APR_REGISTER_OPTIONAL_FN(myfixip_tlv_get);
+    APR_REGISTER_OPTIONAL_FN(myfixip_tlv_var);
 }
 
 module AP_MODULE_DECLARE_DATA myfixip_module = {
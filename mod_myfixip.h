@@ -0,0 +1,109 @@
+/*
+    Apache 2.2/2.4 mod_myfixip -- Author: G.Grandes
+
+    Optional functions exported by mod_myfixip for other modules.
+
+    Retrieve them once (post_config or later) with:
+
+      APR_OPTIONAL_FN_TYPE(myfixip_tlv_get) *tlv_get =
+          APR_RETRIEVE_OPTIONAL_FN(myfixip_tlv_get);
+
+    and check for NULL (mod_myfixip not loaded).
+
+    = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef MOD_MYFIXIP_H
+#define MOD_MYFIXIP_H
+
+#include "httpd.h"
+#include "apr_optional.h"
+
+/*
+ * Origin of the rewritten address (myfixip_source)
+ */
+#define MYFIXIP_SOURCE_NONE     0 // not rewritten
+#define MYFIXIP_SOURCE_HELO     1
+#define MYFIXIP_SOURCE_PROXY_V1 2
+#define MYFIXIP_SOURCE_PROXY_V2 3
+#define MYFIXIP_SOURCE_HEADER   4 // HTTP header of a trusted peer
+
+/**
+ * Address of the peer before any rewrite (the LB / proxy)
+ */
+APR_DECLARE_OPTIONAL_FN(apr_sockaddr_t *, myfixip_original_addr, (conn_rec *c));
+
+/**
+ * Rewritten useragent address of the last request read on c
+ * (NULL = not rewritten)
+ */
+APR_DECLARE_OPTIONAL_FN(apr_sockaddr_t *, myfixip_rewrite_addr, (conn_rec *c));
+
+/**
+ * Peer is in RewriteIPAllow of the connection's server: 1 = yes, 0 = no
+ */
+APR_DECLARE_OPTIONAL_FN(int, myfixip_trusted, (conn_rec *c));
+
+/**
+ * Origin of myfixip_rewrite_addr (MYFIXIP_SOURCE_*)
+ */
+APR_DECLARE_OPTIONAL_FN(int, myfixip_source, (conn_rec *c));
+
+/*
+ * PROXY protocol v2 TLV types
+ */
+#define PP2_TYPE_ALPN           0x01
+#define PP2_TYPE_AUTHORITY      0x02
+#define PP2_TYPE_CRC32C         0x03
+#define PP2_TYPE_NOOP           0x04
+#define PP2_TYPE_UNIQUE_ID      0x05
+#define PP2_TYPE_SSL            0x20
+#define PP2_SUBTYPE_SSL_VERSION 0x21
+#define PP2_SUBTYPE_SSL_CN      0x22
+#define PP2_SUBTYPE_SSL_CIPHER  0x23
+#define PP2_SUBTYPE_SSL_SIG_ALG 0x24
+#define PP2_SUBTYPE_SSL_KEY_ALG 0x25
+#define PP2_TYPE_NETNS          0x30
+#define PP2_TYPE_AWS            0xEA
+#define PP2_SUBTYPE_AWS_VPCE_ID 0x01
+#define PP2_TYPE_AZURE          0xEE
+#define PP2_SUBTYPE_AZURE_PRIVATEENDPOINT_LINKID 0x01
+
+#define PP2_CLIENT_SSL          0x01 // PP2_TYPE_SSL client flags
+#define PP2_CLIENT_CERT_CONN    0x02
+#define PP2_CLIENT_CERT_SESS    0x04
+
+/*
+ * Nested TLV: sub-TLV of PP2_TYPE_SSL (after client + verify fields), or
+ * vendor TLV whose value starts with a subtype byte (AWS, Azure)
+ */
+#define MYFIXIP_TLV(type, subtype) (((type) << 8) | (subtype))
+
+/**
+ * Raw value of a TLV of the PROXY v2 header of connection c (no copy,
+ * valid for the life of the connection). type is a PP2_TYPE_* or
+ * MYFIXIP_TLV(PP2_TYPE_*, PP2_SUBTYPE_*).
+ * Returns 1 if found, 0 if the connection has no such TLV.
+ */
+APR_DECLARE_OPTIONAL_FN(int, myfixip_tlv_get,
+                        (conn_rec *c, int type, const unsigned char **value, apr_size_t *len));
+
+/**
+ * Decoded TLV by variable name (PROXY_SSL_CN, PROXY_AWS_VPCE_ID, ...),
+ * cached per connection. Returns NULL if unknown name or absent TLV.
+ */
+APR_DECLARE_OPTIONAL_FN(const char *, myfixip_tlv_var,
+                        (conn_rec *c, const char *name));
+
+#endif /* MOD_MYFIXIP_H */
@@ -8,6 +8,21 @@
 **    $ apxs2 -c -i mod_node.c
 **
 **  This module add header "Node: X" (where X is the hostname)
+**
+**  Node affinity (optional, global config):
+**
+**    NodeAffinity <index> <secret>
+**    NodeAffinityCookie <name> [attributes]   (default: NODE "Path=/; HttpOnly")
+**    NodeAffinityHeader <name>                (header instead of cookie)
+**
+**  Issues the token "<mac>.<index>" where mac is the first 8 bytes (hex) of
+**  HMAC-SHA1(secret, index), shared by all nodes. The token is built once in
+**  post_config: a request already carrying it costs a memcmp, any other
+**  value (absent, other node, forged) gets the token of this node in the
+**  response. The route is after the first dot, as mod_proxy_balancer
+**  stickysession expects (BalancerMember ... route=<index>), so a local LB
+**  decodes it in O(1) without a lookup table; with the secret it can also
+**  verify the mac. Env NODE_AFFINITY is "hit" or "miss" for logging.
 */ 
 
 #include "httpd.h"
@@ -15,35 +30,232 @@
 #include "http_protocol.h"
 #include "http_log.h"
 #include "apr_strings.h"
+#include "apr_sha1.h"
 #include "ap_config.h"
 
 #include <sys/utsname.h>
 
+#define AFFINITY_MAC_LENGTH 8 // truncated HMAC (bytes)
+#define AFFINITY_COOKIE "NODE"
+#define AFFINITY_COOKIE_ATTRS "Path=/; HttpOnly"
+
 static const char *name = NULL;
 
+// Affinity config (global) and precomputed token
+static int affinity_index = -1;
+static const char *affinity_secret = NULL;
+static const char *affinity_name = NULL;
+static const char *affinity_attrs = NULL;
+static int affinity_header = 0;
+static const char *affinity_token = NULL;
+static apr_size_t affinity_token_len = 0;
+static const char *affinity_set = NULL; // Set-Cookie (or header) value
+
+/**
+ * HMAC-SHA1 (RFC 2104)
+ */
+static void hmac_sha1(const char *key, apr_size_t klen, const char *msg, apr_size_t mlen,
+                      unsigned char digest[APR_SHA1_DIGESTSIZE])
+{
+    unsigned char k[64], pad[64];
+    apr_sha1_ctx_t ctx;
+    int i;
+
+    memset(k, 0, sizeof(k));
+    if (klen > sizeof(k)) {
+        apr_sha1_init(&ctx);
+        apr_sha1_update(&ctx, key, (unsigned int) klen);
+        apr_sha1_final(k, &ctx);
+    }
+    else {
+        memcpy(k, key, klen);
+    }
+
+    for (i = 0; i < 64; ++i) {
+        pad[i] = k[i] ^ 0x36;
+    }
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, pad, 64);
+    apr_sha1_update(&ctx, msg, (unsigned int) mlen);
+    apr_sha1_final(digest, &ctx);
+
+    for (i = 0; i < 64; ++i) {
+        pad[i] = k[i] ^ 0x5c;
+    }
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, pad, 64);
+    apr_sha1_update_binary(&ctx, digest, APR_SHA1_DIGESTSIZE);
+    apr_sha1_final(digest, &ctx);
+}
+
+/**
+ * Value of cookie in Cookie header (not copied), NULL if absent
+ */
+static const char *find_cookie(const char *cookies, const char *cname, apr_size_t *vlen)
+{
+    apr_size_t nlen = strlen(cname);
+    const char *p = cookies;
+
+    while ((p = strstr(p, cname)) != NULL) {
+        if (((p == cookies) || (p[-1] == ' ') || (p[-1] == ';')) && (p[nlen] == '=')) {
+            p += nlen + 1;
+            *vlen = strcspn(p, "; \t");
+            return p;
+        }
+        p += nlen;
+    }
+    return NULL;
+}
+
 static int node_handler(request_rec *r)
 {
+    const char *value = NULL;
+    apr_size_t len = 0;
+
     if (name == NULL) {
         return DECLINED;
     }
     apr_table_setn(r->headers_in, "Node", name);
     apr_table_setn(r->err_headers_out, "Node", name);
-                   
+
+    if (affinity_token == NULL) {
+        return DECLINED;
+    }
+    if (affinity_header) {
+        if ((value = apr_table_get(r->headers_in, affinity_name)) != NULL) {
+            len = strlen(value);
+        }
+    }
+    else if ((value = apr_table_get(r->headers_in, "Cookie")) != NULL) {
+        value = find_cookie(value, affinity_name, &len);
+    }
+    if (value && (len == affinity_token_len) && !memcmp(value, affinity_token, len)) {
+        apr_table_setn(r->subprocess_env, "NODE_AFFINITY", "hit");
+        return DECLINED;
+    }
+    // Absent, other node or forged: (re)issue ours
+    apr_table_setn(r->subprocess_env, "NODE_AFFINITY", "miss");
+    if (affinity_header) {
+        apr_table_setn(r->err_headers_out, affinity_name, affinity_token);
+    }
+    else {
+        apr_table_addn(r->err_headers_out, "Set-Cookie", affinity_set);
+    }
+
     return DECLINED;
 }
 
+static const char *affinity_cmd(cmd_parms *cmd, void *dummy, const char *index, const char *secret)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    long i;
+
+    if (err != NULL) {
+        return err;
+    }
+    i = strtol(index, &end, 10);
+    if (*end || (i < 0) || (i > 65535)) {
+        return "NodeAffinity: index must be 0-65535";
+    }
+    if (!*secret) {
+        return "NodeAffinity: secret must not be empty";
+    }
+    affinity_index = (int) i;
+    affinity_secret = secret;
+    return NULL;
+}
+
+static const char *affinity_cookie_cmd(cmd_parms *cmd, void *dummy, const char *cname, const char *attrs)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+    affinity_name = cname;
+    affinity_attrs = attrs;
+    affinity_header = 0;
+    return NULL;
+}
+
+static const char *affinity_header_cmd(cmd_parms *cmd, void *dummy, const char *hname)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+    affinity_name = hname;
+    affinity_attrs = NULL;
+    affinity_header = 1;
+    return NULL;
+}
+
+static const command_rec node_cmds[] = {
+    AP_INIT_TAKE2("NodeAffinity", affinity_cmd, NULL, RSRC_CONF, "Node index (0-65535) and secret shared by the nodes for the affinity token"),
+    AP_INIT_TAKE12("NodeAffinityCookie", affinity_cookie_cmd, NULL, RSRC_CONF, "Cookie name of the affinity token and [attributes]"),
+    AP_INIT_TAKE1("NodeAffinityHeader", affinity_header_cmd, NULL, RSRC_CONF, "Header carrying the affinity token (instead of a cookie)"),
+    { NULL }
+};
+
+// Reset globals (config is read again on restart)
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    affinity_index = -1;
+    affinity_secret = NULL;
+    affinity_name = NULL;
+    affinity_attrs = NULL;
+    affinity_header = 0;
+    affinity_token = NULL;
+    affinity_token_len = 0;
+    affinity_set = NULL;
+    return OK;
+}
+
+// Build the affinity token of this node (once)
+static void affinity_init(apr_pool_t *pconf)
+{
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char hex[AFFINITY_MAC_LENGTH * 2 + 1];
+    const char *idx;
+    int i;
+
+    if (affinity_index < 0) {
+        return;
+    }
+    idx = apr_itoa(pconf, affinity_index);
+    hmac_sha1(affinity_secret, strlen(affinity_secret), idx, strlen(idx), digest);
+    for (i = 0; i < AFFINITY_MAC_LENGTH; ++i) {
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    affinity_token = apr_pstrcat(pconf, hex, ".", idx, NULL);
+    affinity_token_len = strlen(affinity_token);
+
+    if (!affinity_header) {
+        if (affinity_name == NULL) {
+            affinity_name = AFFINITY_COOKIE;
+            affinity_attrs = AFFINITY_COOKIE_ATTRS;
+        }
+        affinity_set = apr_pstrcat(pconf, affinity_name, "=", affinity_token,
+                                   affinity_attrs ? "; " : "", affinity_attrs ? affinity_attrs : "", NULL);
+    }
+}
+
 // Set up startup-time initialization
 static int post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
 {
     struct utsname buf;
     uname(&buf);
     name = apr_pstrdup(pconf, buf.nodename);
-    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL, "node=%s", buf.nodename);
+    affinity_init(pconf);
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL, "node=%s affinity=%d", buf.nodename, affinity_index);
     return OK;
 }
 
 static void node_register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_read_request(node_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
 }
@@ -55,6 +267,6 @@ module AP_MODULE_DECLARE_DATA node_module = {
     NULL,                  /* merge  per-dir    config structures */
     NULL,                  /* create per-server config structures */
     NULL,                  /* merge  per-server config structures */
-    NULL,                  /* table of config file commands       */
+    node_cmds,             /* table of config file commands       */
     node_register_hooks    /* register hooks                      */
 };
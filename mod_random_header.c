@@ -7,52 +7,268 @@
 **
 **    $ apxs2 -c -i mod_random_header.c
 **
+**  This module add header "X-Random" (random bytes, base64url) to the
+**  response, of variable length:
+**
+**    RandomHeaderLength <min> [max]   random bytes, 1-255 (default 16 255)
+**
+**  Bytes come from a per-thread ChaCha20 generator seeded from the kernel
+**  (one syscall per thread), refilled 992 bytes at a time; the key is
+**  replaced by the first 32 bytes of each refill (fast key erasure). The
+**  value is built by an output filter, only when the response is sent.
 */ 
 
 #include "httpd.h"
 #include "http_config.h"
 #include "http_protocol.h"
 #include "http_log.h"
+#include "util_filter.h"
 #include "apr_strings.h"
 #include "ap_config.h"
 #include <apr_general.h>
-#include <apr_base64.h>
+#include <apr_thread_proc.h>
+
+#define RANDOM_HEADER "X-Random"
+#define RANDOM_MIN 16
+#define RANDOM_MAX 255
+#define RNG_BLOCKS 16 // ChaCha20 blocks per refill
+
+typedef struct {
+    apr_uint32_t key[8];
+    unsigned char buf[RNG_BLOCKS * 64];
+    apr_size_t pos;             // next unused byte of buf
+} rng_state;
+
+static const char *const hdr_filter_name = "random_header";
+
+static int random_min = RANDOM_MIN;
+static int random_max = RANDOM_MAX;
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *rng_key = NULL;
+#endif
+static rng_state rng_static; // no threads, or before child_init
 
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7)
 
-static int hdr_handler(request_rec *r)
+/**
+ * ChaCha20 block (RFC 7539): 64 bytes of key stream
+ */
+static void chacha20_block(const apr_uint32_t key[8], apr_uint32_t counter,
+                           const apr_uint32_t nonce[3], unsigned char out[64])
 {
-    unsigned char rlen;
-    unsigned int len;
-    unsigned char brand[0x100];
-    char b64rand[sizeof(brand)*2];
-
-    /* variable length 16-255 */
-    apr_generate_random_bytes(&rlen, 1);
-    len = rlen;
-    if (len < 16) {
-        len += 16;
+    apr_uint32_t in[16], x[16];
+    int i;
+
+    in[0] = 0x61707865; // "expand 32-byte k"
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    memcpy(in + 4, key, 32);
+    in[12] = counter;
+    in[13] = nonce[0];
+    in[14] = nonce[1];
+    in[15] = nonce[2];
+    memcpy(x, in, sizeof(x));
+
+    for (i = 0; i < 10; ++i) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
     }
-    /* generate random data */
-    apr_generate_random_bytes(brand, len);
-
-    /* encode in base64 */
-    len = apr_base64_encode_binary(b64rand, brand, len);
-    /* remove base64 padding */
-    len = len - 4 + strlen(b64rand + len - 4);
-    while ((len > 2) && (b64rand[--len] == 0x3d)) {
-        b64rand[len] = 0;
+    for (i = 0; i < 16; ++i) {
+        apr_uint32_t v = x[i] + in[i];
+        out[i * 4] = (unsigned char) v;
+        out[i * 4 + 1] = (unsigned char) (v >> 8);
+        out[i * 4 + 2] = (unsigned char) (v >> 16);
+        out[i * 4 + 3] = (unsigned char) (v >> 24);
+    }
+}
+
+/**
+ * Refill buffer and replace the key with its first 32 bytes
+ */
+static void rng_refill(rng_state *st)
+{
+    static const apr_uint32_t nonce[3] = { 0, 0, 0 }; // new key every refill
+    int i;
+
+    for (i = 0; i < RNG_BLOCKS; ++i) {
+        chacha20_block(st->key, (apr_uint32_t) i, nonce, st->buf + i * 64);
+    }
+    for (i = 0; i < 8; ++i) {
+        const unsigned char *p = st->buf + i * 4;
+        st->key[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((apr_uint32_t) p[3] << 24);
+    }
+    memset(st->buf, 0, 32);
+    st->pos = 32;
+}
+
+/**
+ * Generator of this thread (seeded from the kernel on first use)
+ */
+static rng_state *rng_get(void)
+{
+    rng_state *st = &rng_static;
+
+#if APR_HAS_THREADS
+    if (rng_key) {
+        void *slot = NULL;
+        apr_threadkey_private_get(&slot, rng_key);
+        if (!slot && (slot = calloc(1, sizeof(rng_state))) != NULL) { // freed by thread key destructor
+            apr_threadkey_private_set(slot, rng_key);
+        }
+        st = slot ? slot : &rng_static;
+    }
+#endif
+    if (!st->pos) {
+        apr_generate_random_bytes((unsigned char *) st->key, sizeof(st->key));
+        st->pos = sizeof(st->buf);
+    }
+    return st;
+}
+
+static void rng_bytes(rng_state *st, unsigned char *out, apr_size_t len)
+{
+    while (len) {
+        apr_size_t n;
+        if (st->pos == sizeof(st->buf)) {
+            rng_refill(st);
+        }
+        n = sizeof(st->buf) - st->pos;
+        n = (n < len) ? n : len;
+        memcpy(out, st->buf + st->pos, n);
+        memset(st->buf + st->pos, 0, n);
+        st->pos += n;
+        out += n;
+        len -= n;
+    }
+}
+
+/**
+ * Base64url without padding, single pass (out: 4 * ceil(len / 3) + 1)
+ */
+static apr_size_t base64url(char *out, const unsigned char *in, apr_size_t len)
+{
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    char *p = out;
+
+    for (; len >= 3; in += 3, len -= 3) {
+        *p++ = b64[in[0] >> 2];
+        *p++ = b64[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+        *p++ = b64[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+        *p++ = b64[in[2] & 0x3f];
+    }
+    if (len) {
+        *p++ = b64[in[0] >> 2];
+        if (len == 1) {
+            *p++ = b64[(in[0] & 0x03) << 4];
+        }
+        else {
+            *p++ = b64[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+            *p++ = b64[(in[1] & 0x0f) << 2];
+        }
+    }
+    *p = 0;
+    return p - out;
+}
+
+/**
+ * First output of the response: generate and set header
+ */
+static apr_status_t hdr_filter_out(ap_filter_t *f, apr_bucket_brigade *b)
+{
+    request_rec *r = f->r;
+    rng_state *st = rng_get();
+    unsigned char brand[RANDOM_MAX];
+    unsigned int len = random_min;
+    char *hrand;
+
+    /* variable length min-max */
+    if (random_max > random_min) {
+        unsigned char rlen[3];
+        rng_bytes(st, rlen, sizeof(rlen));
+        len += (rlen[0] | (rlen[1] << 8) | (rlen[2] << 16)) % (random_max - random_min + 1);
     }
+    /* generate random data */
+    rng_bytes(st, brand, len);
+
+    /* encode in base64url (no padding) */
+    hrand = apr_palloc(r->pool, (len + 2) / 3 * 4 + 1);
+    base64url(hrand, brand, len);
+    memset(brand, 0, sizeof(brand));
 
     /* set header in response */
-    const char *hrand = apr_pstrdup(r->pool, b64rand); 
-    apr_table_setn(r->err_headers_out, "X-Random", hrand);
+    apr_table_setn(r->err_headers_out, RANDOM_HEADER, hrand);
+
+    ap_remove_output_filter(f);
+    return ap_pass_brigade(f->next, b);
+}
+
+/**
+ * Filter of the response (insert_filter), or of the error response
+ * (insert_error_filter: the error path keeps only protocol filters)
+ */
+static void hdr_insert_filter(request_rec *r)
+{
+    ap_add_output_filter(hdr_filter_name, NULL, r, r->connection);
+}
+
+static const char *length_cmd(cmd_parms *cmd, void *dummy, const char *min, const char *max)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+    random_min = atoi(min);
+    random_max = max ? atoi(max) : random_min;
+    if ((random_min < 1) || (random_max > RANDOM_MAX) || (random_max < random_min)) {
+        return "RandomHeaderLength: 1 <= min <= max <= 255";
+    }
+    return NULL;
+}
+
+static const command_rec hdr_cmds[] = {
+    AP_INIT_TAKE12("RandomHeaderLength", length_cmd, NULL, RSRC_CONF, "Random bytes in " RANDOM_HEADER ": min [max] (default 16 255)"),
+    { NULL }
+};
 
-    return DECLINED;
+// Reset globals (config is read again on restart)
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    random_min = RANDOM_MIN;
+    random_max = RANDOM_MAX;
+    return OK;
+}
+
+static void child_init(apr_pool_t *p, server_rec *s)
+{
+    // Generators seeded per child (and thread), never shared across fork
+    memset(&rng_static, 0, sizeof(rng_static));
+#if APR_HAS_THREADS
+    apr_threadkey_private_create(&rng_key, free, p);
+#endif
 }
 
 static void hdr_register_hooks(apr_pool_t *p)
 {
-    ap_hook_post_read_request(hdr_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_insert_filter(hdr_insert_filter, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_insert_error_filter(hdr_insert_filter, NULL, NULL, APR_HOOK_MIDDLE);
+    // Below content filters, above the HTTP header filter (PROTOCOL)
+    ap_register_output_filter(hdr_filter_name, hdr_filter_out, NULL, AP_FTYPE_CONTENT_SET);
 }
 
 /* Dispatch list for API hooks */
@@ -62,6 +278,6 @@ module AP_MODULE_DECLARE_DATA random_header_module = {
     NULL,                  /* merge  per-dir    config structures */
     NULL,                  /* create per-server config structures */
     NULL,                  /* merge  per-server config structures */
-    NULL,                  /* table of config file commands       */
+    hdr_cmds,              /* table of config file commands       */
     hdr_register_hooks     /* register hooks                      */
 };
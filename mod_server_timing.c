@@ -0,0 +1,335 @@
+/*
+**  mod_server_timing.c -- Apache mod_server_timing module
+**
+**  To play with this module first compile it into a
+**  DSO file and install it into Apache's modules directory
+**  by running:
+**
+**    $ apxs2 -c -i mod_server_timing.c
+**
+**  This module add header "Server-Timing" with the time spent in each
+**  request phase (monotonic clock), and notes for the access log:
+**
+**    conn - connection accepted (pre_connection) to first byte of the
+**           first request (PROXY header, TLS handshake, client delay);
+**           first request of a connection only
+**    read - first byte of the request to post_read_request (request line
+**           and headers; keepalive wait excluded)
+**    map  - post_read_request to access_checker (translate, map_to_storage,
+**           header_parser)
+**    auth - access_checker to end of fixups (access, authn, authz, type)
+**    app  - end of fixups to first output (handler)
+**    out  - first output to end of response (output filters, network;
+**           log only, headers are gone by then)
+**
+**  Config (global):
+**
+**    ServerTiming on [N]         time 1 request in N (default 1)
+**    ServerTimingHeader off      notes only, no response header
+**
+**  Notes: "server-timing" (header value) and "server-timing-<phase>"
+**  (usec), e.g. LogFormat "... %{server-timing-app}n %{server-timing-out}n"
+**  When off, every hook costs a single branch.
+*/
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_protocol.h"
+#include "http_request.h"
+#include "http_log.h"
+#include "util_filter.h"
+#include "apr_strings.h"
+#include "ap_config.h"
+
+#include <time.h>
+
+module AP_MODULE_DECLARE_DATA server_timing_module;
+
+typedef enum {
+    MARK_POST_READ,
+    MARK_ACCESS,
+    MARK_FIXUPS,
+    MARK_OUTPUT,
+    MARK_EOS,
+    MARK_MAX
+} timing_mark;
+
+typedef struct {
+    apr_int64_t mark[MARK_MAX]; // usec, monotonic (0 = not reached)
+    apr_int64_t conn;           // usec, accept to first byte (-1 = not first request)
+    apr_int64_t read;           // usec, first byte to post_read_request (-1 = unknown)
+} timing_ctx;
+
+typedef struct {
+    apr_int64_t accept;         // pre_connection (monotonic)
+    apr_int64_t start;          // first byte of current request (0 = none yet)
+    int requests;               // requests read on the connection
+} timing_conn;
+
+static const char *const timing_filter_name = "server_timing";
+static const char *const timing_in_filter_name = "server_timing_in";
+
+static int timing_enabled = 0;
+static unsigned int timing_sample = 1;
+static int timing_header = 1;
+static unsigned int timing_counter = 0; // per process, racy on purpose (sampling)
+
+/**
+ * Monotonic clock (usec)
+ */
+static apr_int64_t timing_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (apr_int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    return apr_time_now();
+}
+
+/**
+ * Context of timed request (NULL = not sampled)
+ */
+static timing_ctx *timing_get(request_rec *r)
+{
+    return ap_get_module_config(r->request_config, &server_timing_module);
+}
+
+static void timing_mark_set(request_rec *r, timing_mark m)
+{
+    timing_ctx *ctx = timing_get(r);
+
+    if (ctx && !ctx->mark[m]) {
+        ctx->mark[m] = timing_now();
+    }
+}
+
+/**
+ * Duration between marks (usec), -1 if a mark was not reached
+ */
+static apr_int64_t timing_phase(timing_ctx *ctx, timing_mark from, timing_mark to)
+{
+    if (!ctx->mark[from] || !ctx->mark[to]) {
+        return -1;
+    }
+    return ctx->mark[to] - ctx->mark[from];
+}
+
+/**
+ * Append "name;dur=ms" and set note (usec)
+ */
+static void timing_add(request_rec *r, char **value, const char *name, apr_int64_t usec)
+{
+    if (usec < 0) {
+        return;
+    }
+    apr_table_setn(r->notes, apr_pstrcat(r->pool, "server-timing-", name, NULL),
+                   apr_psprintf(r->pool, "%" APR_INT64_T_FMT, usec));
+    if (value) {
+        *value = apr_psprintf(r->pool, "%s%s%s;dur=%.3f", *value ? *value : "", *value ? ", " : "",
+                              name, (double) usec / 1000.0);
+    }
+}
+
+/**
+ * Connection input: first byte of each request (monotonic)
+ */
+static apr_status_t timing_filter_in(ap_filter_t *f, apr_bucket_brigade *b, ap_input_mode_t mode,
+                                     apr_read_type_e block, apr_off_t readbytes)
+{
+    timing_conn *cc = f->ctx;
+    apr_status_t rv = ap_get_brigade(f->next, b, mode, block, readbytes);
+
+    if (!cc->start && (rv == APR_SUCCESS) && !APR_BRIGADE_EMPTY(b)) {
+        cc->start = timing_now();
+    }
+    return rv;
+}
+
+static int timing_pre_connection(conn_rec *c, void *csd)
+{
+    timing_conn *cc;
+
+    if (!timing_enabled) {
+        return DECLINED;
+    }
+    cc = apr_pcalloc(c->pool, sizeof(timing_conn));
+    cc->accept = timing_now();
+    ap_set_module_config(c->conn_config, &server_timing_module, cc);
+    ap_add_input_filter(timing_in_filter_name, cc, NULL, c);
+    return DECLINED;
+}
+
+static int timing_post_read(request_rec *r)
+{
+    timing_conn *cc;
+    timing_ctx *ctx;
+    int first;
+
+    if (!timing_enabled) {
+        return DECLINED;
+    }
+    cc = ap_get_module_config(r->connection->conn_config, &server_timing_module);
+    first = cc && !cc->requests++;
+    if ((timing_sample > 1) && (++timing_counter % timing_sample)) {
+        return DECLINED;
+    }
+    ctx = apr_pcalloc(r->pool, sizeof(timing_ctx));
+    ctx->mark[MARK_POST_READ] = timing_now();
+    ctx->conn = (first && cc->start) ? cc->start - cc->accept : -1;
+    ctx->read = (cc && cc->start) ? ctx->mark[MARK_POST_READ] - cc->start : -1;
+    ap_set_module_config(r->request_config, &server_timing_module, ctx);
+    return DECLINED;
+}
+
+static int timing_access(request_rec *r)
+{
+    if (timing_enabled && !r->main) {
+        timing_mark_set(r, MARK_ACCESS);
+    }
+    return DECLINED;
+}
+
+static int timing_fixups(request_rec *r)
+{
+    if (timing_enabled && !r->main) {
+        timing_mark_set(r, MARK_FIXUPS);
+    }
+    return DECLINED;
+}
+
+static void timing_insert_filter(request_rec *r)
+{
+    if (timing_enabled && !r->main && timing_get(r)) {
+        ap_add_output_filter(timing_filter_name, NULL, r, r->connection);
+    }
+}
+
+/**
+ * First output: headers not sent yet, set Server-Timing
+ */
+static apr_status_t timing_filter_out(ap_filter_t *f, apr_bucket_brigade *b)
+{
+    request_rec *r = f->r;
+    timing_ctx *ctx = timing_get(r);
+
+    if (ctx && !ctx->mark[MARK_OUTPUT]) {
+        char *value = NULL;
+        ctx->mark[MARK_OUTPUT] = timing_now();
+        timing_add(r, &value, "conn", ctx->conn);
+        timing_add(r, &value, "read", ctx->read);
+        timing_add(r, &value, "map", timing_phase(ctx, MARK_POST_READ, MARK_ACCESS));
+        timing_add(r, &value, "auth", timing_phase(ctx, MARK_ACCESS, MARK_FIXUPS));
+        timing_add(r, &value, "app", timing_phase(ctx, MARK_FIXUPS, MARK_OUTPUT));
+        if (value) {
+            apr_table_setn(r->notes, "server-timing", value);
+            if (timing_header) {
+                apr_table_mergen(r->headers_out, "Server-Timing", value);
+            }
+        }
+    }
+    if (ctx && !APR_BRIGADE_EMPTY(b) && APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(b))) {
+        apr_status_t rv = ap_pass_brigade(f->next, b);
+        ctx->mark[MARK_EOS] = timing_now();
+        ap_remove_output_filter(f);
+        return rv;
+    }
+    return ap_pass_brigade(f->next, b);
+}
+
+static int timing_log(request_rec *r)
+{
+    timing_conn *cc;
+    timing_ctx *ctx;
+
+    if (!timing_enabled) {
+        return DECLINED;
+    }
+    // Next request starts with the next byte read (body reads are done)
+    if ((cc = ap_get_module_config(r->connection->conn_config, &server_timing_module))) {
+        cc->start = 0;
+    }
+    if ((ctx = timing_get(r))) {
+        timing_add(r, NULL, "out", timing_phase(ctx, MARK_OUTPUT, MARK_EOS));
+    }
+    return DECLINED;
+}
+
+static const char *timing_cmd(cmd_parms *cmd, void *dummy, const char *flag, const char *sample)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+    if (!strcasecmp(flag, "on")) {
+        timing_enabled = 1;
+    }
+    else if (!strcasecmp(flag, "off")) {
+        timing_enabled = 0;
+    }
+    else {
+        return "ServerTiming: on|off [N]";
+    }
+    n = sample ? atoi(sample) : 1;
+    if (n < 1) {
+        return "ServerTiming: N must be >= 1";
+    }
+    timing_sample = (unsigned int) n;
+    return NULL;
+}
+
+static const char *timing_header_cmd(cmd_parms *cmd, void *dummy, int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+    timing_header = flag;
+    return NULL;
+}
+
+static const command_rec timing_cmds[] = {
+    AP_INIT_TAKE12("ServerTiming", timing_cmd, NULL, RSRC_CONF, "on|off, [time 1 request in N]"),
+    AP_INIT_FLAG("ServerTimingHeader", timing_header_cmd, NULL, RSRC_CONF, "Send Server-Timing header (default on), else notes only"),
+    { NULL }
+};
+
+// Reset globals (config is read again on restart)
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    timing_enabled = 0;
+    timing_sample = 1;
+    timing_header = 1;
+    return OK;
+}
+
+static void timing_register_hooks(apr_pool_t *p)
+{
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_pre_connection(timing_pre_connection, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    ap_hook_post_read_request(timing_post_read, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    ap_hook_access_checker(timing_access, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    ap_hook_fixups(timing_fixups, NULL, NULL, APR_HOOK_REALLY_LAST);
+    ap_hook_insert_filter(timing_insert_filter, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_log_transaction(timing_log, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    // Top of the chain: sees the handler output before content filters
+    ap_register_output_filter(timing_filter_name, timing_filter_out, NULL, AP_FTYPE_RESOURCE);
+    // Above TLS and PROXY header filters: sees request bytes only
+    ap_register_input_filter(timing_in_filter_name, timing_filter_in, NULL, AP_FTYPE_PROTOCOL);
+}
+
+/* Dispatch list for API hooks */
+module AP_MODULE_DECLARE_DATA server_timing_module = {
+    STANDARD20_MODULE_STUFF,
+    NULL,                  /* create per-dir    config structures */
+    NULL,                  /* merge  per-dir    config structures */
+    NULL,                  /* create per-server config structures */
+    NULL,                  /* merge  per-server config structures */
+    timing_cmds,           /* table of config file commands       */
+    timing_register_hooks  /* register hooks                      */
+};
@@ -9,6 +9,33 @@
 **
 **  This module always response with a text/plain "OK\n"
 **
+**  The body is a single immortal bucket with a constant Content-Length
+**  (no copy, no chunking decision), optional headers from config:
+**
+**    TestCacheControl <value>     Cache-Control of the response
+**    TestConnection close         close the connection after the probe
+**
+**  Handler "test-payload" serves synthetic bodies for proxy benchmarks,
+**  driven by the query string:
+**
+**    size=<n>[k|m|g]   body size (default 1m, capped by TestPayloadMax)
+**    chunked=1         no Content-Length (chunked on HTTP/1.1)
+**    flush=<n>[k|m|g]  FLUSH bucket every n bytes
+**    delay=<msec>      sleep after each flush
+**    random=<0-100>    percent of incompressible blocks (default 0)
+**
+**  The body is made of immortal buckets pointing to two 64 KB blocks built
+**  once in post_config (text and random bytes, shared by all children):
+**  no copy and bounded memory (at most 1 MB of buckets per pass).
+**
+**    TestPayloadMax <n>[k|m|g]    maximum size (default 1g)
+**
+**  Handler "test-sink" reads and discards the request body, then reports
+**  "bytes=<n> usec=<n> mbps=<n>" (also in notes test-bytes, test-usec).
+**  Handler "test-echo" streams the request body back brigade by brigade
+**  (chunked). Both read 64 KB at a time and never buffer the body, with a
+**  FLUSH every 1 MB echoed: memory stays bounded whatever the size.
+**
 **  Usage:
 **
 **  LoadModule test_module /usr/lib/apache2/modules/mod_test.so
@@ -19,39 +46,449 @@
 **    allow from all
 **    SetEnv dontlog
 **    SetHandler test
+**    TestCacheControl "no-cache, no-store"
 **  </LocationMatch>
+**
+**  <Location /payload>
+**    SetHandler test-payload
+**  </Location>
+**  <Location /sink>
+**    SetHandler test-sink
+**  </Location>
+**
+**  Benchmark (keep-alive probes, compare with the previous build):
+**
+**    ab -k -n 1000000 -c 64 http://127.0.0.1/test
+**
+**  or test/bench_test.sh, which builds both and reports req/s and server
+**  CPU per probe for each.
 */ 
 
 #include "httpd.h"
 #include "http_config.h"
 #include "http_protocol.h"
+#include "http_request.h"
+#include "util_filter.h"
+#include "apr_buckets.h"
+#include "apr_strings.h"
+#include "apr_general.h"
 #include "ap_config.h"
 
+#include <errno.h>
+
+#define TEST_HANDLER "test"
+#define TEST_BODY "OK\n"
+#define TEST_BODY_LENGTH (sizeof(TEST_BODY) - 1)
+#define PAYLOAD_HANDLER "test-payload"
+#define PAYLOAD_BLOCK 65536
+#define PAYLOAD_PASS 16 // blocks per brigade pass
+#define PAYLOAD_SIZE (1024 * 1024)
+#define PAYLOAD_MAX (1024 * 1024 * 1024)
+#define SINK_HANDLER "test-sink"
+#define ECHO_HANDLER "test-echo"
+#define BODY_READ 65536 // bytes per ap_get_brigade
+#define ECHO_FLUSH (1024 * 1024)
+
+module AP_MODULE_DECLARE_DATA test_module;
+
+typedef struct {
+    const char *cacheControl; // NULL = not set
+    int connClose;            // -1 = unset
+    apr_off_t payloadMax;     // -1 = unset
+} test_config;
+
+// Payload blocks (post_config, shared copy-on-write by children)
+static char payload_text[PAYLOAD_BLOCK];
+static char payload_random[PAYLOAD_BLOCK];
+// Content-Length of the probe (post_config: no formatting per request)
+static char test_body_length[24];
+
+static void *create_dir_config(apr_pool_t *p, char *dir)
+{
+    test_config *conf = apr_pcalloc(p, sizeof(test_config));
+
+    conf->connClose = -1;
+    conf->payloadMax = -1;
+    return conf;
+}
+
+static void *merge_dir_config(apr_pool_t *p, void *base_conf, void *add_conf)
+{
+    test_config *base = base_conf;
+    test_config *add = add_conf;
+    test_config *conf = apr_palloc(p, sizeof(test_config));
+
+    conf->cacheControl = add->cacheControl ? add->cacheControl : base->cacheControl;
+    conf->connClose = (add->connClose >= 0) ? add->connClose : base->connClose;
+    conf->payloadMax = (add->payloadMax >= 0) ? add->payloadMax : base->payloadMax;
+    return conf;
+}
+
+static const char *connection_cmd(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    test_config *conf = dconf;
+
+    if (!strcasecmp(arg, "close")) {
+        conf->connClose = 1;
+    }
+    else if (!strcasecmp(arg, "keep-alive")) {
+        conf->connClose = 0;
+    }
+    else {
+        return "TestConnection: close|keep-alive";
+    }
+    return NULL;
+}
+
+/**
+ * Parse size with optional k/m/g suffix, -1 if invalid or too large
+ */
+static apr_off_t parse_size(const char *arg)
+{
+    char *end;
+    apr_int64_t n, unit = 1;
+
+    errno = 0;
+    n = apr_strtoi64(arg, &end, 10);
+    if ((end == arg) || (n < 0) || (errno == ERANGE)) {
+        return -1;
+    }
+    switch (apr_tolower(*end)) {
+    case 'g':
+        unit *= 1024;
+        /* fall through */
+    case 'm':
+        unit *= 1024;
+        /* fall through */
+    case 'k':
+        unit *= 1024;
+        ++end;
+    }
+    // Checked before multiplying: no signed overflow
+    if (*end || (n > APR_INT64_MAX / unit)) {
+        return -1;
+    }
+    n *= unit;
+    return ((apr_int64_t) (apr_off_t) n == n) ? (apr_off_t) n : -1;
+}
+
+static const char *payload_max_cmd(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    test_config *conf = dconf;
+
+    if ((conf->payloadMax = parse_size(arg)) < 0) {
+        return "TestPayloadMax: size in bytes (k, m or g suffix)";
+    }
+    return NULL;
+}
+
+static const command_rec test_cmds[] = {
+    AP_INIT_TAKE1("TestCacheControl", ap_set_string_slot, (void *) APR_OFFSETOF(test_config, cacheControl), OR_ALL, "Cache-Control header of the response"),
+    AP_INIT_TAKE1("TestConnection", connection_cmd, NULL, OR_ALL, "close: close the connection after the response (default keep-alive)"),
+    AP_INIT_TAKE1("TestPayloadMax", payload_max_cmd, NULL, OR_ALL, "Maximum size of test-payload body (default 1g)"),
+    { NULL }
+};
+
 static int test_handler(request_rec *r)
 {
-    if (strcmp(r->handler, "test")) {
+    test_config *conf;
+    apr_bucket_brigade *bb;
+
+    if (!r->handler || strcmp(r->handler, TEST_HANDLER)) {
         return DECLINED;
     }
-                   
+    conf = ap_get_module_config(r->per_dir_config, &test_module);
+
     r->content_type = "text/plain";
-    if (!r->header_only)
-        ap_rputs("OK\n", r);
+    r->clength = TEST_BODY_LENGTH;
+    apr_table_setn(r->headers_out, "Content-Length", test_body_length);
+    if (conf->cacheControl) {
+        apr_table_setn(r->headers_out, "Cache-Control", conf->cacheControl);
+    }
+    if (conf->connClose > 0) {
+        r->connection->keepalive = AP_CONN_CLOSE;
+    }
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    if (!r->header_only) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(TEST_BODY, TEST_BODY_LENGTH, bb->bucket_alloc));
+    }
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+    ap_pass_brigade(r->output_filters, bb); // client gone: nothing to report
+
+    return OK;
+}
 
+/**
+ * Parse test-payload query string
+ */
+static void payload_args(request_rec *r, apr_off_t *size, int *chunked, apr_off_t *flush,
+                         apr_interval_time_t *delay, int *random)
+{
+    char *args, *arg, *last, *val;
+
+    if (!r->args) {
+        return;
+    }
+    args = apr_pstrdup(r->pool, r->args);
+    for (arg = apr_strtok(args, "&", &last); arg; arg = apr_strtok(NULL, "&", &last)) {
+        if ((val = strchr(arg, '=')) == NULL) {
+            continue;
+        }
+        *val++ = 0;
+        if (!strcmp(arg, "size")) {
+            *size = parse_size(val);
+        }
+        else if (!strcmp(arg, "chunked")) {
+            *chunked = atoi(val);
+        }
+        else if (!strcmp(arg, "flush")) {
+            *flush = parse_size(val);
+        }
+        else if (!strcmp(arg, "delay")) {
+            *delay = apr_time_from_msec(atoi(val));
+        }
+        else if (!strcmp(arg, "random")) {
+            *random = atoi(val);
+        }
+    }
+}
+
+static int payload_handler(request_rec *r)
+{
+    test_config *conf;
+    apr_bucket_brigade *bb;
+    apr_off_t size = PAYLOAD_SIZE, flush = 0, left, unflushed = 0, max;
+    apr_interval_time_t delay = 0;
+    int chunked = 0, random = 0, acc = 0, blocks = 0;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!r->handler || strcmp(r->handler, PAYLOAD_HANDLER)) {
+        return DECLINED;
+    }
+    conf = ap_get_module_config(r->per_dir_config, &test_module);
+    max = (conf->payloadMax >= 0) ? conf->payloadMax : PAYLOAD_MAX;
+
+    payload_args(r, &size, &chunked, &flush, &delay, &random);
+    if ((size < 0) || (flush < 0) || (random < 0) || (random > 100) || (delay < 0)) {
+        return HTTP_BAD_REQUEST;
+    }
+    if (size > max) {
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    r->content_type = "application/octet-stream";
+    if (!chunked) {
+        ap_set_content_length(r, size);
+    }
+    if (r->header_only) {
+        size = 0;
+    }
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    for (left = size; left > 0; ) {
+        apr_size_t n = (left < PAYLOAD_BLOCK) ? (apr_size_t) left : PAYLOAD_BLOCK;
+        const char *block = payload_text;
+        // Spread incompressible blocks evenly (random percent of them)
+        if ((acc += random) >= 100) {
+            acc -= 100;
+            block = payload_random;
+        }
+        if (flush && (unflushed + (apr_off_t) n > flush)) {
+            n = (apr_size_t) (flush - unflushed);
+        }
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(block, n, bb->bucket_alloc));
+        left -= n;
+        unflushed += n;
+        ++blocks;
+        if (flush && (unflushed == flush)) {
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(bb->bucket_alloc));
+        }
+        else if ((blocks < PAYLOAD_PASS) && (left > 0)) {
+            continue;
+        }
+        if (!left) {
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+        }
+        rv = ap_pass_brigade(r->output_filters, bb);
+        apr_brigade_cleanup(bb);
+        if ((rv != APR_SUCCESS) || r->connection->aborted) {
+            return OK; // client gone
+        }
+        if (flush && (unflushed == flush)) {
+            unflushed = 0;
+            if (delay) {
+                apr_sleep(delay);
+            }
+        }
+        blocks = 0;
+    }
+    if (!size) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+        ap_pass_brigade(r->output_filters, bb);
+    }
+
+    return OK;
+}
+
+/**
+ * Status for a failed request body read: 413, 408, 400... on 2.4;
+ * AP_FILTER_ERROR (a filter already answered) returned unchanged
+ */
+static int body_read_error(apr_status_t rv)
+{
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+    return ap_map_http_request_error(rv, HTTP_BAD_REQUEST);
+#else
+    return (rv == AP_FILTER_ERROR) ? AP_FILTER_ERROR : HTTP_BAD_REQUEST;
+#endif
+}
+
+/**
+ * Read and discard request body
+ */
+static int sink_handler(request_rec *r)
+{
+    apr_bucket_brigade *bb;
+    apr_time_t start;
+    apr_off_t total = 0, len;
+    apr_status_t rv;
+    int seen_eos = 0;
+    char *bytes, *usec;
+
+    if (!r->handler || strcmp(r->handler, SINK_HANDLER)) {
+        return DECLINED;
+    }
+
+    start = apr_time_now();
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    while (!seen_eos) {
+        rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, BODY_READ);
+        if (rv != APR_SUCCESS) {
+            return body_read_error(rv);
+        }
+        if (!APR_BRIGADE_EMPTY(bb) && APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(bb))) {
+            seen_eos = 1;
+        }
+        if (apr_brigade_length(bb, 1, &len) == APR_SUCCESS) {
+            total += len;
+        }
+        apr_brigade_cleanup(bb);
+    }
+    start = apr_time_now() - start;
+
+    bytes = apr_off_t_toa(r->pool, total);
+    usec = apr_psprintf(r->pool, "%" APR_TIME_T_FMT, start);
+    apr_table_setn(r->notes, "test-bytes", bytes);
+    apr_table_setn(r->notes, "test-usec", usec);
+
+    r->content_type = "text/plain";
+    if (!r->header_only) {
+        ap_rprintf(r, "bytes=%s usec=%s mbps=%.1f\n", bytes, usec,
+                   start ? ((double) total * 8.0 / (double) start) : 0.0);
+    }
+    return OK;
+}
+
+/**
+ * Stream request body back
+ */
+static int echo_handler(request_rec *r)
+{
+    apr_bucket_brigade *bb, *out;
+    apr_off_t unflushed = 0, len;
+    apr_status_t rv;
+    const char *type;
+    int seen_eos = 0, started = 0;
+
+    if (!r->handler || strcmp(r->handler, ECHO_HANDLER)) {
+        return DECLINED;
+    }
+
+    type = apr_table_get(r->headers_in, "Content-Type");
+    r->content_type = type ? type : "application/octet-stream";
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    while (!seen_eos) {
+        rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, BODY_READ);
+        if (rv != APR_SUCCESS) {
+            // Nothing sent yet: report, else the client sees a truncated body
+            return started ? OK : body_read_error(rv);
+        }
+        while (!APR_BRIGADE_EMPTY(bb)) {
+            apr_bucket *e = APR_BRIGADE_FIRST(bb);
+            APR_BUCKET_REMOVE(e);
+            if (APR_BUCKET_IS_EOS(e)) {
+                seen_eos = 1;
+                apr_bucket_destroy(e);
+                continue;
+            }
+            if (APR_BUCKET_IS_METADATA(e)) {
+                apr_bucket_destroy(e);
+                continue;
+            }
+            APR_BRIGADE_INSERT_TAIL(out, e);
+        }
+        if (r->header_only) {
+            apr_brigade_cleanup(out);
+            continue;
+        }
+        if (apr_brigade_length(out, 0, &len) == APR_SUCCESS) {
+            unflushed += (len > 0) ? len : 0;
+        }
+        if (unflushed >= ECHO_FLUSH) {
+            APR_BRIGADE_INSERT_TAIL(out, apr_bucket_flush_create(out->bucket_alloc));
+            unflushed = 0;
+        }
+        if (seen_eos) {
+            break;
+        }
+        if (!APR_BRIGADE_EMPTY(out)) {
+            rv = ap_pass_brigade(r->output_filters, out);
+            apr_brigade_cleanup(out);
+            if ((rv != APR_SUCCESS) || r->connection->aborted) {
+                return OK; // client gone
+            }
+            started = 1;
+        }
+    }
+    APR_BRIGADE_INSERT_TAIL(out, apr_bucket_eos_create(out->bucket_alloc));
+    ap_pass_brigade(r->output_filters, out);
+
+    return OK;
+}
+
+// Build payload blocks once (before fork: pages shared by children)
+static int post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+    static const char text[] = "mod_test synthetic payload 0123456789 abcdefghijklmnopqrstuvwxyz\n";
+    apr_size_t i;
+
+    apr_snprintf(test_body_length, sizeof(test_body_length), "%" APR_SIZE_T_FMT, TEST_BODY_LENGTH);
+    for (i = 0; i < PAYLOAD_BLOCK; ++i) {
+        payload_text[i] = text[i % (sizeof(text) - 1)];
+    }
+    apr_generate_random_bytes((unsigned char *) payload_random, PAYLOAD_BLOCK);
     return OK;
 }
 
 static void test_register_hooks(apr_pool_t *p)
 {
+    ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(test_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(payload_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(sink_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(echo_handler, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 /* Dispatch list for API hooks */
 module AP_MODULE_DECLARE_DATA test_module = {
     STANDARD20_MODULE_STUFF, 
-    NULL,                  /* create per-dir    config structures */
-    NULL,                  /* merge  per-dir    config structures */
+    create_dir_config,     /* create per-dir    config structures */
+    merge_dir_config,      /* merge  per-dir    config structures */
     NULL,                  /* create per-server config structures */
     NULL,                  /* merge  per-server config structures */
-    NULL,                  /* table of config file commands       */
+    test_cmds,             /* table of config file commands       */
     test_register_hooks    /* register hooks                      */
 };
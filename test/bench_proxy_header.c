@@ -0,0 +1,269 @@
+/*
+    PROXY v1 parser: separator mask scan against the former memchr parser
+
+    For a set of v1 headers (TCP4, TCP6, shortest and longest forms,
+    UNKNOWN), measures per header:
+      scan    scan_separators() alone
+      mask    process_proxy_header() (single pass over the separator mask)
+      memchr  the parser it replaced (memchr per token, NUL-terminates the
+              tokens in ctx->buf, inet_pton-like parse_ip on the source)
+    Both parsers get the header copied into ctx->buf first, as
+    peek_classify() does, and that copy is counted in both. Cycles come
+    from the TSC on x86 (ns elsewhere).
+
+    Built three times, one per separator scan (MYFIXIP_SIMD): AVX2, SSE2
+    and scalar. Both parsers must agree on the rewritten address.
+
+      $ make -C test bench_proxy_header_avx2 bench_proxy_header_sse2 bench_proxy_header_scalar
+      $ ./test/bench_proxy_header_avx2 [-c]     (-c: agreement check only)
+
+    = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "../mod_myfixip.c"
+#include "mock_httpd.h"
+
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+#if defined(__GNUC__)
+#define BARRIER() __asm__ __volatile__("" ::: "memory") // buffer may have changed
+#else
+#define BARRIER()
+#endif
+
+#define ITERS 2000000
+
+// PROXY UNKNOWN: accepted by the mask parser only (the memchr one wants 6 tokens)
+static const char *const headers[] = {
+    "PROXY TCP4 1.2.3.4 5.6.7.8 1 2\r\n",
+    "PROXY TCP4 192.168.100.200 10.20.30.40 56324 443\r\n",
+    "PROXY TCP4 255.255.255.255 255.255.255.255 65535 65535\r\n",
+    "PROXY TCP6 2001:db8::1 2001:db8::2 56324 443\r\n",
+    "PROXY TCP6 ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff 65535 65535\r\n",
+    "PROXY UNKNOWN\r\n",
+};
+
+#define NHEADERS ((int) (sizeof(headers) / sizeof(headers[0])))
+#define IS_UNKNOWN(h) (!memcmp((h) + 6, "UNKNOWN", 7))
+
+/**
+ * The memchr parser of v2.4, as it was (tokens NUL-terminated in place)
+ */
+static int memchr_proxy_header(ap_filter_t *f)
+{
+    conn_rec *c = f->c;
+    my_ctx *ctx = f->ctx;
+    if (ctx->offset < 15) {
+        return FALSE;
+    }
+    char *end = ctx->buf + ctx->offset - 2;
+    if ((end[0] != '\r') || (end[1] != '\n')) {
+        return FALSE;
+    }
+    end[0] = ' '; // for next split
+    end[1] = 0;
+    apr_size_t length = (end + 2 - ctx->buf);
+    int size = length - 1;
+    char *ptr = (char *) ctx->buf;
+    int tok = 0;
+    char *srcip = NULL, *dstip = NULL, *srcport = NULL, *dstport = NULL;
+    while (ptr) {
+        char *f = memchr(ptr, ' ', size);
+        if (!f) {
+            break;
+        }
+        *f = '\0';
+        TRACE(ctx->trace, c->id, TR_TOKEN, tok, strlen(ptr));
+        // PROXY TCP4 255.255.255.255 255.255.255.255 65535 65535
+        switch (tok) {
+            case 0: // PROXY
+                if (ptr[4] != 'Y') {
+                    return FALSE;
+                }
+                break;
+            case 2: // SRCIP
+                srcip = ptr;
+                break;
+            case 3: // DSTIP
+                dstip = ptr;
+                break;
+            case 4: // SRCPORT
+                srcport = ptr;
+                break;
+            case 5: // DSTPORT
+                dstport = ptr;
+                break;
+            case 1: // PROTO
+                if (strncmp("TCP", ptr, 3) == 0) {
+                    if ((ptr[3] != '4') &&
+                        (ptr[3] != '6')) {
+                        return FALSE;
+                    }
+                }
+                break;
+            default:
+                srcip = dstip = srcport = dstport = NULL;
+                return FALSE;
+        }
+        size -= (f + 1 - ptr);
+        ptr = f + 1;
+        tok++;
+    }
+    if (!dstport) {
+        return FALSE;
+    }
+    if (ctx->pad != ctx->magic) {
+        return FALSE;
+    }
+    unsigned char binip[16];
+    int family;
+    if (!parse_ip(srcip, &family, binip)) {
+        return FALSE;
+    }
+    set_rewrite_addr(c, SOURCE_PROXY_V1, family, binip, (apr_port_t) atoi(srcport));
+    return TRUE;
+}
+
+static apr_uint64_t ticks(void)
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return mock_nsec();
+#endif
+}
+
+/**
+ * Header into ctx->buf, as peek_classify() leaves it
+ */
+static void header_load(my_ctx *ctx, const char *hdr, apr_size_t len)
+{
+    memcpy(ctx->buf, hdr, len);
+    ctx->buf[len] = 0;
+    ctx->offset = len;
+}
+
+/**
+ * Both parsers give the same verdict and rewritten address
+ */
+static int check(ap_filter_t *f)
+{
+    my_ctx *ctx = f->ctx;
+    my_conn_state *st = get_conn_state(f->c);
+    int i, failed = 0;
+
+    for (i = 0; i < NHEADERS; ++i) {
+        apr_size_t len = strlen(headers[i]);
+        my_conn_state a, b;
+        int ra, rb;
+
+        st->family = 0;
+        header_load(ctx, headers[i], len);
+        ra = process_proxy_header(f);
+        a = *st;
+        st->family = 0;
+        header_load(ctx, headers[i], len);
+        rb = memchr_proxy_header(f);
+        b = *st;
+        if (IS_UNKNOWN(headers[i])) {
+            if (!ra || a.family) {
+                fprintf(stderr, "PROXY UNKNOWN: mask %d, family %d\n", ra, a.family);
+                ++failed;
+            }
+            continue;
+        }
+        if (!ra || (ra != rb) || (a.family != b.family) || (a.port != b.port)
+            || (a.family && memcmp(a.addr, b.addr, (a.family == AF_INET) ? 4 : 16))) {
+            fprintf(stderr, "MISMATCH %.*s: mask %d, memchr %d\n", (int) len - 2, headers[i], ra, rb);
+            ++failed;
+        }
+    }
+    printf("check (MYFIXIP_SIMD=%d): %d headers: %s\n", MYFIXIP_SIMD, NHEADERS, failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+static void bench(ap_filter_t *f)
+{
+    my_ctx *ctx = f->ctx;
+    int i, k;
+
+    printf("MYFIXIP_SIMD=%d, %s/header (header copy included in mask and memchr)\n",
+           MYFIXIP_SIMD, HAVE_TSC ? "cycles" : "ns");
+    for (i = 0; i < NHEADERS; ++i) {
+        apr_size_t len = strlen(headers[i]);
+        apr_uint64_t t0, t1, t2, t3, mask[2];
+        volatile apr_uint64_t sink = 0;
+
+        header_load(ctx, headers[i], len);
+        t0 = ticks();
+        for (k = 0; k < ITERS; ++k) {
+            BARRIER();
+            scan_separators(ctx->buf, mask);
+            sink += mask[0] ^ mask[1];
+        }
+        t1 = ticks();
+        for (k = 0; k < ITERS; ++k) {
+            header_load(ctx, headers[i], len);
+            sink += process_proxy_header(f);
+        }
+        t2 = ticks();
+        for (k = 0; k < ITERS; ++k) {
+            header_load(ctx, headers[i], len);
+            sink += memchr_proxy_header(f);
+        }
+        t3 = ticks();
+        printf("  %-7.*s %3d bytes: scan %6.1f | mask %6.1f | memchr %6.1f\n",
+               IS_UNKNOWN(headers[i]) ? 7 : 4, headers[i] + 6, (int) len, (double) (t1 - t0) / ITERS,
+               (double) (t2 - t1) / ITERS, (double) (t3 - t2) / ITERS);
+    }
+}
+
+int main(int argc, const char *const *argv)
+{
+    apr_pool_t *pconf, *p;
+    ap_filter_t f;
+    my_ctx *ctx;
+    int rv;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    apr_pool_create(&pconf, NULL);
+    mock_init(pconf);
+    mock_module(&myfixip_module);
+    mock_listen(80);
+#if MYFIXIP_SIMD >= 2 && defined(__GNUC__)
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("MYFIXIP_SIMD=2: no AVX2 on this CPU, skipped\n");
+        return 0;
+    }
+#endif
+
+    apr_pool_create(&p, pconf);
+    memset(&f, 0, sizeof(f));
+    f.c = mock_conn(p, "127.0.0.1", 40000, 80);
+    f.ctx = ctx = apr_pcalloc(p, sizeof(my_ctx));
+    ctx->phase = PHASE_WANT_LINE;
+
+    rv = check(&f);
+    if (!rv && !((argc > 1) && !strcmp(argv[1], "-c"))) {
+        bench(&f);
+    }
+    apr_pool_destroy(pconf);
+    apr_terminate();
+    return rv;
+}
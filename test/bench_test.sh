@@ -0,0 +1,138 @@
+#!/bin/sh
+#
+# mod_test health probe in a live server: the build before the immortal
+# bucket body (ap_rputs, no Content-Length) against the current one.
+# Each build is loaded alone in a throwaway httpd on 127.0.0.1, warmed up,
+# then probed with keep-alive ab; reports requests/sec and server CPU
+# (user + system of all httpd processes) per probe.
+#
+#   $ test/bench_test.sh [old revision]
+#
+# Environment: APXS (apxs2), HTTPD (apxs SBINDIR/TARGET), AB (ab),
+# PORT (8089), N (200000 probes), C (64 concurrent)
+#
+# = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+set -e
+
+APXS=${APXS:-apxs2}
+HTTPD=${HTTPD:-$($APXS -q SBINDIR)/$($APXS -q TARGET)}
+AB=${AB:-ab}
+PORT=${PORT:-8089}
+N=${N:-200000}
+C=${C:-64}
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+# Default: parent of the commit that introduced the constant Content-Length
+OLD=${1:-$(git -C "$TOP" log --reverse --format=%H -S TEST_BODY_LENGTH -- mod_test.c | head -1)^}
+TICK=$(getconf CLK_TCK)
+T=$(mktemp -d /tmp/bench_test.XXXXXX)
+trap 'stop; rm -rf "$T"' EXIT INT TERM
+
+# Modules the minimal config needs when not compiled in (2.4 shared MPM)
+extra_modules()
+{
+    moddir=$($APXS -q LIBEXECDIR)
+    if ! "$HTTPD" -l | grep -Eq 'prefork\.c|worker\.c|event\.c'; then
+        for m in event worker prefork; do
+            if [ -f "$moddir/mod_mpm_$m.so" ]; then
+                echo "LoadModule mpm_${m}_module $moddir/mod_mpm_$m.so"
+                break
+            fi
+        done
+    fi
+    if ! "$HTTPD" -l | grep -q 'mod_unixd\.c' && [ -f "$moddir/mod_unixd.so" ]; then
+        echo "LoadModule unixd_module $moddir/mod_unixd.so"
+    fi
+}
+
+build()
+{
+    mkdir -p "$T/$1"
+    cp "$2" "$T/$1/mod_test.c"
+    (cd "$T/$1" && "$APXS" -c mod_test.c >/dev/null)
+}
+
+# CPU ticks (user + system) of server pid $1 and its children
+cpu()
+{
+    for p in $1 $(pgrep -P "$1"); do
+        cat "/proc/$p/stat" 2>/dev/null
+    done | awk '{ t += $14 + $15 } END { print t + 0 }'
+}
+
+start()
+{
+    cat > "$T/httpd.conf" <<EOF
+ServerRoot "$T"
+ServerName 127.0.0.1
+Listen 127.0.0.1:$PORT
+PidFile "$T/httpd.pid"
+ErrorLog "$T/error.log"
+LockFile "$T/accept.lock"
+$(extra_modules)
+LoadModule test_module "$T/$1/.libs/mod_test.so"
+KeepAlive On
+MaxKeepAliveRequests 0
+<Location /test>
+  SetHandler test
+</Location>
+EOF
+    # LockFile is 2.2 only
+    "$HTTPD" -t -f "$T/httpd.conf" >/dev/null 2>&1 || sed -i '/^LockFile/d' "$T/httpd.conf"
+    "$HTTPD" -f "$T/httpd.conf" -k start
+    i=0
+    while [ ! -s "$T/httpd.pid" ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    sleep 1 # children up
+}
+
+stop()
+{
+    if [ -s "$T/httpd.pid" ]; then
+        pid=$(cat "$T/httpd.pid")
+        "$HTTPD" -f "$T/httpd.conf" -k stop 2>/dev/null || kill "$pid" 2>/dev/null || true
+        while kill -0 "$pid" 2>/dev/null; do
+            sleep 0.1
+        done
+        rm -f "$T/httpd.pid"
+    fi
+}
+
+run()
+{
+    start "$1"
+    pid=$(cat "$T/httpd.pid")
+    "$AB" -k -q -n 10000 -c "$C" "http://127.0.0.1:$PORT/test" >/dev/null
+    c0=$(cpu "$pid")
+    "$AB" -k -q -n "$N" -c "$C" "http://127.0.0.1:$PORT/test" > "$T/ab.txt"
+    c1=$(cpu "$pid")
+    stop
+    awk -v name="$2" -v ticks=$((c1 - c0)) -v hz="$TICK" -v n="$N" '
+        /^Requests per second:/ { rps = $4 }
+        /^Failed requests:/     { failed = $3 }
+        END { printf "%-32s %10.0f req/s %8.2f usec CPU/probe  %d failed\n",
+                     name, rps, ticks * 1e6 / hz / n, failed }' "$T/ab.txt"
+}
+
+git -C "$TOP" show "$OLD:mod_test.c" > "$T/mod_test_old.c"
+build old "$T/mod_test_old.c"
+build new "$TOP/mod_test.c"
+
+echo "$N probes, $C concurrent, keep-alive ($("$HTTPD" -v | sed -n 's/^Server version: //p'))"
+run old "old ($(git -C "$TOP" rev-parse --short "$OLD"))"
+run new "new (working tree)"
@@ -0,0 +1,317 @@
+/*
+    RewriteIPAllow: compiled trie against the apr_ipsubnet_test linear scan
+
+    Checks that find_trie() and find_accesslist() agree on random addresses
+    (IPv4, IPv6, IPv4-mapped IPv6) for random prefix sets in every form the
+    directive accepts (CIDR, netmask, partial IPv4, single address), then
+    measures both lookups with 10, 1k and 100k prefixes.
+
+      $ make -C test bench_trie
+      $ ./test/bench_trie [-c] [seed]     (-c: equivalence check only)
+
+    = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "../mod_myfixip.c"
+#include "mock_httpd.h"
+
+#include <stdio.h>
+
+#define CHECK_ROUNDS 500      // random prefix sets of the equivalence check
+#define CHECK_ADDRS 4096      // addresses tested per set
+#define BENCH_ADDRS 65536     // addresses of the benchmark
+#define BENCH_TESTS 200000000 // budget of apr_ipsubnet_test calls per size
+
+static apr_uint64_t rnd_state = 88172645463325252ULL;
+
+static apr_uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return (apr_uint32_t) (rnd_state >> 16);
+}
+
+typedef struct {
+    int family;
+    int bits;
+    apr_uint32_t net[4];
+} prefix;
+
+/**
+ * Random prefix, from a narrow address space when dense (nested and
+ * overlapping prefixes), added to the allow list of server in its text form
+ */
+static const char *prefix_add(apr_pool_t *p, prefix *x, int dense)
+{
+    cmd_parms *cmd = mock_cmd(NULL);
+    char addr[INET6_ADDRSTRLEN], *arg;
+    unsigned char b[16];
+    const char *err;
+    int i, form = rnd() % 8;
+
+    memset(x, 0, sizeof(prefix));
+    x->family = (rnd() % 4) ? AF_INET : AF_INET6;
+    for (i = 0; i < 4; ++i) {
+        x->net[i] = rnd();
+    }
+    if (dense) {
+        x->net[0] = (x->family == AF_INET) ? (0x0A000000 | (x->net[0] & 0x0000FFFF))
+                                           : (0x20010DB8);
+        if (x->family == AF_INET6) {
+            x->net[1] &= 0x000000FF;
+        }
+    }
+    x->bits = (x->family == AF_INET) ? (8 + rnd() % 25) : (16 + rnd() % 113);
+    for (i = 0; i < 4; ++i) {
+        b[4*i] = x->net[i] >> 24;
+        b[4*i+1] = x->net[i] >> 16;
+        b[4*i+2] = x->net[i] >> 8;
+        b[4*i+3] = x->net[i];
+    }
+    inet_ntop(x->family, b, addr, sizeof(addr));
+
+    if ((x->family == AF_INET) && (form == 0) && b[0]) { // partial: "10.1" (/8, /16, /24)
+        x->bits = 8 * (1 + rnd() % 3);
+        arg = apr_psprintf(p, "%u", b[0]);
+        for (i = 1; i < x->bits / 8; ++i) {
+            arg = apr_psprintf(p, "%s.%u", arg, b[i]);
+        }
+    }
+    else if ((x->family == AF_INET) && (form == 1)) { // netmask
+        apr_uint32_t m = x->bits ? (0xFFFFFFFFU << (32 - x->bits)) : 0;
+        arg = apr_psprintf(p, "%s/%u.%u.%u.%u", addr, m >> 24, (m >> 16) & 255, (m >> 8) & 255, m & 255);
+    }
+    else if (form == 2) { // single address
+        x->bits = (x->family == AF_INET) ? 32 : 128;
+        arg = apr_pstrdup(p, addr);
+    }
+    else {
+        arg = apr_psprintf(p, "%s/%d", addr, x->bits);
+    }
+
+    cmd->pool = p;
+    if ((err = allow_config_cmd(cmd, NULL, arg)) != NULL) {
+        fprintf(stderr, "RewriteIPAllow %s: %s\n", arg, err);
+        exit(2);
+    }
+    return arg;
+}
+
+/**
+ * Random address: inside a random prefix of the set (one in two), else
+ * anywhere; IPv4 addresses sometimes given as IPv4-mapped IPv6
+ */
+static void addr_make(apr_sockaddr_t *sa, const apr_sockaddr_t *sa4, const apr_sockaddr_t *sa6,
+                      const prefix *set, int n)
+{
+    apr_uint32_t a[4];
+    int i, family = (rnd() % 4) ? AF_INET : AF_INET6;
+
+    for (i = 0; i < 4; ++i) {
+        a[i] = rnd();
+    }
+    if (n && (rnd() % 2)) {
+        const prefix *x = &set[rnd() % n];
+        family = x->family;
+        for (i = 0; i < 4; ++i) {
+            int keep = x->bits - 32 * i;
+            apr_uint32_t m = (keep <= 0) ? 0 : (keep >= 32) ? 0xFFFFFFFFU : ~(0xFFFFFFFFU >> keep);
+            a[i] = (x->net[i] & m) | (a[i] & ~m);
+        }
+    }
+    if ((family == AF_INET) && (rnd() % 8)) {
+        *sa = *sa4;
+        sa->sa.sin.sin_addr.s_addr = htonl(a[0]);
+        sa->ipaddr_ptr = &sa->sa.sin.sin_addr;
+        return;
+    }
+    *sa = *sa6;
+    if (family == AF_INET) { // ::ffff:a.b.c.d
+        a[3] = a[0];
+        a[0] = a[1] = 0;
+        a[2] = 0xFFFF;
+    }
+    for (i = 0; i < 4; ++i) {
+        unsigned char *b = sa->sa.sin6.sin6_addr.s6_addr + 4 * i;
+        b[0] = a[i] >> 24;
+        b[1] = a[i] >> 16;
+        b[2] = a[i] >> 8;
+        b[3] = a[i];
+    }
+    sa->ipaddr_ptr = &sa->sa.sin6.sin6_addr;
+}
+
+/**
+ * Fresh allow list on the server
+ */
+static my_config *config_reset(apr_pool_t *p)
+{
+    my_config *conf = create_config(p, mock_server());
+
+    ap_set_module_config(mock_server()->module_config, &myfixip_module, conf);
+    return conf;
+}
+
+static void addr_print(const apr_sockaddr_t *sa)
+{
+    char buf[INET6_ADDRSTRLEN];
+
+    inet_ntop(sa->family, sa->ipaddr_ptr, buf, sizeof(buf));
+    fprintf(stderr, "  address %s\n", buf);
+}
+
+/**
+ * Brute force: trie and linear scan agree on every address
+ */
+static int check(apr_pool_t *pconf, const apr_sockaddr_t *sa4, const apr_sockaddr_t *sa6)
+{
+    int round, i, failed = 0;
+    apr_uint64_t hits = 0, tests = 0;
+
+    for (round = 0; round < CHECK_ROUNDS; ++round) {
+        apr_pool_t *p, *ptemp;
+        prefix set[64];
+        const char *args[64];
+        int n = 1 + rnd() % 64, dense = round % 2;
+        my_config *conf;
+        iptrie *t;
+
+        apr_pool_create(&p, pconf);
+        apr_pool_create(&ptemp, p);
+        conf = config_reset(p);
+        for (i = 0; i < n; ++i) {
+            args[i] = prefix_add(p, &set[i], dense);
+        }
+        t = trie_compile(p, ptemp, conf->allows);
+        for (i = 0; i < CHECK_ADDRS; ++i) {
+            apr_sockaddr_t sa;
+            int want, got;
+            addr_make(&sa, sa4, sa6, set, n);
+            want = find_accesslist(conf->allows, &sa);
+            got = find_trie(t, &sa);
+            hits += want;
+            ++tests;
+            if (want != got) {
+                int k;
+                fprintf(stderr, "MISMATCH round %d: trie %d, apr_ipsubnet_test %d\n", round, got, want);
+                addr_print(&sa);
+                for (k = 0; k < n; ++k) {
+                    fprintf(stderr, "  RewriteIPAllow %s\n", args[k]);
+                }
+                if (++failed > 5) {
+                    return 1;
+                }
+                break;
+            }
+        }
+        apr_pool_destroy(p);
+    }
+    printf("check: %d prefix sets, %" APR_UINT64_T_FMT " addresses (%" APR_UINT64_T_FMT " allowed): %s\n",
+           CHECK_ROUNDS, tests, hits, failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+/**
+ * ns/lookup of trie and linear scan for n prefixes
+ */
+static int bench(apr_pool_t *pconf, const apr_sockaddr_t *sa4, const apr_sockaddr_t *sa6, int n)
+{
+    apr_pool_t *p, *ptemp;
+    prefix *set;
+    apr_sockaddr_t *addrs;
+    my_config *conf;
+    iptrie *t;
+    apr_uint64_t t0, t1, t2;
+    int i, nlinear, found = 0, mismatch = 0;
+    volatile int sink = 0;
+
+    apr_pool_create(&p, pconf);
+    apr_pool_create(&ptemp, p);
+    conf = config_reset(p);
+    set = apr_palloc(p, n * sizeof(prefix));
+    for (i = 0; i < n; ++i) {
+        prefix_add(p, &set[i], 0);
+    }
+    addrs = apr_palloc(p, BENCH_ADDRS * sizeof(apr_sockaddr_t));
+    for (i = 0; i < BENCH_ADDRS; ++i) {
+        addr_make(&addrs[i], sa4, sa6, set, n);
+    }
+
+    t0 = mock_nsec();
+    t = trie_compile(p, ptemp, conf->allows);
+    t1 = mock_nsec();
+
+    for (i = 0; i < BENCH_ADDRS; ++i) {
+        found += find_trie(t, &addrs[i]);
+    }
+    t2 = mock_nsec();
+    sink += found;
+    printf("%6d prefixes: compile %8.3f ms, %d nodes | trie %7.1f ns/lookup",
+           n, (t1 - t0) / 1e6, t->nnodes, (double) (t2 - t1) / BENCH_ADDRS);
+
+    nlinear = BENCH_TESTS / n;
+    nlinear = (nlinear > BENCH_ADDRS) ? BENCH_ADDRS : nlinear;
+    t1 = mock_nsec();
+    for (i = 0; i < nlinear; ++i) {
+        sink += find_accesslist(conf->allows, &addrs[i]);
+    }
+    t2 = mock_nsec();
+    printf(" | linear %11.1f ns/lookup (%d addresses)", (double) (t2 - t1) / nlinear, nlinear);
+
+    for (i = 0; i < nlinear; ++i) {
+        mismatch += (find_trie(t, &addrs[i]) != find_accesslist(conf->allows, &addrs[i]));
+    }
+    printf(" | %d mismatches\n", mismatch);
+
+    apr_pool_destroy(p);
+    return mismatch ? 1 : 0;
+}
+
+int main(int argc, const char *const *argv)
+{
+    static const int sizes[] = { 10, 1000, 100000 };
+    apr_pool_t *pconf;
+    apr_sockaddr_t *sa4, *sa6;
+    int i, only_check = 0, rv = 0;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    apr_pool_create(&pconf, NULL);
+    mock_init(pconf);
+    mock_module(&myfixip_module);
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-c")) {
+            only_check = 1;
+        }
+        else {
+            rnd_state ^= apr_atoi64(argv[i]) * 0x9E3779B97F4A7C15ULL;
+        }
+    }
+    apr_sockaddr_info_get(&sa4, "127.0.0.1", APR_INET, 80, 0, pconf);
+    if (apr_sockaddr_info_get(&sa6, "::1", APR_INET6, 80, 0, pconf) != APR_SUCCESS) {
+        fprintf(stderr, "no IPv6 support in APR\n");
+        return 2;
+    }
+
+    rv |= check(pconf, sa4, sa6);
+    if (!only_check) {
+        for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); ++i) {
+            rv |= bench(pconf, sa4, sa6, sizes[i]);
+        }
+    }
+    apr_pool_destroy(pconf);
+    apr_terminate();
+    return rv;
+}
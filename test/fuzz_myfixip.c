@@ -0,0 +1,462 @@
+/*
+    mod_myfixip input filter: split/fuzz check and per connection cost
+
+    A connection runs pre_connection() and then reads its input through
+    helocon_filter_in() the way the HTTP request reader does (GETLINE until
+    EOF), over the mock core input filter of mock_httpd.c. The client bytes
+    arrive cut in segments, blocking or non-blocking (APR_EAGAIN before each
+    segment), on an optional or a required port, with the speculative path
+    on or off.
+
+    check: for every seed header (PROXY v1/v2, HELO, TEST, plain HTTP,
+    truncated and malformed ones), every split point and every flag
+    combination gives the same outcome as the unsplit input (verdict,
+    rewritten address, TLVs, bytes handed to HTTP), and those bytes are
+    always the tail of the input.
+
+    bench: ns, allocations and connection pool bytes per connection for
+    PROXY v1, PROXY v2, HELO, TEST and passthrough, header in one segment
+    (speculative path) or cut after 3 bytes (buffered path), minus the same
+    connection without the module.
+
+      $ make -C test fuzz_myfixip
+      $ ./test/fuzz_myfixip check|bench
+
+    libFuzzer (first byte: flags, second: split point, rest: client bytes):
+
+      $ make -C test fuzz_myfixip_libfuzzer CC=clang
+      $ ./test/fuzz_myfixip_libfuzzer -max_len=1200
+
+    = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "../mod_myfixip.c"
+#include "mock_httpd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PORT_OPTIONAL 80
+#define PORT_REQUIRED 81
+#define OUT_MAX 4096 // bytes of the HTTP side kept for comparison
+
+#define RUN_EAGAIN   1 // non-blocking reads, APR_EAGAIN before each segment
+#define RUN_REQUIRED 2 // RewriteIPProxyProtocol required port
+#define RUN_NOPEEK   4 // RewriteIPSpeculative off
+#define RUN_NOMODULE 8 // fixture only (no pre_connection)
+#define RUN_FLAGS    8 // combinations of the first three
+
+#define REQ "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n"
+#define V2_SIG "\r\n\r\n\0\r\nQUIT\n"
+
+typedef struct {
+    apr_status_t status;   // last read
+    int aborted;
+    int stat;              // my_stat of the header phase (-1 = no filter)
+    my_source source;      // rewrite address found in header
+    int family;
+    unsigned char addr[16];
+    apr_port_t port;
+    apr_size_t tlv_len;
+    apr_size_t out_len;    // bytes read by HTTP
+    char out[OUT_MAX];
+    apr_ssize_t pool_bytes; // c->pool growth (-1 = new block)
+} outcome;
+
+typedef struct {
+    const char *name;
+    const char *data;
+    apr_size_t len;
+} seed;
+
+static apr_pool_t *conn_parent = NULL;
+static my_config *conf = NULL;
+
+static void setup(void)
+{
+    static int done = 0;
+    apr_pool_t *pconf, *ptemp;
+    cmd_parms *cmd;
+
+    if (done) {
+        return;
+    }
+    done = 1;
+    apr_initialize();
+    apr_pool_create(&pconf, NULL);
+    apr_pool_create(&ptemp, pconf);
+    apr_pool_create(&conn_parent, pconf);
+    mock_init(pconf);
+    mock_module(&myfixip_module);
+    mock_listen(PORT_OPTIONAL);
+    mock_listen(PORT_REQUIRED);
+
+    conf = ap_get_module_config(mock_server()->module_config, &myfixip_module);
+    cmd = mock_cmd(NULL);
+    allow_config_cmd(cmd, NULL, "127.0.0.1");
+    proxy_protocol_config_cmd(cmd, NULL, "81", "required");
+    post_config(pconf, pconf, ptemp, mock_server());
+    child_init(pconf, mock_server());
+}
+
+/**
+ * One connection: pre_connection, then GETLINE reads until EOF or error
+ */
+static void run_conn(const char *data, apr_size_t len, const apr_size_t *cuts, int ncuts, int flags, outcome *o)
+{
+    apr_read_type_e block = (flags & RUN_EAGAIN) ? APR_NONBLOCK_READ : APR_BLOCK_READ;
+    apr_pool_t *p;
+    conn_rec *c;
+    apr_socket_t *csd = NULL;
+    apr_bucket_brigade *bb;
+    my_ctx *ctx = NULL;
+    my_conn_state *st;
+    char *mark;
+    apr_size_t n, max = len + 2 * MOCK_SEGMENTS + 8; // reads before "stuck"
+    apr_status_t s = APR_SUCCESS;
+    int peer = -1;
+
+    apr_pool_create(&p, conn_parent);
+    c = mock_conn(p, "127.0.0.1", 40000, (flags & RUN_REQUIRED) ? PORT_REQUIRED : PORT_OPTIONAL);
+    if (!(flags & RUN_NOMODULE) && (len >= 4) && !memcmp(data, TEST, 4)) {
+        csd = mock_socket(c, &peer); // answered on the socket
+    }
+    mock_input(c, data, len, cuts, ncuts, flags & RUN_EAGAIN);
+    bb = apr_brigade_create(p, c->bucket_alloc);
+    conf->speculative = (flags & RUN_NOPEEK) ? 0 : 1;
+
+    mark = mock_pool_mark(p);
+    if (!(flags & RUN_NOMODULE)) {
+        pre_connection(c, csd);
+        if (!strcmp(c->input_filters->frec->name, myfixip_filter_name)) {
+            ctx = c->input_filters->ctx;
+        }
+    }
+    o->out_len = 0;
+    for (n = 0; (n < max) && !c->aborted; ++n) {
+        apr_bucket *e;
+        s = ap_get_brigade(c->input_filters, bb, AP_MODE_GETLINE, block, HUGE_STRING_LEN);
+        if (APR_STATUS_IS_EAGAIN(s)) {
+            continue;
+        }
+        if (s != APR_SUCCESS) {
+            break;
+        }
+        for (e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb); e = APR_BUCKET_NEXT(e)) {
+            const char *str;
+            apr_size_t slen;
+            if (APR_BUCKET_IS_METADATA(e) || (apr_bucket_read(e, &str, &slen, APR_BLOCK_READ) != APR_SUCCESS)) {
+                continue;
+            }
+            if (o->out_len < OUT_MAX) {
+                memcpy(o->out + o->out_len, str, (slen < OUT_MAX - o->out_len) ? slen : (OUT_MAX - o->out_len));
+            }
+            o->out_len += slen;
+        }
+        apr_brigade_cleanup(bb);
+    }
+    o->pool_bytes = mock_pool_used(p, mark);
+
+    o->status = (n >= max) ? APR_EGENERAL : s;
+    o->aborted = c->aborted;
+    o->stat = ctx ? (int) ctx->stat : -1;
+    st = ap_get_module_config(c->conn_config, &myfixip_module);
+    o->source = st ? st->source : SOURCE_NONE;
+    o->family = st ? st->family : 0;
+    memset(o->addr, 0, sizeof(o->addr));
+    if (o->family) {
+        memcpy(o->addr, st->addr, sizeof(o->addr));
+    }
+    o->port = st ? st->port : 0;
+    o->tlv_len = st ? st->tlv_len : 0;
+
+    if (csd && (o->stat != STAT_TEST)) { // else closed by send_test_response
+        apr_socket_close(csd);
+    }
+    apr_pool_destroy(p);
+    if (peer >= 0) {
+        close(peer);
+    }
+}
+
+static int outcome_same(const outcome *a, const outcome *b)
+{
+    return (a->status == b->status) && (a->aborted == b->aborted) && (a->stat == b->stat)
+        && (a->source == b->source) && (a->family == b->family) && !memcmp(a->addr, b->addr, sizeof(a->addr))
+        && (a->port == b->port) && (a->tlv_len == b->tlv_len) && (a->out_len == b->out_len)
+        && !memcmp(a->out, b->out, (a->out_len < OUT_MAX) ? a->out_len : OUT_MAX);
+}
+
+static void outcome_print(const char *what, const outcome *o)
+{
+    char ip[INET6_ADDRSTRLEN] = "-";
+
+    if (o->family) {
+        inet_ntop(o->family, o->addr, ip, sizeof(ip));
+    }
+    fprintf(stderr, "  %-8s status=%d aborted=%d stat=%s source=%d ip=%s port=%u tlv=%" APR_SIZE_T_FMT " http=%" APR_SIZE_T_FMT " bytes\n",
+            what, o->status, o->aborted, (o->stat >= 0) ? stat_names[o->stat] : "-", o->source, ip, o->port,
+            o->tlv_len, o->out_len);
+}
+
+/**
+ * Outcome alone: HTTP gets the tail of the input, all of it when the
+ * first bytes cannot start a header
+ */
+static const char *outcome_check(const char *data, apr_size_t len, int flags, const outcome *o)
+{
+    apr_size_t keep = (o->out_len < OUT_MAX) ? o->out_len : OUT_MAX;
+
+    if (o->status == APR_EGENERAL) {
+        return "reader stuck (no progress)";
+    }
+    if ((o->out_len > len) || memcmp(o->out, data + len - o->out_len, keep)) {
+        return "bytes read by HTTP are not the tail of the input";
+    }
+    if ((len >= 4) && !(flags & RUN_REQUIRED) && memcmp(data, TEST, 4) && memcmp(data, HELO, 4)
+        && memcmp(data, PROXY, 4) && memcmp(data, PROXY_V2_SIG, 4) && (o->aborted || (o->out_len != len))) {
+        return "passthrough input altered";
+    }
+    return NULL;
+}
+
+/**
+ * Input cut at every byte boundary (one cut), then in single bytes, under
+ * every flag combination: same outcome as unsplit
+ */
+static int check_input(const char *name, const char *data, apr_size_t len, int verbose)
+{
+    static outcome ref, o;
+    apr_size_t cuts[MOCK_SEGMENTS];
+    const char *err;
+    int flags, i, ncuts, failed = 0;
+
+    for (flags = 0; flags < RUN_FLAGS; ++flags) {
+        run_conn(data, len, NULL, 0, flags, &ref);
+        if ((err = outcome_check(data, len, flags, &ref)) != NULL) {
+            fprintf(stderr, "FAIL %s flags=%d unsplit: %s\n", name, flags, err);
+            outcome_print("got", &ref);
+            failed++;
+            continue;
+        }
+        for (i = 0; (apr_size_t) i <= len; ++i) {
+            if ((apr_size_t) i < len) {
+                cuts[0] = i + 1; // segment [0, i+1), rest
+                ncuts = 1;
+            }
+            else { // single bytes as far as the cuts go
+                for (ncuts = 0; (ncuts < MOCK_SEGMENTS) && ((apr_size_t) ncuts < len); ++ncuts) {
+                    cuts[ncuts] = ncuts + 1;
+                }
+            }
+            run_conn(data, len, cuts, ncuts, flags, &o);
+            if (!outcome_same(&ref, &o) || ((err = outcome_check(data, len, flags, &o)) != NULL)) {
+                fprintf(stderr, "FAIL %s flags=%d cut=%d%s: %s\n", name, flags, (ncuts == 1) ? (int) cuts[0] : -1,
+                        (ncuts == 1) ? "" : " (bytes)", err ? err : "differs from unsplit");
+                outcome_print("unsplit", &ref);
+                outcome_print("split", &o);
+                failed++;
+                break;
+            }
+        }
+    }
+    if (verbose) {
+        printf("%-28s %4" APR_SIZE_T_FMT " bytes: %s\n", name, len, failed ? "FAILED" : "ok");
+    }
+    return failed;
+}
+
+/*
+ * Seeds
+ */
+#define V2_TCP4 V2_SIG "\x21\x11\x00\x0c" "\xc0\x00\x02\x01" "\xc6\x33\x64\x01" "\xdc\x04\x01\xbb"
+#define V2_TCP6_TLV V2_SIG "\x21\x21\x00\x2f" \
+    "\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01" \
+    "\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02" \
+    "\xdc\x04\x01\xbb" "\x02\x00\x08" "backend1"
+#define V2_LOCAL V2_SIG "\x20\x00\x00\x00"
+#define V2_BAD_SIG "\r\n\r\n\0\r\nQUIX\n" "\x21\x11\x00\x0c" "\xc0\x00\x02\x01" "\xc6\x33\x64\x01" "\xdc\x04\x01\xbb"
+#define V2_TOO_LONG V2_SIG "\x21\x11\x04\x00"
+
+#define SEED(name, str) { name, str, sizeof(str) - 1 }
+
+static const seed seeds[] = {
+    SEED("plain HTTP", REQ),
+    SEED("plain HTTP, short", "GET /"),
+    SEED("plain, 3 bytes", "GET"),
+    SEED("empty", ""),
+    SEED("PROXY v1 TCP4", "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\r\n" REQ),
+    SEED("PROXY v1 TCP6", "PROXY TCP6 2001:db8::1 2001:db8::2 56324 443\r\n" REQ),
+    SEED("PROXY v1 UNKNOWN", "PROXY UNKNOWN\r\n" REQ),
+    SEED("PROXY v1 only", "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\r\n"),
+    SEED("PROXY v1 no CRLF", "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443"),
+    SEED("PROXY v1 LF only", "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\n" REQ),
+    SEED("PROXY v1 bad address", "PROXY TCP4 192.0.2.300 198.51.100.1 56324 443\r\n" REQ),
+    SEED("PROXY v1 bad port", "PROXY TCP4 192.0.2.1 198.51.100.1 65536 443\r\n" REQ),
+    SEED("PROXY v1 overflow", "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443 "
+         "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n" REQ),
+    SEED("PROX (truncated)", "PROX"),
+    SEED("PROXY v2 TCP4", V2_TCP4 REQ),
+    SEED("PROXY v2 TCP6 + TLV", V2_TCP6_TLV REQ),
+    SEED("PROXY v2 LOCAL", V2_LOCAL REQ),
+    SEED("PROXY v2 only", V2_TCP4),
+    SEED("PROXY v2 bad signature", V2_BAD_SIG REQ),
+    SEED("PROXY v2 overflow", V2_TOO_LONG REQ),
+    SEED("HELO", "HELO\xc0\x00\x02\x01" REQ),
+    SEED("HELO only", "HELO\xc0\x00\x02\x01"),
+    SEED("HELO truncated", "HELO\xc0\x00"),
+    SEED("TEST", "TEST"),
+    SEED("TEST + data", "TEST\n"),
+};
+
+#define NSEEDS ((int) (sizeof(seeds) / sizeof(seeds[0])))
+
+static int check(void)
+{
+    int i, failed = 0;
+
+    for (i = 0; i < NSEEDS; ++i) {
+        failed += (check_input(seeds[i].name, seeds[i].data, seeds[i].len, 1) != 0);
+    }
+    printf("check: %d seeds x %d flag combinations x every split: %s\n", NSEEDS, RUN_FLAGS, failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+/*
+ * Per connection cost
+ */
+typedef struct {
+    apr_uint64_t nsec, pallocs, palloc_bytes, bucket_allocs;
+    apr_int64_t pool_bytes;
+    int spilled;
+} cost;
+
+/**
+ * Mean pool bytes of the connections that stayed in their first block
+ */
+static double pool_mean(const cost *k, int n)
+{
+    return (n > k->spilled) ? ((double) k->pool_bytes / (n - k->spilled)) : 0.0;
+}
+
+static void measure(const seed *sd, const apr_size_t *cuts, int ncuts, int flags, int iters, cost *k)
+{
+    static outcome o;
+    mock_counters before;
+    apr_uint64_t t0;
+    int i;
+
+    memset(k, 0, sizeof(cost));
+    run_conn(sd->data, sd->len, cuts, ncuts, flags, &o); // warm up
+    before = mock_count;
+    t0 = mock_nsec();
+    for (i = 0; i < iters; ++i) {
+        run_conn(sd->data, sd->len, cuts, ncuts, flags, &o);
+        if (o.pool_bytes < 0) {
+            k->spilled++;
+        }
+        else {
+            k->pool_bytes += o.pool_bytes;
+        }
+    }
+    k->nsec = mock_nsec() - t0;
+    k->pallocs = mock_count.pallocs - before.pallocs;
+    k->palloc_bytes = mock_count.palloc_bytes - before.palloc_bytes;
+    k->bucket_allocs = mock_count.bucket_allocs - before.bucket_allocs;
+}
+
+static int bench(int iters)
+{
+    static const seed rows[] = {
+        SEED("PROXY v1", "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\r\n" REQ),
+        SEED("PROXY v2", V2_TCP4 REQ),
+        SEED("HELO", "HELO\xc0\x00\x02\x01" REQ),
+        SEED("TEST", "TEST"),
+        SEED("passthrough", REQ),
+    };
+    static const apr_size_t cut3[1] = { 3 };
+    int i, path;
+
+    printf("per connection, module minus fixture (%d connections per row)\n", iters);
+    printf("%-12s %-11s %10s %10s %12s %10s %10s\n", "header", "path", "ns/conn", "pallocs", "palloc B", "buckets", "pool B");
+    for (i = 0; i < (int) (sizeof(rows) / sizeof(rows[0])); ++i) {
+        for (path = 0; path < 2; ++path) {
+            cost with, without;
+            int n = strcmp(rows[i].name, "TEST") ? iters : iters / 10; // socketpair per connection
+            const apr_size_t *cuts = path ? cut3 : NULL;
+            measure(&rows[i], cuts, path, RUN_NOMODULE, n, &without);
+            measure(&rows[i], cuts, path, 0, n, &with);
+            printf("%-12s %-11s %10.1f %10.2f %12.1f %10.2f %10.1f%s\n", rows[i].name,
+                   path ? "buffered" : "speculative",
+                   ((double) with.nsec - (double) without.nsec) / n,
+                   ((double) with.pallocs - (double) without.pallocs) / n,
+                   ((double) with.palloc_bytes - (double) without.palloc_bytes) / n,
+                   ((double) with.bucket_allocs - (double) without.bucket_allocs) / n,
+                   pool_mean(&with, n) - pool_mean(&without, n),
+                   with.spilled ? " (pool spilled)" : "");
+        }
+    }
+    return 0;
+}
+
+#ifdef FUZZ_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t size)
+{
+    static outcome ref, o;
+    apr_size_t cuts[2];
+    const char *data = (const char *) buf + 2, *err;
+    apr_size_t len;
+    int flags;
+
+    if (size < 2) {
+        return 0;
+    }
+    setup();
+    flags = buf[0] % RUN_FLAGS;
+    len = size - 2;
+    run_conn(data, len, NULL, 0, flags, &ref);
+    if ((err = outcome_check(data, len, flags, &ref)) != NULL) {
+        fprintf(stderr, "flags=%d: %s\n", flags, err);
+        outcome_print("got", &ref);
+        abort();
+    }
+    if (len > 1) {
+        cuts[0] = 1 + buf[1] % (len - 1);
+        cuts[1] = cuts[0] + 1;
+        run_conn(data, len, cuts, (cuts[1] < len) ? 2 : 1, flags, &o);
+        if (!outcome_same(&ref, &o)) {
+            fprintf(stderr, "flags=%d cut=%d: differs from unsplit\n", flags, (int) cuts[0]);
+            outcome_print("unsplit", &ref);
+            outcome_print("split", &o);
+            abort();
+        }
+    }
+    return 0;
+}
+#else
+int main(int argc, const char *const *argv)
+{
+    const char *what = (argc > 1) ? argv[1] : "check";
+
+    setup();
+    if (!strcmp(what, "check")) {
+        return check();
+    }
+    if (!strcmp(what, "bench")) {
+        return bench((argc > 2) ? atoi(argv[2]) : 100000);
+    }
+    fprintf(stderr, "usage: %s check|bench [connections]\n", argv[0]);
+    return 2;
+}
+#endif
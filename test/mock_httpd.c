@@ -0,0 +1,927 @@
+/*
+    Mock httpd for in-process tests and benchmarks of the modules
+    (see mock_httpd.h)
+
+    = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // RTLD_NEXT
+#endif
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// 2.4 defines ap_rputs inline (on top of ap_rwrite), 2.2 exports it
+#define ap_rputs mock_rputs_decl
+#include "httpd.h"
+#include "http_config.h"
+#include "http_connection.h"
+#include "http_core.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "http_request.h"
+#include "util_filter.h"
+#include "ap_listen.h"
+#include "ap_mpm.h"
+#include "scoreboard.h"
+#include "apr_strings.h"
+#include "apr_buckets.h"
+#include "apr_base64.h"
+#include "apr_portable.h"
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+#include "ap_expr.h"
+#endif
+#undef ap_rputs
+
+#include "mock_httpd.h"
+
+#define MOCK_POOL_BLOCK 8192 // smallest block of an APR pool
+
+mock_counters mock_count;
+
+static apr_pool_t *mock_pconf = NULL;
+static server_rec *mock_main_server = NULL;
+static int mock_next_index = 1;
+static long mock_conn_id = 0;
+static int mock_log = 0;
+static ap_filter_rec_t *mock_filters = NULL; // registered filters
+
+/*
+ * Mock data of httpd
+ */
+module AP_MODULE_DECLARE_DATA core_module = {
+    STANDARD20_MODULE_STUFF,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+ap_listen_rec *ap_listeners = NULL;
+scoreboard *ap_scoreboard_image = NULL;
+ap_generation_t volatile ap_my_generation = 0;
+
+/*
+ * Allocation counters: the executable is linked with -rdynamic, so these
+ * also catch the calls made inside libapr/libaprutil (unless they were
+ * linked with -Bsymbolic-functions, as on some distributions)
+ */
+typedef void *(*palloc_fn)(apr_pool_t *, apr_size_t);
+typedef void *(*bucket_alloc_fn)(apr_size_t, apr_bucket_alloc_t *);
+
+static void *palloc_real(apr_pool_t *p, apr_size_t size)
+{
+    static palloc_fn real = NULL;
+
+    if (!real) {
+        real = (palloc_fn) dlsym(RTLD_NEXT, "apr_palloc");
+    }
+    return real(p, size);
+}
+
+#if !APR_POOL_DEBUG
+void *apr_palloc(apr_pool_t *p, apr_size_t size)
+{
+    ++mock_count.pallocs;
+    mock_count.palloc_bytes += size;
+    return palloc_real(p, size);
+}
+#endif
+
+void *apr_bucket_alloc(apr_size_t size, apr_bucket_alloc_t *list)
+{
+    static bucket_alloc_fn real = NULL;
+
+    if (!real) {
+        real = (bucket_alloc_fn) dlsym(RTLD_NEXT, "apr_bucket_alloc");
+    }
+    ++mock_count.bucket_allocs;
+    return real(size, list);
+}
+
+char *mock_pool_mark(apr_pool_t *p)
+{
+    return palloc_real(p, 0); // first free byte, nothing taken
+}
+
+apr_ssize_t mock_pool_used(apr_pool_t *p, const char *mark)
+{
+    apr_ssize_t used = (char *) palloc_real(p, 0) - mark;
+
+    // A new block is another malloc: never within a block after mark
+    return ((used >= 0) && (used < MOCK_POOL_BLOCK)) ? used : -1;
+}
+
+apr_uint64_t mock_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Config
+ */
+static ap_conf_vector_t *mock_vector(apr_pool_t *p)
+{
+    return (ap_conf_vector_t *) apr_pcalloc(p, MOCK_MODULES * sizeof(void *));
+}
+
+#undef ap_get_module_config
+#undef ap_set_module_config
+void *ap_get_module_config(const ap_conf_vector_t *cv, const module *m)
+{
+    return ((void **) cv)[m->module_index];
+}
+
+void ap_set_module_config(ap_conf_vector_t *cv, const module *m, void *val)
+{
+    ((void **) cv)[m->module_index] = val;
+}
+
+const char *ap_check_cmd_context(cmd_parms *cmd, unsigned forbidden)
+{
+    return NULL;
+}
+
+const char *ap_set_flag_slot(cmd_parms *cmd, void *struct_ptr, int arg)
+{
+    *(int *) ((char *) struct_ptr + (apr_size_t) cmd->info) = arg ? 1 : 0;
+    return NULL;
+}
+
+const char *ap_set_int_slot(cmd_parms *cmd, void *struct_ptr, const char *arg)
+{
+    *(int *) ((char *) struct_ptr + (apr_size_t) cmd->info) = atoi(arg);
+    return NULL;
+}
+
+const char *ap_set_string_slot(cmd_parms *cmd, void *struct_ptr, const char *arg)
+{
+    *(const char **) ((char *) struct_ptr + (apr_size_t) cmd->info) = arg;
+    return NULL;
+}
+
+char *ap_server_root_relative(apr_pool_t *p, const char *fname)
+{
+    char *name = apr_pstrcat(p, "/tmp/mock_httpd.", fname, NULL), *s;
+
+    for (s = name + 5; *s; ++s) {
+        if (*s == '/') {
+            *s = '_';
+        }
+    }
+    return name;
+}
+
+void ap_add_version_component(apr_pool_t *pconf, const char *component)
+{
+}
+
+apr_status_t ap_mpm_query(int query_code, int *result)
+{
+    switch (query_code) {
+        case AP_MPMQ_HARD_LIMIT_DAEMONS:
+        case AP_MPMQ_MAX_DAEMONS:
+            *result = 4;
+            return APR_SUCCESS;
+        case AP_MPMQ_HARD_LIMIT_THREADS:
+        case AP_MPMQ_MAX_THREADS:
+            *result = 25;
+            return APR_SUCCESS;
+        case AP_MPMQ_MPM_STATE:
+            *result = AP_MPMQ_RUNNING;
+            return APR_SUCCESS;
+        default:
+            *result = 0;
+            return APR_ENOTIMPL;
+    }
+}
+
+int ap_exists_scoreboard_image(void)
+{
+    return 0;
+}
+
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+worker_score *ap_get_scoreboard_worker_from_indexes(int child_num, int thread_num)
+{
+    return NULL;
+}
+#else
+worker_score *ap_get_scoreboard_worker(int x, int y)
+{
+    return NULL;
+}
+#endif
+
+/*
+ * Hooks: registered functions are not run, tests call them directly
+ */
+#define MOCK_HOOK(name) \
+    void ap_hook_##name(ap_HOOK_##name##_t *pf, const char * const *pre, const char * const *succ, int order) { }
+
+MOCK_HOOK(pre_config)
+MOCK_HOOK(post_config)
+MOCK_HOOK(child_init)
+MOCK_HOOK(pre_connection)
+MOCK_HOOK(post_read_request)
+MOCK_HOOK(header_parser)
+MOCK_HOOK(access_checker)
+MOCK_HOOK(fixups)
+MOCK_HOOK(insert_filter)
+MOCK_HOOK(insert_error_filter)
+MOCK_HOOK(handler)
+MOCK_HOOK(log_transaction)
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+MOCK_HOOK(expr_lookup)
+#endif
+
+/*
+ * Logging (MOCK_LOG=1 in the environment prints to stderr)
+ */
+static void mock_vlog(const char *file, int line, int level, apr_status_t status, const char *fmt, va_list ap)
+{
+    char buf[512];
+
+    if (!mock_log) {
+        return;
+    }
+    apr_vsnprintf(buf, sizeof(buf), fmt, ap);
+    fprintf(stderr, "[%d] %s:%d status=%d %s\n", level & APLOG_LEVELMASK, file, line, status, buf);
+}
+
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+void ap_log_error_(const char *file, int line, int module_index, int level, apr_status_t status,
+                   const server_rec *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    mock_vlog(file, line, level, status, fmt, ap);
+    va_end(ap);
+}
+
+void ap_log_cerror_(const char *file, int line, int module_index, int level, apr_status_t status,
+                    const conn_rec *c, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    mock_vlog(file, line, level, status, fmt, ap);
+    va_end(ap);
+}
+
+void ap_log_rerror_(const char *file, int line, int module_index, int level, apr_status_t status,
+                    const request_rec *r, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    mock_vlog(file, line, level, status, fmt, ap);
+    va_end(ap);
+}
+#else
+void ap_log_error(const char *file, int line, int level, apr_status_t status,
+                  const server_rec *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    mock_vlog(file, line, level, status, fmt, ap);
+    va_end(ap);
+}
+
+void ap_log_rerror(const char *file, int line, int level, apr_status_t status,
+                   const request_rec *r, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    mock_vlog(file, line, level, status, fmt, ap);
+    va_end(ap);
+}
+#endif
+
+/*
+ * Strings
+ */
+#undef ap_strchr
+char *ap_strchr(char *s, int c)
+{
+    return strchr(s, c);
+}
+
+char *ap_getword(apr_pool_t *p, const char **line, char stop)
+{
+    const char *pos = *line;
+    char *res;
+
+    while ((*pos != stop) && *pos) {
+        ++pos;
+    }
+    res = apr_pstrmemdup(p, *line, pos - *line);
+    if (stop) {
+        while (*pos == stop) {
+            ++pos;
+        }
+    }
+    *line = pos;
+    return res;
+}
+
+char *ap_getword_nulls(apr_pool_t *p, const char **line, char stop)
+{
+    const char *pos = strchr(*line, stop);
+    char *res;
+
+    if (!pos) {
+        apr_size_t len = strlen(*line);
+        res = apr_pstrmemdup(p, *line, len);
+        *line += len;
+        return res;
+    }
+    res = apr_pstrmemdup(p, *line, pos - *line);
+    *line = pos + 1;
+    return res;
+}
+
+char *ap_pbase64decode(apr_pool_t *p, const char *bufcoded)
+{
+    char *decoded = apr_palloc(p, apr_base64_decode_len(bufcoded) + 1);
+    int len = apr_base64_decode(decoded, bufcoded);
+
+    decoded[len] = '\0';
+    return decoded;
+}
+
+char *ap_pbase64encode(apr_pool_t *p, char *string)
+{
+    int len = (int) strlen(string);
+    char *encoded = apr_palloc(p, apr_base64_encode_len(len));
+
+    apr_base64_encode(encoded, string, len);
+    return encoded;
+}
+
+/*
+ * Response (bytes are counted, not kept)
+ */
+int ap_rwrite(const void *buf, int nbyte, request_rec *r)
+{
+    mock_count.out_bytes += nbyte;
+    return nbyte;
+}
+
+int ap_rputs(const char *str, request_rec *r)
+{
+    return ap_rwrite(str, (int) strlen(str), r);
+}
+
+int ap_rprintf(request_rec *r, const char *fmt, ...)
+{
+    char buf[4096];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = apr_vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return ap_rwrite(buf, len, r);
+}
+
+void ap_set_content_type(request_rec *r, const char *ct)
+{
+    r->content_type = ct;
+}
+
+void ap_set_content_length(request_rec *r, apr_off_t length)
+{
+    r->clength = length;
+    apr_table_setn(r->headers_out, "Content-Length", apr_off_t_toa(r->pool, length));
+}
+
+/*
+ * Filters
+ */
+ap_filter_rec_t *ap_register_input_filter(const char *name, ap_in_filter_func filter_func,
+                                          ap_init_filter_func filter_init, ap_filter_type ftype)
+{
+    ap_filter_rec_t *frec = apr_pcalloc(mock_pconf, sizeof(ap_filter_rec_t));
+
+    frec->name = name;
+    frec->filter_func.in_func = filter_func;
+    frec->filter_init_func = filter_init;
+    frec->ftype = ftype;
+    frec->next = mock_filters;
+    mock_filters = frec;
+    return frec;
+}
+
+ap_filter_rec_t *ap_register_output_filter(const char *name, ap_out_filter_func filter_func,
+                                           ap_init_filter_func filter_init, ap_filter_type ftype)
+{
+    ap_filter_rec_t *frec = ap_register_input_filter(name, NULL, filter_init, ftype);
+
+    frec->filter_func.out_func = filter_func;
+    return frec;
+}
+
+static ap_filter_rec_t *mock_filter_find(const char *name)
+{
+    ap_filter_rec_t *frec;
+
+    for (frec = mock_filters; frec; frec = frec->next) {
+        if (!strcasecmp(frec->name, name)) {
+            return frec;
+        }
+    }
+    return NULL;
+}
+
+// Same placement as util_filter.c: ordered by type, request filters first
+#define INSERT_BEFORE(f, before_this) ((before_this) == NULL \
+                                       || (before_this)->frec->ftype > (f)->frec->ftype \
+                                       || (before_this)->r != (f)->r)
+
+static ap_filter_t *mock_add_filter(const char *name, void *ctx, request_rec *r, conn_rec *c,
+                                    ap_filter_t **r_filters, ap_filter_t **p_filters, ap_filter_t **c_filters)
+{
+    ap_filter_rec_t *frec = mock_filter_find(name);
+    ap_filter_t *f, **outf;
+
+    if (!frec) {
+        fprintf(stderr, "mock_httpd: unknown filter %s\n", name);
+        abort();
+    }
+    f = apr_pcalloc(r ? r->pool : c->pool, sizeof(ap_filter_t));
+    f->frec = frec;
+    f->ctx = ctx;
+    f->r = (frec->ftype < AP_FTYPE_CONNECTION) ? r : NULL;
+    f->c = c;
+    outf = (r && (frec->ftype < AP_FTYPE_PROTOCOL)) ? r_filters
+         : (r && (frec->ftype < AP_FTYPE_CONNECTION)) ? p_filters : c_filters;
+
+    if (INSERT_BEFORE(f, *outf)) {
+        f->next = *outf;
+        if (*outf && r && (*r_filters != *outf)) {
+            ap_filter_t *first = *r_filters;
+            while (first && (first->next != *outf)) {
+                first = first->next;
+            }
+            if (first) {
+                first->next = f;
+            }
+        }
+        *outf = f;
+    }
+    else {
+        ap_filter_t *fscan = *outf;
+        while (!INSERT_BEFORE(f, fscan->next)) {
+            fscan = fscan->next;
+        }
+        f->next = fscan->next;
+        fscan->next = f;
+    }
+    if (r && (frec->ftype < AP_FTYPE_CONNECTION) && (*r_filters == *c_filters)) {
+        *r_filters = *p_filters;
+    }
+    return f;
+}
+
+static void mock_remove_filter(ap_filter_t *f, ap_filter_t **r_filters, ap_filter_t **p_filters, ap_filter_t **c_filters)
+{
+    ap_filter_t **curr = (f->r && r_filters) ? r_filters : c_filters;
+    ap_filter_t *fscan = *curr;
+
+    if (p_filters && (*p_filters == f)) {
+        *p_filters = f->next;
+    }
+    if (*curr == f) {
+        *curr = f->next;
+        return;
+    }
+    while (fscan && (fscan->next != f)) {
+        fscan = fscan->next;
+    }
+    if (fscan) {
+        fscan->next = f->next;
+    }
+}
+
+ap_filter_t *ap_add_input_filter(const char *name, void *ctx, request_rec *r, conn_rec *c)
+{
+    return mock_add_filter(name, ctx, r, c, r ? &r->input_filters : NULL,
+                           r ? &r->proto_input_filters : NULL, &c->input_filters);
+}
+
+ap_filter_t *ap_add_output_filter(const char *name, void *ctx, request_rec *r, conn_rec *c)
+{
+    return mock_add_filter(name, ctx, r, c, r ? &r->output_filters : NULL,
+                           r ? &r->proto_output_filters : NULL, &c->output_filters);
+}
+
+void ap_remove_input_filter(ap_filter_t *f)
+{
+    mock_remove_filter(f, f->r ? &f->r->input_filters : NULL,
+                       f->r ? &f->r->proto_input_filters : NULL, &f->c->input_filters);
+}
+
+void ap_remove_output_filter(ap_filter_t *f)
+{
+    mock_remove_filter(f, f->r ? &f->r->output_filters : NULL,
+                       f->r ? &f->r->proto_output_filters : NULL, &f->c->output_filters);
+}
+
+apr_status_t ap_get_brigade(ap_filter_t *f, apr_bucket_brigade *bb, ap_input_mode_t mode,
+                            apr_read_type_e block, apr_off_t readbytes)
+{
+    return f ? f->frec->filter_func.in_func(f, bb, mode, block, readbytes) : AP_NOBODY_READ;
+}
+
+apr_status_t ap_pass_brigade(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    return f ? f->frec->filter_func.out_func(f, bb) : AP_NOBODY_WROTE;
+}
+
+/*
+ * Core input: the client stream, received segment by segment
+ */
+typedef struct {
+    const char *data;
+    apr_size_t len;
+    apr_size_t pos;        // consumed by the filters above
+    apr_size_t avail;      // received
+    apr_size_t cut[MOCK_SEGMENTS];
+    int ncuts;
+    int next;              // next cut
+    int eagain;
+    int stalled;           // APR_EAGAIN returned for this segment
+} mock_stream;
+
+/**
+ * Receive next segment, 0 = connection closed by the client
+ */
+static int mock_receive(mock_stream *s)
+{
+    if (s->avail == s->len) {
+        return 0;
+    }
+    while ((s->next < s->ncuts) && (s->cut[s->next] <= s->avail)) {
+        ++s->next;
+    }
+    s->avail = (s->next < s->ncuts) ? s->cut[s->next++] : s->len;
+    return 1;
+}
+
+static apr_status_t mock_core_in(ap_filter_t *f, apr_bucket_brigade *b, ap_input_mode_t mode,
+                                 apr_read_type_e block, apr_off_t readbytes)
+{
+    mock_stream *s = f->ctx;
+    apr_size_t n;
+
+    ++mock_count.in_reads;
+    if (mode == AP_MODE_INIT) {
+        return APR_SUCCESS;
+    }
+    if (!s) {
+        return APR_EOF;
+    }
+    if (s->pos == s->avail) {
+        if (s->avail == s->len) {
+            return APR_EOF;
+        }
+        if ((block == APR_NONBLOCK_READ) && s->eagain && !s->stalled) {
+            s->stalled = 1;
+            return APR_EAGAIN;
+        }
+        s->stalled = 0;
+        mock_receive(s);
+    }
+    switch (mode) {
+        case AP_MODE_GETLINE: {
+            const char *lf;
+            while (!(lf = memchr(s->data + s->pos, '\n', s->avail - s->pos))
+                   && (block == APR_BLOCK_READ) && mock_receive(s))
+                ;
+            n = lf ? (apr_size_t) (lf + 1 - (s->data + s->pos)) : (s->avail - s->pos);
+            break;
+        }
+        case AP_MODE_EXHAUSTIVE:
+            while (mock_receive(s))
+                ;
+            n = s->avail - s->pos;
+            break;
+        default:
+            n = s->avail - s->pos;
+            if ((readbytes > 0) && ((apr_off_t) n > readbytes)) {
+                n = (apr_size_t) readbytes;
+            }
+            break;
+    }
+    APR_BRIGADE_INSERT_TAIL(b, apr_bucket_transient_create(s->data + s->pos, n, f->c->bucket_alloc));
+    if (mode != AP_MODE_SPECULATIVE) {
+        s->pos += n;
+    }
+    return APR_SUCCESS;
+}
+
+void mock_input(conn_rec *c, const char *data, apr_size_t len, const apr_size_t *cuts, int ncuts, int eagain)
+{
+    ap_filter_t *f = c->input_filters;
+    mock_stream *s = apr_pcalloc(c->pool, sizeof(mock_stream));
+
+    while (f->next) {
+        f = f->next;
+    }
+    s->data = data;
+    s->len = len;
+    s->ncuts = (ncuts < MOCK_SEGMENTS) ? ncuts : MOCK_SEGMENTS;
+    if (s->ncuts > 0) {
+        memcpy(s->cut, cuts, s->ncuts * sizeof(apr_size_t));
+    }
+    s->eagain = eagain;
+    f->ctx = s;
+}
+
+/*
+ * Core output: the client (bytes counted)
+ */
+static apr_status_t mock_core_out(ap_filter_t *f, apr_bucket_brigade *b)
+{
+    apr_bucket *e;
+
+    for (e = APR_BRIGADE_FIRST(b); e != APR_BRIGADE_SENTINEL(b); e = APR_BUCKET_NEXT(e)) {
+        if (APR_BUCKET_IS_EOS(e)) {
+            ++mock_count.out_eos;
+        }
+        else if (!APR_BUCKET_IS_METADATA(e)) {
+            const char *str;
+            apr_size_t len;
+            if (apr_bucket_read(e, &str, &len, APR_BLOCK_READ) == APR_SUCCESS) {
+                mock_count.out_bytes += len;
+            }
+        }
+    }
+    apr_brigade_cleanup(b);
+    return f->c->aborted ? APR_ECONNABORTED : APR_SUCCESS;
+}
+
+/*
+ * Protocol filter standing for HTTP_HEADER: the response headers are the
+ * ones set before the first brigade reaches it (kept in r->notes as
+ * "mock-headers", "name: value\n" lines of headers_out and err_headers_out)
+ */
+static apr_status_t mock_http_header(ap_filter_t *f, apr_bucket_brigade *b)
+{
+    request_rec *r = f->r;
+    const apr_array_header_t *arr[2];
+    char *lines = "";
+    int i, k;
+
+    arr[0] = apr_table_elts(r->headers_out);
+    arr[1] = apr_table_elts(r->err_headers_out);
+    for (k = 0; k < 2; ++k) {
+        const apr_table_entry_t *e = (const apr_table_entry_t *) arr[k]->elts;
+        for (i = 0; i < arr[k]->nelts; ++i) {
+            lines = apr_pstrcat(r->pool, lines, e[i].key, ": ", e[i].val, "\n", NULL);
+        }
+    }
+    apr_table_setn(r->notes, "mock-headers", lines);
+    ap_remove_output_filter(f);
+    return ap_pass_brigade(f->next, b);
+}
+
+/*
+ * Fixture
+ */
+void mock_init(apr_pool_t *p)
+{
+    server_rec *s;
+
+    mock_pconf = p;
+    mock_log = getenv("MOCK_LOG") != NULL;
+    core_module.module_index = 0;
+
+    s = apr_pcalloc(p, sizeof(server_rec));
+    s->process = apr_pcalloc(p, sizeof(process_rec));
+    s->process->pool = p;
+    s->process->pconf = p;
+    s->process->short_name = "mock_httpd";
+    s->defn_name = "mock_httpd";
+    s->server_hostname = "localhost";
+    s->port = 80;
+    s->timeout = apr_time_from_sec(60);
+    s->keep_alive_timeout = apr_time_from_sec(5);
+    s->keep_alive_max = 100;
+    s->keep_alive = 1;
+    s->module_config = mock_vector(p);
+    s->lookup_defaults = mock_vector(p);
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+    s->log.level = APLOG_WARNING;
+#else
+    s->loglevel = APLOG_WARNING;
+#endif
+    mock_main_server = s;
+
+    ap_register_input_filter("MOCK_CORE_IN", mock_core_in, NULL, AP_FTYPE_NETWORK);
+    ap_register_output_filter("MOCK_CORE_OUT", mock_core_out, NULL, AP_FTYPE_NETWORK);
+    ap_register_output_filter("MOCK_HTTP_HEADER", mock_http_header, NULL, AP_FTYPE_PROTOCOL);
+}
+
+void mock_module(module *m)
+{
+    server_rec *s = mock_main_server;
+
+    m->module_index = mock_next_index++;
+    if (m->module_index >= MOCK_MODULES) {
+        fprintf(stderr, "mock_httpd: more than %d modules\n", MOCK_MODULES);
+        abort();
+    }
+    if (m->create_server_config) {
+        ((void **) s->module_config)[m->module_index] = m->create_server_config(mock_pconf, s);
+    }
+    if (m->create_dir_config) {
+        ((void **) s->lookup_defaults)[m->module_index] = m->create_dir_config(mock_pconf, NULL);
+    }
+    if (m->register_hooks) {
+        m->register_hooks(mock_pconf);
+    }
+}
+
+server_rec *mock_server(void)
+{
+    return mock_main_server;
+}
+
+void mock_listen(apr_port_t port)
+{
+    ap_listen_rec *l = apr_pcalloc(mock_pconf, sizeof(ap_listen_rec));
+
+    apr_sockaddr_info_get(&l->bind_addr, "0.0.0.0", APR_INET, port, 0, mock_pconf);
+    l->next = ap_listeners;
+    ap_listeners = l;
+}
+
+cmd_parms *mock_cmd(void *info)
+{
+    cmd_parms *cmd = apr_pcalloc(mock_pconf, sizeof(cmd_parms));
+
+    cmd->info = info;
+    cmd->pool = mock_pconf;
+    cmd->temp_pool = mock_pconf;
+    cmd->server = mock_main_server;
+    cmd->override = OR_ALL | ACCESS_CONF | RSRC_CONF;
+    return cmd;
+}
+
+/**
+ * Address of numeric ip (parsed once, copied into p)
+ */
+static apr_sockaddr_t *mock_sockaddr(apr_pool_t *p, const char *ip, apr_port_t port)
+{
+    static struct {
+        char ip[64];
+        apr_sockaddr_t sa;
+    } cache[8];
+    static int ncache = 0;
+    apr_sockaddr_t *sa = NULL;
+    int i;
+
+    for (i = 0; i < ncache; ++i) {
+        if (!strcmp(cache[i].ip, ip)) {
+            sa = &cache[i].sa;
+            break;
+        }
+    }
+    if (!sa) {
+        apr_sockaddr_t *parsed;
+        if (apr_sockaddr_info_get(&parsed, ip, APR_UNSPEC, 0, 0, mock_pconf) != APR_SUCCESS) {
+            fprintf(stderr, "mock_httpd: bad address %s\n", ip);
+            abort();
+        }
+        i = (ncache < 8) ? ncache++ : 7;
+        apr_cpystrn(cache[i].ip, ip, sizeof(cache[i].ip));
+        cache[i].sa = *parsed;
+        sa = &cache[i].sa;
+    }
+    sa = apr_pmemdup(p, sa, sizeof(apr_sockaddr_t));
+    sa->pool = p;
+    sa->hostname = NULL;
+    sa->servname = NULL;
+    sa->next = NULL;
+    sa->port = port;
+#if APR_HAVE_IPV6
+    if (sa->family == APR_INET6) {
+        sa->sa.sin6.sin6_port = htons(port);
+        sa->ipaddr_ptr = &sa->sa.sin6.sin6_addr;
+        return sa;
+    }
+#endif
+    sa->sa.sin.sin_port = htons(port);
+    sa->ipaddr_ptr = &sa->sa.sin.sin_addr;
+    return sa;
+}
+
+conn_rec *mock_conn(apr_pool_t *p, const char *client_ip, apr_port_t client_port, apr_port_t local_port)
+{
+    conn_rec *c = apr_pcalloc(p, sizeof(conn_rec));
+    ap_filter_t *in = apr_pcalloc(p, sizeof(ap_filter_t));
+    ap_filter_t *out = apr_pcalloc(p, sizeof(ap_filter_t));
+
+    c->pool = p;
+    c->base_server = mock_main_server;
+    c->id = ++mock_conn_id;
+    c->conn_config = mock_vector(p);
+    c->notes = apr_table_make(p, 5);
+    c->bucket_alloc = apr_bucket_alloc_create(p);
+    c->keepalive = AP_CONN_UNKNOWN;
+    c->local_addr = mock_sockaddr(p, "127.0.0.1", local_port);
+    c->local_ip = "127.0.0.1";
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+    c->client_addr = mock_sockaddr(p, client_ip, client_port);
+    c->client_ip = apr_pstrdup(p, client_ip);
+#else
+    c->remote_addr = mock_sockaddr(p, client_ip, client_port);
+    c->remote_ip = apr_pstrdup(p, client_ip);
+#endif
+    in->frec = mock_filter_find("MOCK_CORE_IN");
+    in->c = c;
+    c->input_filters = in;
+    out->frec = mock_filter_find("MOCK_CORE_OUT");
+    out->c = c;
+    c->output_filters = out;
+    return c;
+}
+
+apr_socket_t *mock_socket(conn_rec *c, int *peer)
+{
+    apr_socket_t *sock = NULL;
+    int fd[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0) {
+        perror("mock_httpd: socketpair");
+        abort();
+    }
+    apr_os_sock_put(&sock, &fd[0], c->pool);
+    ap_set_module_config(c->conn_config, &core_module, sock);
+    *peer = fd[1];
+    return sock;
+}
+
+request_rec *mock_request(conn_rec *c, const char *method, const char *uri, const char *args)
+{
+    apr_pool_t *p;
+    request_rec *r;
+
+    apr_pool_create(&p, c->pool);
+    r = apr_pcalloc(p, sizeof(request_rec));
+    r->pool = p;
+    r->connection = c;
+    r->server = c->base_server;
+    r->request_time = apr_time_now();
+    r->method = method;
+    r->method_number = !strcmp(method, "POST") ? M_POST : !strcmp(method, "PUT") ? M_PUT : M_GET;
+    r->header_only = !strcmp(method, "HEAD");
+    r->protocol = "HTTP/1.1";
+    r->proto_num = HTTP_VERSION(1, 1);
+    r->hostname = "localhost";
+    r->uri = apr_pstrdup(p, uri);
+    r->unparsed_uri = args ? apr_pstrcat(p, uri, "?", args, NULL) : r->uri;
+    r->args = args ? apr_pstrdup(p, args) : NULL;
+    r->the_request = apr_pstrcat(p, method, " ", r->unparsed_uri, " HTTP/1.1", NULL);
+    r->status = HTTP_OK;
+    r->headers_in = apr_table_make(p, 10);
+    r->headers_out = apr_table_make(p, 10);
+    r->err_headers_out = apr_table_make(p, 5);
+    r->subprocess_env = apr_table_make(p, 10);
+    r->notes = apr_table_make(p, 5);
+    r->request_config = mock_vector(p);
+    r->per_dir_config = c->base_server->lookup_defaults;
+#if AP_SERVER_MINORVERSION_NUMBER > 3
+    r->useragent_addr = c->client_addr;
+    r->useragent_ip = c->client_ip;
+#endif
+    r->input_filters = r->proto_input_filters = c->input_filters;
+    r->output_filters = r->proto_output_filters = c->output_filters;
+    ap_add_output_filter("MOCK_HTTP_HEADER", NULL, r, c);
+    return r;
+}
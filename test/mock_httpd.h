@@ -0,0 +1,118 @@
+/*
+    Mock httpd for in-process tests and benchmarks of the modules
+
+    Implements the part of the httpd API the modules use (config vectors,
+    filter chains, hooks, logging, response output) over real APR, with a
+    server_rec / conn_rec / request_rec fixture. A test includes the module
+    source (static functions become reachable) and links mock_httpd.o.
+
+    The input chain of a mock connection ends in a core filter serving a
+    byte string cut in segments, as reads from the socket would return it
+    (SPECULATIVE, READBYTES, GETLINE, blocking or not). The output chain
+    ends in a sink counting bytes.
+
+    = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef MOCK_HTTPD_H
+#define MOCK_HTTPD_H
+
+#include "httpd.h"
+#include "http_config.h"
+#include "util_filter.h"
+#include "apr_pools.h"
+#include "apr_network_io.h"
+
+#define MOCK_MODULES 16   // config vector size (module_index 0 is core)
+#define MOCK_SEGMENTS 64  // cuts of a mock input stream
+
+/*
+ * Counters of the mock (allocations are counted for the whole process)
+ */
+typedef struct {
+    apr_uint64_t pallocs;       // apr_palloc calls
+    apr_uint64_t palloc_bytes;
+    apr_uint64_t bucket_allocs; // apr_bucket_alloc calls
+    apr_uint64_t out_bytes;     // bytes reaching the output sink
+    apr_uint64_t out_eos;       // EOS buckets reaching the output sink
+    apr_uint64_t in_reads;      // calls of the core input filter
+} mock_counters;
+
+extern mock_counters mock_count;
+
+/**
+ * Initialize the mock (once, before anything else)
+ */
+void mock_init(apr_pool_t *p);
+
+/**
+ * Register module: index, per-server config of the server, default
+ * per-dir config, register_hooks (filters)
+ */
+void mock_module(module *m);
+
+/**
+ * The server (main server, no vhosts)
+ */
+server_rec *mock_server(void);
+
+/**
+ * Listening port (ap_listeners)
+ */
+void mock_listen(apr_port_t port);
+
+/**
+ * cmd_parms for a directive of the main server (cmd->pool is pconf)
+ */
+cmd_parms *mock_cmd(void *info);
+
+/**
+ * New connection on a pool of its own (destroy the pool to close it)
+ */
+conn_rec *mock_conn(apr_pool_t *p, const char *client_ip, apr_port_t client_port, apr_port_t local_port);
+
+/**
+ * Socket pair: returns the server side as apr_socket_t (also the core
+ * conn_config of c), *peer is the client side file descriptor
+ */
+apr_socket_t *mock_socket(conn_rec *c, int *peer);
+
+/**
+ * Bytes the client sends on c, cut after each offset in cuts (ncuts
+ * offsets, increasing). With eagain, a non-blocking read gets APR_EAGAIN
+ * once before each segment.
+ */
+void mock_input(conn_rec *c, const char *data, apr_size_t len, const apr_size_t *cuts, int ncuts, int eagain);
+
+/**
+ * Request on c (request line fields, empty tables, default per-dir config)
+ */
+request_rec *mock_request(conn_rec *c, const char *method, const char *uri, const char *args);
+
+/**
+ * First free byte of the active block of pool p (nothing allocated)
+ */
+char *mock_pool_mark(apr_pool_t *p);
+
+/**
+ * Bytes allocated from p since mark, -1 if p moved to another block
+ */
+apr_ssize_t mock_pool_used(apr_pool_t *p, const char *mark);
+
+/**
+ * Monotonic clock (nsec)
+ */
+apr_uint64_t mock_nsec(void);
+
+#endif /* MOCK_HTTPD_H */
@@ -0,0 +1,133 @@
+/*
+    Offline decoder of the mod_myfixip trace segment (RewriteIPTrace)
+
+    Prints the same per-connection timelines as the myfixip-trace handler
+    from a raw dump of the segment, or from the live segment attached by
+    name (only when APR could not create it anonymously and fell back to
+    logs/mod_myfixip.trace under ServerRoot):
+
+      $ curl -s 'http://127.0.0.1/myfixip-trace?raw' > trace.bin
+      $ ./test/myfixip_trace [-c conn] trace.bin
+      $ ./test/myfixip_trace [-c conn] -s /usr/local/apache2/logs/mod_myfixip.trace
+
+    The dump must come from a module built with the same source (layout of
+    the records) on the same architecture.
+
+    = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "../mod_myfixip.c"
+#include "mock_httpd.h"
+
+#include <stdio.h>
+#include "apr_file_io.h"
+
+static void trace_out_file(void *data, const char *line)
+{
+    fputs(line, (FILE *) data);
+}
+
+/**
+ * Header of segment matches its size and the record layout of this build
+ */
+static const char *trace_valid(const my_trace *t, apr_size_t size)
+{
+    if (size < APR_ALIGN_DEFAULT(sizeof(my_trace))) {
+        return "too short for a trace segment";
+    }
+    if (!t->size || (t->size & (t->size - 1)) || !t->nslots) {
+        return "bad header (records per ring, children)";
+    }
+    if (t->ring_bytes != APR_ALIGN_DEFAULT(APR_OFFSETOF(my_trace_ring, rec) + t->size * sizeof(my_trace_rec))) {
+        return "ring size does not match this build (other version or architecture)";
+    }
+    if (trace_bytes(t) != size) {
+        return "size does not match header (truncated dump?)";
+    }
+    return NULL;
+}
+
+int main(int argc, const char *const *argv)
+{
+    apr_pool_t *p;
+    const my_trace *t;
+    const char *path = NULL, *err;
+    apr_size_t size;
+    trace_entry *all;
+    apr_uint32_t n;
+    long conn = -1;
+    int i, attach = 0;
+    apr_status_t rv;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    apr_pool_create(&p, NULL);
+    mock_init(p);
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-c") && (i + 1 < argc)) {
+            conn = atol(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-s")) {
+            attach = 1;
+        }
+        else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [-c conn] <dump> | -s <shm file>\n", argv[0]);
+        return 2;
+    }
+
+    if (attach) {
+        apr_shm_t *shm;
+        if ((rv = apr_shm_attach(&shm, path, p)) != APR_SUCCESS) {
+            char buf[120];
+            fprintf(stderr, "%s: %s\n", path, apr_strerror(rv, buf, sizeof(buf)));
+            return 1;
+        }
+        t = apr_shm_baseaddr_get(shm);
+        size = apr_shm_size_get(shm);
+        // A name based segment may be larger than asked for
+        if ((size >= sizeof(my_trace)) && (trace_bytes(t) <= size)) {
+            size = trace_bytes(t);
+        }
+    }
+    else {
+        apr_file_t *f;
+        apr_finfo_t finfo;
+        void *buf;
+        if (((rv = apr_file_open(&f, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, p)) != APR_SUCCESS)
+            || ((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f)) != APR_SUCCESS)
+            || ((rv = apr_file_read_full(f, buf = apr_palloc(p, (apr_size_t) finfo.size + 1), (apr_size_t) finfo.size, &size)) != APR_SUCCESS)) {
+            char msg[120];
+            fprintf(stderr, "%s: %s\n", path, apr_strerror(rv, msg, sizeof(msg)));
+            return 1;
+        }
+        apr_file_close(f);
+        t = buf;
+    }
+    if ((err = trace_valid(t, size)) != NULL) {
+        fprintf(stderr, "%s: %s\n", path, err);
+        return 1;
+    }
+
+    all = apr_palloc(p, t->nslots * t->size * sizeof(trace_entry));
+    n = trace_collect(t, conn, all);
+    trace_print(t, all, n, trace_out_file, stdout);
+
+    apr_pool_destroy(p);
+    apr_terminate();
+    return 0;
+}